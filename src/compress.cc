@@ -0,0 +1,185 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+//#define DEBUGTAG "Compress"
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+/* Shortest match worth encoding.  Matches are found by hashing this
+ * many bytes. */
+#define LZ_MIN_MATCH 4
+/* Largest back-reference distance representable in a sequence. */
+#define LZ_MAX_OFFSET 0xffff
+/* log2 of the number of match-finder hash table entries.  16K
+ * entries keeps the table in L1/L2 while still finding most matches
+ * in trace data. */
+#define LZ_HASH_BITS 14
+/* Token nibble value that means "length continues". */
+#define LZ_RUN_MASK 15
+
+static uint32_t read32(const byte* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(const byte* p)
+{
+	return (read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static byte* put_length(byte* op, size_t len)
+{
+	len -= LZ_RUN_MASK;
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static bool get_length(const byte** ip, const byte* iend, size_t* len)
+{
+	byte b;
+	do {
+		if (*ip >= iend || *len > SIZE_MAX / 2) {
+			return false;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (255 == b);
+	return true;
+}
+
+static byte* put_literals(byte* op, byte* token,
+			  const byte* lit, size_t lit_len)
+{
+	*token = MIN(lit_len, (size_t)LZ_RUN_MASK) << 4;
+	if (lit_len >= LZ_RUN_MASK) {
+		op = put_length(op, lit_len);
+	}
+	memcpy(op, lit, lit_len);
+	return op + lit_len;
+}
+
+size_t lz_compress_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+size_t lz_compress(const byte* in, size_t len, byte* out)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	const byte* ip = in;
+	const byte* anchor = in;
+	const byte* end = in + len;
+	byte* op = out;
+
+	if (len >= LZ_MIN_MATCH) {
+		const byte* match_limit = end - LZ_MIN_MATCH;
+		while (ip <= match_limit) {
+			uint32_t h = hash4(ip);
+			const byte* ref = in + table[h];
+			table[h] = ip - in;
+			if (!(ref < ip && ip - ref <= LZ_MAX_OFFSET
+			      && read32(ref) == read32(ip))) {
+				// Skip ahead faster the longer we go
+				// without finding a match, so that
+				// incompressible data (already
+				// compressed files, random bytes)
+				// costs little more than a copy.
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			const byte* mp = ip + LZ_MIN_MATCH;
+			const byte* rp = ref + LZ_MIN_MATCH;
+			while (mp < end && *mp == *rp) {
+				++mp;
+				++rp;
+			}
+
+			byte* token = op++;
+			op = put_literals(op, token, anchor, ip - anchor);
+			size_t offset = ip - ref;
+			*op++ = offset & 0xff;
+			*op++ = offset >> 8;
+			size_t match_len = (mp - ip) - LZ_MIN_MATCH;
+			*token |= MIN(match_len, (size_t)LZ_RUN_MASK);
+			if (match_len >= LZ_RUN_MASK) {
+				op = put_length(op, match_len);
+			}
+
+			ip = anchor = mp;
+		}
+	}
+
+	// The final sequence carries the trailing literals, if any,
+	// and no match.
+	byte* token = op++;
+	op = put_literals(op, token, anchor, end - anchor);
+	return op - out;
+}
+
+bool lz_decompress(const byte* in, size_t in_len, byte* out, size_t out_len)
+{
+	const byte* ip = in;
+	const byte* iend = in + in_len;
+	byte* op = out;
+	byte* oend = out + out_len;
+
+	while (ip < iend) {
+		byte token = *ip++;
+
+		size_t lit_len = token >> 4;
+		if (LZ_RUN_MASK == lit_len && !get_length(&ip, iend, &lit_len)) {
+			return false;
+		}
+		if (lit_len > size_t(iend - ip) || lit_len > size_t(oend - op)) {
+			return false;
+		}
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+		if (op == oend) {
+			return ip == iend;
+		}
+
+		if (iend - ip < 2) {
+			return false;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t match_len = token & LZ_RUN_MASK;
+		if (LZ_RUN_MASK == match_len
+		    && !get_length(&ip, iend, &match_len)) {
+			return false;
+		}
+		match_len += LZ_MIN_MATCH;
+		if (0 == offset || offset > size_t(op - out)
+		    || match_len > size_t(oend - op)) {
+			return false;
+		}
+		const byte* ref = op - offset;
+		if (offset >= match_len) {
+			memcpy(op, ref, match_len);
+			op += match_len;
+		} else {
+			// Overlapping match, e.g. a run of one
+			// repeated byte.  Copy forward bytewise so
+			// that the copy sees its own output.
+			while (match_len--) {
+				*op++ = *ref++;
+			}
+		}
+	}
+	return op == oend;
+}
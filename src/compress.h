@@ -0,0 +1,47 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#ifndef RR_COMPRESS_H_
+#define RR_COMPRESS_H_
+
+#include <stddef.h>
+
+#include "types.h"
+
+/**
+ * A small LZ77-class block codec, in the style of LZ4.  It trades
+ * compression ratio for speed: the recorder compresses every trace
+ * block on the tracer thread, so compression must cost much less
+ * than the ptrace round-trips that generated the data.
+ *
+ * A compressed block is a sequence of "sequences".  Each sequence is
+ * a token byte whose high nibble is the number of literal bytes that
+ * follow and whose low nibble is the length of the following match,
+ * minus |LZ_MIN_MATCH|.  A nibble value of 15 means that the length
+ * continues in following bytes, each adding up to 255, until a byte
+ * other than 255 is seen.  The literals are followed by a 16-bit
+ * little-endian match offset and then the extended match length, if
+ * any.  The last sequence of a block has only literals.
+ */
+
+/**
+ * Return the maximum number of bytes that |lz_compress()| can
+ * produce for |len| bytes of input.
+ */
+size_t lz_compress_bound(size_t len);
+
+/**
+ * Compress the |len| bytes at |in| into |out|, which must have room
+ * for at least |lz_compress_bound(len)| bytes.  Return the number of
+ * bytes written to |out|.
+ */
+size_t lz_compress(const byte* in, size_t len, byte* out);
+
+/**
+ * Decompress the |in_len| bytes at |in| into exactly |out_len| bytes
+ * at |out|.  Return false if |in| is malformed, in which case the
+ * contents of |out| are unspecified.  Malformed input never causes
+ * reads or writes outside of the given buffers.
+ */
+bool lz_decompress(const byte* in, size_t in_len, byte* out, size_t out_len);
+
+#endif /* RR_COMPRESS_H_ */
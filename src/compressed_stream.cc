@@ -0,0 +1,893 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+//#define DEBUGTAG "CompressedStream"
+
+#include "compressed_stream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "compress.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+/* No legitimate block is larger than this; anything claiming to be is
+ * corrupt. */
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+string
+segment_file_path(const string& filename, uint32_t segment)
+{
+	if (0 == segment) {
+		return filename;
+	}
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), ".%04u", segment);
+	return filename + suffix;
+}
+
+/**
+ * Write all |size| bytes at |data| to |fd|.  Return false on error.
+ */
+static bool write_all(int fd, const byte* data, size_t size)
+{
+	while (size > 0) {
+		ssize_t nwritten = ::write(fd, data, size);
+		if (0 > nwritten && EINTR == errno) {
+			continue;
+		}
+		if (0 >= nwritten) {
+			return false;
+		}
+		data += nwritten;
+		size -= nwritten;
+	}
+	return true;
+}
+
+/**
+ * Start a thread running |fn(arg)|, with all signals blocked: signals
+ * are meant for the tracer thread.
+ */
+static pthread_t start_thread(void* (*fn)(void*), void* arg,
+			      const char* what)
+{
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	int err = pthread_create(&thread, nullptr, fn, arg);
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+	if (err) {
+		FATAL() <<"Failed to start "<< what <<" thread";
+	}
+	return thread;
+}
+
+WriterThread::WriterThread()
+	: head(0)
+	, tail(0)
+	, started(false)
+{
+	sem_init(&filled_slots, 0, 0);
+	sem_init(&empty_slots, 0, QUEUE_LENGTH);
+	sem_init(&flushed, 0, 0);
+}
+
+WriterThread::~WriterThread()
+{
+	if (started) {
+		vector<byte> none;
+		push(EXIT, -1, none, nullptr);
+		pthread_join(thread, nullptr);
+	}
+	sem_destroy(&filled_slots);
+	sem_destroy(&empty_slots);
+	sem_destroy(&flushed);
+}
+
+void
+WriterThread::write(int fd, vector<byte>& data, atomic<bool>* error)
+{
+	if (!started) {
+		thread = start_thread(thread_main, this, "trace writer");
+		started = true;
+	}
+	push(WRITE, fd, data, error);
+}
+
+void
+WriterThread::close(int fd)
+{
+	if (!started) {
+		::close(fd);
+		return;
+	}
+	vector<byte> none;
+	push(CLOSE, fd, none, nullptr);
+}
+
+void
+WriterThread::flush()
+{
+	if (!started) {
+		return;
+	}
+	vector<byte> none;
+	push(FLUSH, -1, none, nullptr);
+	while (0 > sem_wait(&flushed) && EINTR == errno);
+}
+
+void
+WriterThread::push(RequestType type, int fd, vector<byte>& data,
+		   atomic<bool>* error)
+{
+	// This is where backpressure happens: if the writer thread
+	// has fallen |QUEUE_LENGTH| blocks behind, wait for it.
+	while (0 > sem_wait(&empty_slots) && EINTR == errno);
+	Request& r = queue[head];
+	r.type = type;
+	r.fd = fd;
+	r.error = error;
+	// The slot's old buffer was written out already; hand it
+	// back for reuse.
+	swap(r.data, data);
+	data.clear();
+	head = (head + 1) % QUEUE_LENGTH;
+	sem_post(&filled_slots);
+}
+
+/*static*/ void*
+WriterThread::thread_main(void* arg)
+{
+	static_cast<WriterThread*>(arg)->run();
+	return nullptr;
+}
+
+void
+WriterThread::run()
+{
+	while (true) {
+		while (0 > sem_wait(&filled_slots) && EINTR == errno);
+		Request& r = queue[tail];
+		tail = (tail + 1) % QUEUE_LENGTH;
+		RequestType type = r.type;
+		if (WRITE == type && !*r.error
+		    && !write_all(r.fd, r.data.data(), r.data.size())) {
+			*r.error = true;
+		}
+		if (CLOSE == type) {
+			::close(r.fd);
+		}
+		sem_post(&empty_slots);
+		if (EXIT == type) {
+			return;
+		}
+		if (FLUSH == type) {
+			sem_post(&flushed);
+		}
+	}
+}
+
+CompressedWriter::CompressedWriter(const string& filename,
+				   WriterThread* thread,
+				   uint64_t segment_size, size_t block_size)
+	: filename(filename)
+	, segment(0)
+	, fd(-1)
+	, thread(thread)
+	, file_offset(0)
+	, total_bytes(0)
+	, segment_size(segment_size)
+	, first_segment(0)
+	, block_size(block_size)
+	, buffer(new byte[block_size])
+	, buffer_len(0)
+	, error(false)
+{
+	assert(block_size <= MAX_BLOCK_SIZE);
+	open_segment();
+}
+
+CompressedWriter::~CompressedWriter()
+{
+	flush();
+	if (thread) {
+		// |fd| has to stay open until the queued writes to it
+		// are done.
+		thread->flush();
+	}
+	if (0 <= fd) {
+		close(fd);
+	}
+}
+
+void
+CompressedWriter::open_segment()
+{
+	string path = segment_file_path(filename, segment);
+	fd = open(path.c_str(),
+		  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_LARGEFILE,
+		  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+	file_offset = 0;
+	if (0 > fd) {
+		LOG(error) <<"Failed to open "<< path;
+		error = true;
+	}
+}
+
+void
+CompressedWriter::close_segment()
+{
+	if (thread) {
+		// Queued writes to |fd| may still be pending.
+		thread->close(fd);
+	} else {
+		close(fd);
+	}
+	fd = -1;
+}
+
+void
+CompressedWriter::discard_segments_before(uint32_t first)
+{
+	assert(first <= segment);
+	for (; first_segment < first; ++first_segment) {
+		string path = segment_file_path(filename, first_segment);
+		// Pending writes to the segment, if any, are harmless:
+		// they land in the unlinked file.
+		if (unlink(path.c_str()) && ENOENT != errno) {
+			LOG(warn) <<"Failed to discard "<< path;
+		}
+	}
+}
+
+/**
+ * Return true iff the block at |a| comes before the block at |b| in
+ * the stream.
+ */
+static bool block_before(const CompressedPosition& a,
+			 const CompressedPosition& b)
+{
+	return a.segment < b.segment
+		|| (a.segment == b.segment && a.block_offset < b.block_offset);
+}
+
+bool
+CompressedWriter::matches(const CompressedPosition& begin,
+			  const CompressedPosition& end,
+			  const void* data, size_t size)
+{
+	if (begin.segment == segment && begin.block_offset == file_offset) {
+		// Still in the block being filled.
+		return begin.offset_in_block + size <= buffer_len
+			&& !memcmp(&buffer[begin.offset_in_block], data, size);
+	}
+	if (begin.segment < first_segment || error) {
+		return false;
+	}
+	// The last byte is in |end|'s block, or in the one before it
+	// if that's where |end| starts.  Unless that block is older
+	// than every block that may still be queued, we'd have to
+	// wait for it.
+	CompressedPosition unwritten =
+		queued_blocks.empty() ? tell() : queued_blocks.front();
+	if (end.offset_in_block > 0 ? !block_before(end, unwritten)
+	    : block_before(unwritten, end)) {
+		return false;
+	}
+	if (!reader) {
+		reader.reset(new CompressedReader(filename));
+	}
+	reader->seek(begin);
+	const byte* p;
+	if (!reader->read_view(size, &p)) {
+		// Start over with a fresh reader next time.
+		reader = nullptr;
+		return false;
+	}
+	return !memcmp(p, data, size);
+}
+
+void
+CompressedWriter::write(const void* data, size_t size)
+{
+	const byte* p = static_cast<const byte*>(data);
+	if (size <= block_size && buffer_len + size > block_size) {
+		write_block();
+	}
+	while (size > 0) {
+		size_t n = MIN(size, block_size - buffer_len);
+		memcpy(&buffer[buffer_len], p, n);
+		buffer_len += n;
+		p += n;
+		size -= n;
+		if (buffer_len == block_size) {
+			write_block();
+		}
+	}
+}
+
+void
+CompressedWriter::write_in_place(size_t size, const Filler& fill)
+{
+	if (size <= block_size && buffer_len + size > block_size) {
+		write_block();
+	}
+	size_t offset = 0;
+	while (offset < size) {
+		size_t n = MIN(size - offset, block_size - buffer_len);
+		fill(&buffer[buffer_len], offset, n);
+		buffer_len += n;
+		offset += n;
+		if (buffer_len == block_size) {
+			write_block();
+		}
+	}
+}
+
+void
+CompressedWriter::flush()
+{
+	write_block();
+}
+
+void
+CompressedWriter::write_block()
+{
+	if (0 == buffer_len || error) {
+		buffer_len = 0;
+		return;
+	}
+
+	struct block_header header;
+	header.uncompressed_length = buffer_len;
+	compressed.resize(sizeof(header) + lz_compress_bound(buffer_len));
+	byte* payload = compressed.data() + sizeof(header);
+	size_t nbytes = lz_compress(buffer.get(), buffer_len, payload);
+	if (nbytes >= buffer_len) {
+		nbytes = buffer_len;
+		memcpy(payload, buffer.get(), nbytes);
+	}
+	header.compressed_length = nbytes;
+	memcpy(compressed.data(), &header, sizeof(header));
+	compressed.resize(sizeof(header) + nbytes);
+	buffer_len = 0;
+
+	// The block's offset is known now, even if it won't be
+	// written for a while.
+	CompressedPosition block(segment, file_offset);
+	file_offset += compressed.size();
+	total_bytes += compressed.size();
+	if (thread) {
+		thread->write(fd, compressed, &error);
+		queued_blocks.push_back(block);
+		if (queued_blocks.size() > WriterThread::QUEUE_LENGTH) {
+			queued_blocks.pop_front();
+		}
+	} else if (!write_all(fd, compressed.data(), compressed.size())) {
+		LOG(error) <<"Failed to write block to "<< filename;
+		error = true;
+	}
+
+	if (segment_size && file_offset >= segment_size && !error) {
+		close_segment();
+		++segment;
+		open_segment();
+	}
+}
+
+ReadAheadThread::ReadAheadThread()
+	: exiting(false)
+	, started(false)
+{
+	pthread_mutex_init(&lock, nullptr);
+	pthread_cond_init(&cond, nullptr);
+}
+
+ReadAheadThread::~ReadAheadThread()
+{
+	if (started) {
+		pthread_mutex_lock(&lock);
+		exiting = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		pthread_join(thread, nullptr);
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void
+ReadAheadThread::request(CompressedReader* r)
+{
+	if (!started) {
+		thread = start_thread(thread_main, this, "trace read-ahead");
+		started = true;
+	}
+	pthread_mutex_lock(&lock);
+	r->ahead_pending = true;
+	queue.push_back(r);
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void
+ReadAheadThread::wait(CompressedReader* r, bool cancel)
+{
+	pthread_mutex_lock(&lock);
+	if (cancel) {
+		auto it = find(queue.begin(), queue.end(), r);
+		if (it != queue.end()) {
+			queue.erase(it);
+			r->ahead_pending = false;
+		}
+	}
+	while (r->ahead_pending) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*static*/ void*
+ReadAheadThread::thread_main(void* arg)
+{
+	static_cast<ReadAheadThread*>(arg)->run();
+	return nullptr;
+}
+
+void
+ReadAheadThread::run()
+{
+	pthread_mutex_lock(&lock);
+	while (true) {
+		while (queue.empty() && !exiting) {
+			pthread_cond_wait(&cond, &lock);
+		}
+		if (exiting) {
+			break;
+		}
+		CompressedReader* r = queue.front();
+		queue.pop_front();
+		pthread_mutex_unlock(&lock);
+
+		r->ahead_status =
+			CompressedReader::read_block(r->ahead_file->fd,
+						     r->ahead_offset,
+						     *r->ahead,
+						     r->ahead_compressed);
+
+		pthread_mutex_lock(&lock);
+		r->ahead_pending = false;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+CompressedReader::File::~File()
+{
+	if (0 <= fd) {
+		close(fd);
+	}
+}
+
+CompressedReader::Block::Block()
+	: segment(0)
+	, offset(0)
+	, next_offset(0)
+	, data(nullptr)
+	, size(0)
+	, mapping(nullptr)
+	, mapping_len(0)
+{
+}
+
+CompressedReader::Block::~Block()
+{
+	clear();
+}
+
+void
+CompressedReader::Block::clear()
+{
+	if (mapping) {
+		munmap(mapping, mapping_len);
+		mapping = nullptr;
+		mapping_len = 0;
+	}
+	decompressed.clear();
+	data = nullptr;
+	size = 0;
+}
+
+CompressedReader::CompressedReader(const string& filename,
+				   bool may_start_later)
+	: filename(filename)
+	, block(new Block())
+	, buffer_pos(0)
+	, prev_block(new Block())
+	, error(false)
+	, read_ahead(nullptr)
+	, ahead_segment(0)
+	, ahead_offset(0)
+	, ahead_status(BLOCK_EOF)
+	, ahead_requested(false)
+	, ahead_pending(false)
+{
+	// Later segments are opened when they're reached.
+	if (!may_start_later && !get_file(0)) {
+		LOG(error) <<"Failed to open "<< filename;
+		error = true;
+	}
+}
+
+CompressedReader::CompressedReader(const CompressedReader& other)
+	: filename(other.filename)
+	, files(other.files)
+	, block(other.block)
+	, buffer_pos(other.buffer_pos)
+	, prev_block(other.prev_block)
+	, error(other.error)
+	, read_ahead(nullptr)
+	, ahead_segment(0)
+	, ahead_offset(0)
+	, ahead_status(BLOCK_EOF)
+	, ahead_requested(false)
+	, ahead_pending(false)
+{
+}
+
+CompressedReader::~CompressedReader()
+{
+	if (ahead_requested) {
+		read_ahead->wait(this, true);
+	}
+}
+
+/**
+ * Return the file of |segment|, opening it if necessary, or null if
+ * there's no such segment.
+ */
+CompressedReader::File*
+CompressedReader::get_file(uint32_t segment)
+{
+	if (segment >= files.size()) {
+		files.resize(segment + 1);
+	}
+	if (!files[segment]) {
+		string path = segment_file_path(filename, segment);
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+		if (0 > fd) {
+			return nullptr;
+		}
+		files[segment] = make_shared<File>(fd);
+	}
+	return files[segment].get();
+}
+
+/**
+ * We've read past the end of |segment|.  Tell the kernel we're done
+ * with its pages, and close it; it's reopened if we seek back.
+ */
+void
+CompressedReader::drop_segment(uint32_t segment)
+{
+	if (segment >= files.size() || !files[segment]) {
+		return;
+	}
+	posix_fadvise64(files[segment]->fd, 0, 0, POSIX_FADV_DONTNEED);
+	files[segment] = nullptr;
+}
+
+/*static*/ void
+CompressedReader::make_unshared(shared_ptr<Block>& b)
+{
+	if (!b || b.use_count() > 1) {
+		b.reset(new Block());
+	}
+}
+
+void
+CompressedReader::set_read_ahead(ReadAheadThread* thread)
+{
+	assert(!read_ahead);
+	read_ahead = thread;
+	start_read_ahead();
+}
+
+static bool read_all(int fd, void* buf, size_t size, uint64_t offset)
+{
+	byte* p = static_cast<byte*>(buf);
+	while (size > 0) {
+		ssize_t nread = pread64(fd, p, size, offset);
+		if (0 > nread && EINTR == errno) {
+			continue;
+		}
+		if (0 >= nread) {
+			return false;
+		}
+		p += nread;
+		size -= nread;
+		offset += nread;
+	}
+	return true;
+}
+
+/**
+ * Read the block at file |offset| of |fd| into |b|, using
+ * |compressed| as scratch space.  This touches nothing else, so it's
+ * safe to run on the read-ahead thread.
+ */
+/*static*/ CompressedReader::BlockStatus
+CompressedReader::read_block(int fd, uint64_t offset, Block& b,
+			     vector<byte>& compressed)
+{
+	b.clear();
+
+	struct block_header header;
+	ssize_t nread = pread64(fd, &header, sizeof(header), offset);
+	if (0 == nread) {
+		return BLOCK_EOF;
+	}
+	if (nread != sizeof(header)
+	    || 0 == header.uncompressed_length
+	    || header.uncompressed_length > MAX_BLOCK_SIZE
+	    || header.compressed_length > header.uncompressed_length) {
+		return BLOCK_CORRUPT;
+	}
+
+	uint64_t payload_offset = offset + sizeof(header);
+	bool ok = true;
+	if (header.compressed_length == header.uncompressed_length) {
+		// Stored blocks can be used straight from the page
+		// cache.
+		uint64_t map_offset = payload_offset & ~uint64_t(page_size() - 1);
+		size_t map_len = payload_offset - map_offset
+				 + header.uncompressed_length;
+		void* p = mmap64(nullptr, map_len, PROT_READ, MAP_PRIVATE,
+				 fd, map_offset);
+		if (MAP_FAILED != p) {
+			b.mapping = p;
+			b.mapping_len = map_len;
+			b.data = (const byte*)p + (payload_offset - map_offset);
+		} else {
+			b.decompressed.resize(header.uncompressed_length);
+			ok = read_all(fd, b.decompressed.data(),
+				      b.decompressed.size(), payload_offset);
+			b.data = b.decompressed.data();
+		}
+	} else {
+		b.decompressed.resize(header.uncompressed_length);
+		compressed.resize(header.compressed_length);
+		ok = read_all(fd, compressed.data(), compressed.size(),
+			      payload_offset)
+		     && lz_decompress(compressed.data(), compressed.size(),
+				      b.decompressed.data(),
+				      b.decompressed.size());
+		b.data = b.decompressed.data();
+	}
+	if (!ok) {
+		b.clear();
+		return BLOCK_IO_ERROR;
+	}
+	b.size = header.uncompressed_length;
+	b.offset = offset;
+	b.next_offset = payload_offset + header.compressed_length;
+	return BLOCK_OK;
+}
+
+/**
+ * Make the block at |offset| of |segment| current.  If |offset| is
+ * the end of the segment, the first block of the following segment
+ * is loaded instead.  Return false if there's no block there, either
+ * because that's the end of the stream or because the file is
+ * corrupt.  The current block is unchanged in that case.
+ */
+bool
+CompressedReader::load_block(uint32_t segment, uint64_t offset)
+{
+	if (error) {
+		return false;
+	}
+	if (segment == prev_block->segment && offset == prev_block->offset
+	    && prev_block->size > 0) {
+		swap(block, prev_block);
+		buffer_pos = 0;
+		start_read_ahead();
+		return true;
+	}
+	if (take_read_ahead(segment, offset)) {
+		start_read_ahead();
+		return true;
+	}
+
+	// Read the new block into |prev_block|; it becomes current
+	// below, and the current block becomes the previous one.
+	make_unshared(prev_block);
+	bool loaded = false;
+	while (!loaded) {
+		File* f = get_file(segment);
+		if (!f) {
+			return false;
+		}
+		switch (read_block(f->fd, offset, *prev_block, compressed)) {
+		case BLOCK_OK:
+			loaded = true;
+			break;
+		case BLOCK_EOF:
+			if (!get_file(segment + 1)) {
+				return false;
+			}
+			// We're done with this segment; move on to
+			// the next.
+			drop_segment(segment);
+			++segment;
+			offset = 0;
+			break;
+		case BLOCK_CORRUPT:
+			LOG(error) <<"Corrupt block header at offset "<< offset
+				   <<" of "<< segment_file_path(filename, segment);
+			error = true;
+			return false;
+		case BLOCK_IO_ERROR:
+			LOG(error) <<"Failed to read block at offset "<< offset
+				   <<" of "<< segment_file_path(filename, segment);
+			error = true;
+			return false;
+		}
+	}
+	prev_block->segment = segment;
+
+	swap(block, prev_block);
+	buffer_pos = 0;
+	start_read_ahead();
+	return true;
+}
+
+/**
+ * If the block at |offset| of |segment| was read ahead, make it
+ * current and return true.  Otherwise, drop any read-ahead block.
+ */
+bool
+CompressedReader::take_read_ahead(uint32_t segment, uint64_t offset)
+{
+	if (!ahead_requested) {
+		return false;
+	}
+	// If we're not going where we expected, we don't care about
+	// the read-ahead block anymore.
+	bool wanted = ahead_segment == segment && ahead_offset == offset;
+	read_ahead->wait(this, !wanted);
+	ahead_requested = false;
+	ahead_file = nullptr;
+	if (!wanted || BLOCK_OK != ahead_status) {
+		// Let the synchronous path find and report any
+		// errors.
+		return false;
+	}
+	// The read-ahead block becomes current, the current block
+	// becomes the previous one, and the previous one is recycled
+	// for the next read-ahead.
+	swap(prev_block, ahead);
+	swap(block, prev_block);
+	buffer_pos = 0;
+	return true;
+}
+
+/**
+ * Start reading the block after the current one, unless it's
+ * already on hand.  Read-ahead stays within the current segment;
+ * crossing into the next one is left to |load_block()|.
+ */
+void
+CompressedReader::start_read_ahead()
+{
+	if (!read_ahead || ahead_requested || error
+	    || (block->segment == prev_block->segment
+		&& block->next_offset == prev_block->offset
+		&& prev_block->size > 0)) {
+		return;
+	}
+	File* file = get_file(block->segment);
+	if (!file) {
+		return;
+	}
+	make_unshared(ahead);
+	ahead->segment = block->segment;
+	ahead_file = files[block->segment];
+	ahead_segment = block->segment;
+	ahead_offset = block->next_offset;
+	ahead_requested = true;
+	read_ahead->request(this);
+}
+
+bool
+CompressedReader::at_end()
+{
+	return buffer_pos == block->size
+	       && !load_block(block->segment, block->next_offset);
+}
+
+bool
+CompressedReader::read(void* data, size_t size)
+{
+	return read_or_skip(data, size);
+}
+
+bool
+CompressedReader::read_view(size_t size, const byte** data)
+{
+	if (size > 0 && buffer_pos == block->size
+	    && !load_block(block->segment, block->next_offset)) {
+		error = true;
+		return false;
+	}
+	if (size <= block->size - buffer_pos) {
+		*data = block->data + buffer_pos;
+		buffer_pos += size;
+		return true;
+	}
+	view_scratch.resize(size);
+	*data = view_scratch.data();
+	return read_or_skip(view_scratch.data(), size);
+}
+
+bool
+CompressedReader::skip(size_t size)
+{
+	return read_or_skip(nullptr, size);
+}
+
+/**
+ * Consume |size| bytes of the stream, copying them to |data| unless
+ * it's null.
+ */
+bool
+CompressedReader::read_or_skip(void* data, size_t size)
+{
+	byte* p = static_cast<byte*>(data);
+	while (size > 0) {
+		if (buffer_pos == block->size
+		    && !load_block(block->segment, block->next_offset)) {
+			error = true;
+			return false;
+		}
+		size_t n = MIN(size, block->size - buffer_pos);
+		if (p) {
+			memcpy(p, block->data + buffer_pos, n);
+			p += n;
+		}
+		buffer_pos += n;
+		size -= n;
+	}
+	return true;
+}
+
+void
+CompressedReader::seek(const CompressedPosition& pos)
+{
+	if (pos.segment != block->segment
+	    || pos.block_offset != block->offset || 0 == block->size) {
+		if (!load_block(pos.segment, pos.block_offset)) {
+			// Nothing at |pos|: it's the end of the
+			// file.
+			assert(0 == pos.offset_in_block);
+			make_unshared(block);
+			block->clear();
+			block->segment = pos.segment;
+			block->offset = block->next_offset = pos.block_offset;
+		}
+	}
+	assert(pos.offset_in_block <= block->size);
+	buffer_pos = pos.offset_in_block;
+}
@@ -0,0 +1,476 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#ifndef RR_COMPRESSED_STREAM_H_
+#define RR_COMPRESSED_STREAM_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+/**
+ * Trace files that can grow large are stored as a sequence of
+ * independently-compressed blocks.  Each block is a |block_header|
+ * followed by |compressed_length| bytes of payload.  If
+ * |compressed_length == uncompressed_length|, the payload is stored
+ * verbatim, because compressing it didn't help.  Otherwise the
+ * payload is |lz_compress()|ed.
+ *
+ * Because blocks are independent, readers can seek to any block
+ * without decompressing the blocks before it.
+ */
+struct block_header {
+	uint32_t compressed_length;
+	uint32_t uncompressed_length;
+};
+
+/**
+ * A stream may be split into "segment" files of roughly bounded
+ * size, so that no single trace file grows without bound.  Segment 0
+ * is the file named by the stream's filename, and segment N > 0 is
+ * the file with ".NNNN" appended.  Blocks never span segments.
+ */
+std::string segment_file_path(const std::string& filename,
+			      uint32_t segment);
+
+/**
+ * A position in a compressed stream: the segment and file offset of
+ * the header of the block containing the position, and the offset of
+ * the position within the uncompressed contents of the block.
+ */
+struct CompressedPosition {
+	CompressedPosition(uint32_t segment = 0,
+			   uint64_t block_offset = 0,
+			   uint32_t offset_in_block = 0)
+		: segment(segment)
+		, block_offset(block_offset)
+		, offset_in_block(offset_in_block)
+	{}
+
+	uint32_t segment;
+	uint64_t block_offset;
+	uint32_t offset_in_block;
+};
+
+class CompressedReader;
+
+/**
+ * A thread that performs the file writes of one or more
+ * CompressedWriters, so that their owner doesn't stall on disk I/O.
+ * Completed blocks are handed off through a bounded single-producer
+ * single-consumer queue; all calls must come from the same (producer)
+ * thread.  When the queue is full, the producer blocks until the
+ * writer thread catches up, so queued memory stays bounded.
+ *
+ * The thread is started lazily by the first |write()|, so that
+ * processes fork()d before then don't inherit a running writer.
+ */
+class WriterThread {
+public:
+	/* Number of blocks that may be queued before |write()| blocks.
+	 * With the default block size this bounds queued data to
+	 * about 16MB. */
+	enum { QUEUE_LENGTH = 16 };
+
+	WriterThread();
+	/** Write out everything queued and stop the thread. */
+	~WriterThread();
+
+	/**
+	 * Queue the contents of |data| to be appended to |fd|.  If the
+	 * write fails, |*error| is set.  |data| is exchanged for a
+	 * cleared buffer whose storage can be reused.
+	 */
+	void write(int fd, std::vector<byte>& data, std::atomic<bool>* error);
+
+	/**
+	 * Close |fd| once everything queued for it has been written.
+	 */
+	void close(int fd);
+
+	/**
+	 * Block until everything queued so far has been written.
+	 */
+	void flush();
+
+private:
+	enum RequestType { WRITE, CLOSE, FLUSH, EXIT };
+	struct Request {
+		RequestType type;
+		// For WRITE requests: append |data| to |fd|, and set
+		// |*error| on failure.  For CLOSE requests: close |fd|.
+		int fd;
+		std::vector<byte> data;
+		std::atomic<bool>* error;
+	};
+
+	void push(RequestType type, int fd, std::vector<byte>& data,
+		  std::atomic<bool>* error);
+	static void* thread_main(void* arg);
+	void run();
+
+	Request queue[QUEUE_LENGTH];
+	// Next slot to be filled by the producer, and next slot to be
+	// written by the writer thread.  Each is only touched by one
+	// thread; the semaphores order accesses to the slots.
+	size_t head;
+	size_t tail;
+	// Count of filled slots, and of empty slots.
+	sem_t filled_slots;
+	sem_t empty_slots;
+	// Posted by the writer thread when it reaches a flush
+	// barrier.
+	sem_t flushed;
+	pthread_t thread;
+	bool started;
+
+	WriterThread(const WriterThread&) = delete;
+	WriterThread& operator=(const WriterThread&) = delete;
+};
+
+/**
+ * Buffer data written to a trace file and write it out as compressed
+ * blocks.  Blocks are compressed on the calling thread, and written
+ * by |thread| if one is given.
+ */
+class CompressedWriter {
+public:
+	/* Blocks are this big unless |flush()| cuts them short.  Big
+	 * enough that compression finds plenty of redundancy in
+	 * trace data, small enough that seeking to a random position
+	 * costs little. */
+	enum { DEFAULT_BLOCK_SIZE = 1024 * 1024 };
+
+	/**
+	 * If |segment_size| is nonzero, a new segment is started
+	 * whenever the current one reaches that size.
+	 */
+	CompressedWriter(const std::string& filename,
+			 WriterThread* thread = nullptr,
+			 uint64_t segment_size = 0,
+			 size_t block_size = DEFAULT_BLOCK_SIZE);
+	/** Flush buffered data, wait for it to be written, and close
+	 * the file. */
+	~CompressedWriter();
+
+	/**
+	 * Return true iff no error has occurred opening or writing
+	 * the file.
+	 */
+	bool good() const { return !error; }
+
+	/**
+	 * Append |size| bytes at |data| to the stream.  Writes that
+	 * are no larger than a block are never split across blocks,
+	 * so that readers usually find records contiguous.
+	 */
+	void write(const void* data, size_t size);
+
+	/**
+	 * Produces bytes [offset, offset + size) of some data in
+	 * |dest|.
+	 */
+	typedef std::function<void (byte* dest, size_t offset, size_t size)>
+		Filler;
+	/**
+	 * Like |write()|, but rather than copying the |size| bytes
+	 * from a buffer, have |fill| produce them straight into this
+	 * stream's block buffer.  |fill| is called once for each
+	 * block the data lands in, in order.
+	 */
+	void write_in_place(size_t size, const Filler& fill);
+
+	/**
+	 * Compress and write out whatever is buffered, even if that's
+	 * less than a full block.  If there's a writer thread, the
+	 * data may not have reached the file when this returns; call
+	 * |WriterThread::flush()| for that.
+	 */
+	void flush();
+
+	/**
+	 * Return the position at which the next byte written will be
+	 * found by a CompressedReader.
+	 */
+	CompressedPosition tell() const {
+		return CompressedPosition(segment, file_offset, buffer_len);
+	}
+
+	/**
+	 * Return the number of compressed bytes written to all
+	 * segments so far, including discarded ones.
+	 */
+	uint64_t bytes_written() const { return total_bytes; }
+
+	/**
+	 * Delete the files of all segments before |first|, which
+	 * must not be after the current segment.  Readers must not
+	 * need the data in them anymore.
+	 */
+	void discard_segments_before(uint32_t first);
+
+	/**
+	 * Return true iff the |size| bytes written from |begin| to
+	 * |end| are those at |data|.  Bytes still in the block being
+	 * filled are compared in memory, and bytes that have reached
+	 * the file are read back.  This never waits for |thread|: if
+	 * the bytes may still be queued to be written, return false.
+	 */
+	bool matches(const CompressedPosition& begin,
+		     const CompressedPosition& end,
+		     const void* data, size_t size);
+
+private:
+	void write_block();
+	void open_segment();
+	void close_segment();
+
+	std::string filename;
+	// The current segment, and its file.
+	uint32_t segment;
+	int fd;
+	WriterThread* thread;
+	// Number of bytes written (or queued to be written) to |fd| so
+	// far; the file offset of the block being filled.
+	uint64_t file_offset;
+	uint64_t total_bytes;
+	uint64_t segment_size;
+	// Segments before this have been discarded.
+	uint32_t first_segment;
+	size_t block_size;
+	// Uncompressed data of the block being filled, |buffer_len|
+	// bytes of it so far.  Not a vector, so that space for
+	// |write_in_place()| needn't be initialized first.
+	std::unique_ptr<byte[]> buffer;
+	size_t buffer_len;
+	// The block header and compressed payload of the block being
+	// written out.
+	std::vector<byte> compressed;
+	// The blocks most recently handed to |thread|, oldest first.
+	// It can't have more than |WriterThread::QUEUE_LENGTH|
+	// requests outstanding, so blocks before these have reached
+	// the file.
+	std::deque<CompressedPosition> queued_blocks;
+	// Set by |thread| if a write fails, so atomic.
+	std::atomic<bool> error;
+	// Reads back written data for |matches()|, created on first
+	// use.
+	std::unique_ptr<CompressedReader> reader;
+
+	CompressedWriter(const CompressedWriter&) = delete;
+	CompressedWriter& operator=(const CompressedWriter&) = delete;
+};
+
+/**
+ * A thread that loads the block following the current one of one or
+ * more CompressedReaders, so that by the time a reader gets there,
+ * the block has usually already been read and decompressed.  Each
+ * reader has at most one block read ahead, which bounds the memory
+ * used.  All the readers must be used from the same thread.
+ *
+ * Like WriterThread, the thread is started by the first request.
+ */
+class ReadAheadThread {
+public:
+	ReadAheadThread();
+	/** All readers using this must have been destroyed. */
+	~ReadAheadThread();
+
+private:
+	friend class CompressedReader;
+
+	/** Start loading |r|'s |ahead| block. */
+	void request(CompressedReader* r);
+	/**
+	 * Wait until |r|'s requested block has been loaded.  If
+	 * |cancel|, drop the request instead if it hasn't started
+	 * yet.
+	 */
+	void wait(CompressedReader* r, bool cancel = false);
+
+	static void* thread_main(void* arg);
+	void run();
+
+	// Protects |queue|, |exiting| and the |ahead_pending| flags of
+	// the readers.
+	pthread_mutex_t lock;
+	// Signalled when a request is queued or completed.
+	pthread_cond_t cond;
+	std::deque<CompressedReader*> queue;
+	bool exiting;
+	pthread_t thread;
+	bool started;
+
+	ReadAheadThread(const ReadAheadThread&) = delete;
+	ReadAheadThread& operator=(const ReadAheadThread&) = delete;
+};
+
+/**
+ * Read back a file written by CompressedWriter.  Blocks that were
+ * stored uncompressed are mmap()d rather than copied, and
+ * |read_view()| hands out pointers into the current block, so most
+ * data can be consumed without any copying.
+ *
+ * Copies of a reader share its file descriptor and loaded blocks,
+ * which are never modified once loaded.  So copying is cheap and
+ * makes no syscalls.
+ */
+class CompressedReader {
+public:
+	/**
+	 * Segment 0 of |filename| has to exist, unless
+	 * |may_start_later|: the oldest segments of a ring trace
+	 * have been discarded, and its readers start by seeking past
+	 * them.
+	 */
+	CompressedReader(const std::string& filename,
+			 bool may_start_later = false);
+	/**
+	 * Create another reader of the same file, positioned where
+	 * |other| is.  The two readers are independent afterwards,
+	 * and the copy doesn't read ahead.
+	 */
+	CompressedReader(const CompressedReader& other);
+	~CompressedReader();
+
+	/**
+	 * Return true iff no error has occurred opening or reading
+	 * the file, including attempting to read past its end.
+	 */
+	bool good() const { return !error; }
+
+	/** Return true iff all the data in the stream has been read. */
+	bool at_end();
+
+	/**
+	 * Read exactly |size| bytes into |data|.  Return false and
+	 * mark this reader as bad if that many bytes aren't
+	 * available.
+	 */
+	bool read(void* data, size_t size);
+
+	/**
+	 * Like |read()|, but rather than copying the data, point
+	 * |*data| at it.  The data is only valid until the next call
+	 * on this reader.  Records that don't span blocks (which
+	 * CompressedWriter avoids) are returned in place.
+	 */
+	bool read_view(size_t size, const byte** data);
+
+	/**
+	 * Like |read()|, but discard the data.
+	 */
+	bool skip(size_t size);
+
+	/** Return the current read position. */
+	CompressedPosition tell() const {
+		return CompressedPosition(block->segment, block->offset,
+					  buffer_pos);
+	}
+	/**
+	 * Move the read position to |pos|, which must have been
+	 * returned by |tell()| on a reader of this file.
+	 */
+	void seek(const CompressedPosition& pos);
+	/** Equivalent to seeking to the start of the file. */
+	void rewind() { seek(CompressedPosition()); }
+
+	/**
+	 * Have |thread| load each block before this reader reaches
+	 * it.  |thread| must outlive this.
+	 */
+	void set_read_ahead(ReadAheadThread* thread);
+
+private:
+	friend class ReadAheadThread;
+
+	/** A file descriptor, closed when the last reader drops it. */
+	struct File {
+		File(int fd) : fd(fd) {}
+		~File();
+		int fd;
+	};
+
+	/**
+	 * The uncompressed contents of one block, either mapped from
+	 * the file or decompressed into |decompressed|.  Blocks may
+	 * be shared between copies of a reader, and must only be
+	 * modified while unshared.
+	 */
+	struct Block {
+		Block();
+		~Block();
+		/** Drop the contents of this block. */
+		void clear();
+
+		// Segment containing this block, and the file offset
+		// of the header of this block and of the block
+		// following it.
+		uint32_t segment;
+		uint64_t offset;
+		uint64_t next_offset;
+		const byte* data;
+		size_t size;
+		std::vector<byte> decompressed;
+		void* mapping;
+		size_t mapping_len;
+	};
+
+	enum BlockStatus { BLOCK_OK, BLOCK_EOF, BLOCK_CORRUPT, BLOCK_IO_ERROR };
+	static BlockStatus read_block(int fd, uint64_t offset, Block& b,
+				      std::vector<byte>& compressed);
+	File* get_file(uint32_t segment);
+	void drop_segment(uint32_t segment);
+	bool load_block(uint32_t segment, uint64_t offset);
+	bool take_read_ahead(uint32_t segment, uint64_t offset);
+	void start_read_ahead();
+	bool read_or_skip(void* data, size_t size);
+
+	/** Return an unshared block that can be loaded into. */
+	static void make_unshared(std::shared_ptr<Block>& b);
+
+	std::string filename;
+	// Segment files, opened as needed.  Missing segments are
+	// null.
+	std::vector<std::shared_ptr<File> > files;
+	// The current block, and the read position within it.
+	std::shared_ptr<Block> block;
+	size_t buffer_pos;
+	// The most recently replaced block.  Peeking at the next
+	// record and then seeking back often crosses a block boundary
+	// twice; keeping the old block around avoids reading it
+	// again.
+	std::shared_ptr<Block> prev_block;
+	// Scratch space for reading compressed payloads.
+	std::vector<byte> compressed;
+	// Holds |read_view()| data that spans blocks.
+	std::vector<byte> view_scratch;
+	bool error;
+	// If set, the block at |ahead_offset| of |ahead_file| is read
+	// into |ahead| by |read_ahead|.  While |ahead_pending|,
+	// |ahead|, |ahead_compressed| and |ahead_status| belong to
+	// the read-ahead thread.  |ahead_requested| is set from the
+	// time a request is made until its result is consumed or
+	// dropped.
+	ReadAheadThread* read_ahead;
+	std::shared_ptr<Block> ahead;
+	std::shared_ptr<File> ahead_file;
+	uint32_t ahead_segment;
+	uint64_t ahead_offset;
+	std::vector<byte> ahead_compressed;
+	BlockStatus ahead_status;
+	bool ahead_requested;
+	bool ahead_pending;
+
+	CompressedReader& operator=(const CompressedReader&) = delete;
+};
+
+#endif /* RR_COMPRESSED_STREAM_H_ */
@@ -169,7 +169,7 @@ EmuFs::get_or_create(const struct mmapped_file& mf)
 		it->second->update(mf.stat);
 		return it->second;
 	}
-	auto vf = EmuFile::create(tag, mf.filename, mf.stat);
+	auto vf = EmuFile::create(tag, mf.filename.c_str(), mf.stat);
 	files[id] = vf;
 	return vf;
 }
@@ -36,6 +36,7 @@ Event::Event(EncodedEvent e)
 {
 	switch ((event_type = EventType(e.type))) {
 	case EV_SEGV_RDTSC:
+	case EV_PATCH_RDTSC:
 	case EV_EXIT:
 	case EV_SCHED:
 	case EV_SYSCALLBUF_FLUSH:
@@ -153,6 +154,7 @@ Event::encode() const
 
 	switch (event_type) {
 	case EV_SEGV_RDTSC:
+	case EV_PATCH_RDTSC:
 	case EV_EXIT:
 	case EV_SCHED:
 	case EV_SYSCALLBUF_FLUSH:
@@ -330,6 +332,7 @@ Event::type_name() const
 	CASE(NOOP);
 	CASE(SCHED);
 	CASE(SEGV_RDTSC);
+	CASE(PATCH_RDTSC);
 	CASE(SYSCALLBUF_FLUSH);
 	CASE(SYSCALLBUF_ABORT_COMMIT);
 	CASE(SYSCALLBUF_RESET);
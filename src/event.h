@@ -31,6 +31,9 @@ enum EventType {
 	EV_NOOP,
 	EV_SCHED,
 	EV_SEGV_RDTSC,
+	// rr patched an rdtsc site to call into the syscallbuf lib.
+	// The patched code is saved as raw data.
+	EV_PATCH_RDTSC,
 	EV_SYSCALLBUF_FLUSH,
 	EV_SYSCALLBUF_ABORT_COMMIT,
 	EV_SYSCALLBUF_RESET,
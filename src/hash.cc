@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+//#define DEBUGTAG "Hash"
+
+#include "hash.h"
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+hash128 hash_bytes(const void* data, size_t len)
+{
+	static const uint32_t c1 = 0x239b961b;
+	static const uint32_t c2 = 0xab0e9789;
+	static const uint32_t c3 = 0x38b34ae5;
+	static const uint32_t c4 = 0xa1e38b93;
+
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	size_t nblocks = len / 16;
+	uint32_t h1 = 0, h2 = 0, h3 = 0, h4 = 0;
+
+	for (size_t i = 0; i < nblocks; ++i, p += 16) {
+		uint32_t k[4];
+		memcpy(k, p, sizeof(k));
+
+		k[0] *= c1; k[0] = rotl32(k[0], 15); k[0] *= c2; h1 ^= k[0];
+		h1 = rotl32(h1, 19); h1 += h2; h1 = h1 * 5 + 0x561ccd1b;
+
+		k[1] *= c2; k[1] = rotl32(k[1], 16); k[1] *= c3; h2 ^= k[1];
+		h2 = rotl32(h2, 17); h2 += h3; h2 = h2 * 5 + 0x0bcaa747;
+
+		k[2] *= c3; k[2] = rotl32(k[2], 17); k[2] *= c4; h3 ^= k[2];
+		h3 = rotl32(h3, 15); h3 += h4; h3 = h3 * 5 + 0x96cd1c35;
+
+		k[3] *= c4; k[3] = rotl32(k[3], 18); k[3] *= c1; h4 ^= k[3];
+		h4 = rotl32(h4, 13); h4 += h1; h4 = h4 * 5 + 0x32ac3b17;
+	}
+
+	// Mix in the last |len % 16| bytes.
+	uint32_t k1 = 0, k2 = 0, k3 = 0, k4 = 0;
+	switch (len & 15) {
+	case 15: k4 ^= p[14] << 16;
+	case 14: k4 ^= p[13] << 8;
+	case 13: k4 ^= p[12];
+		k4 *= c4; k4 = rotl32(k4, 18); k4 *= c1; h4 ^= k4;
+	case 12: k3 ^= p[11] << 24;
+	case 11: k3 ^= p[10] << 16;
+	case 10: k3 ^= p[9] << 8;
+	case 9: k3 ^= p[8];
+		k3 *= c3; k3 = rotl32(k3, 17); k3 *= c4; h3 ^= k3;
+	case 8: k2 ^= p[7] << 24;
+	case 7: k2 ^= p[6] << 16;
+	case 6: k2 ^= p[5] << 8;
+	case 5: k2 ^= p[4];
+		k2 *= c2; k2 = rotl32(k2, 16); k2 *= c3; h2 ^= k2;
+	case 4: k1 ^= p[3] << 24;
+	case 3: k1 ^= p[2] << 16;
+	case 2: k1 ^= p[1] << 8;
+	case 1: k1 ^= p[0];
+		k1 *= c1; k1 = rotl32(k1, 15); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len; h2 ^= len; h3 ^= len; h4 ^= len;
+
+	h1 += h2; h1 += h3; h1 += h4;
+	h2 += h1; h3 += h1; h4 += h1;
+
+	h1 = fmix32(h1);
+	h2 = fmix32(h2);
+	h3 = fmix32(h3);
+	h4 = fmix32(h4);
+
+	h1 += h2; h1 += h3; h1 += h4;
+	h2 += h1; h3 += h1; h4 += h1;
+
+	hash128 ret = { { h1, h2, h3, h4 } };
+	return ret;
+}
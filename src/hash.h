@@ -0,0 +1,33 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#ifndef RR_HASH_H_
+#define RR_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * A 128-bit content hash, wide enough that distinct recorded
+ * payloads can be assumed never to collide.
+ */
+struct hash128 {
+	uint32_t h[4];
+
+	bool operator==(const hash128& other) const {
+		return !memcmp(h, other.h, sizeof(h));
+	}
+	bool operator<(const hash128& other) const {
+		return memcmp(h, other.h, sizeof(h)) < 0;
+	}
+};
+
+/**
+ * Return the hash of the |len| bytes at |data|.  This is
+ * MurmurHash3_x86_128, which is fast on 32-bit x86 but not
+ * cryptographically strong; it's not meant to resist deliberate
+ * collisions.
+ */
+hash128 hash_bytes(const void* data, size_t len);
+
+#endif /* RR_HASH_H_ */
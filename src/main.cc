@@ -34,11 +34,9 @@ extern char** environ;
  * either a single event number of a range, and may be null to
  * indicate "dump all events".
  *
- * This function is side-effect-y, in that the trace file isn't
- * rewound in between matching each spec.  Therefore specs should be
- * constructed so as to match properly on a serial linear scan; that
- * is, they should comprise disjoint and monotonically increasing
- * event sets.  No attempt is made to enforce this or normalize specs.
+ * The trace is first positioned at the start of the range using the
+ * trace index, so specs may name events in any order without
+ * rescanning the trace from the beginning.
  */
 static void dump_events_matching(TraceIfstream& trace,
 				 FILE* out, const char* spec)
@@ -53,6 +51,7 @@ static void dump_events_matching(TraceIfstream& trace,
 		start = end = atoi(spec);
 	}
 
+	trace.seek_to_time(start);
 	while (trace.good()) {
 		struct trace_frame frame;
 		trace >> frame;
@@ -207,12 +206,18 @@ static void print_usage(void)
 "\n"
 "Syntax for `record'\n"
 " rr record [OPTION]... <exe> [exe-args]...\n"
+"  -a, --adaptive-timeslice   adjust each task's timeslice to how\n"
+"                             CPU- or syscall-heavy it is, rather than\n"
+"                             using the same -c and -e for all tasks\n"
 "  -b, --force-syscall-buffer force the syscall buffer preload library\n"
 "                             to be used, even if that's probably a bad\n"
 "                             idea\n"
 "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
 "                             retired conditional branches) to allow a \n"
 "                             task to run before interrupting it\n"
+"  -D, --dedup-data           store identical large blocks of recorded\n"
+"                             data only once, and report how much space\n"
+"                             that saved\n"
 "  -e, --num-events=<NUM>     maximum number of events (syscall \n"
 "                             enter/exit, signal, CPU interrupt, ...) \n"
 "                             to allow a task before descheduling it\n"
@@ -220,6 +225,25 @@ static void print_usage(void)
 "                             Probably only useful for unit tests.\n"
 "  -n, --no-syscall-buffer    disable the syscall buffer preload library\n"
 "                             even if it would otherwise be used\n"
+"  -R, --max-buffered-read=<BYTES>\n"
+"                             trap to rr for read(), pread64(), recv(),\n"
+"                             recvfrom() and recvmsg() calls of more than\n"
+"                             <BYTES> bytes instead of buffering them, so\n"
+"                             that their data is copied only once\n"
+"  -r, --ring=<MB>            keep only about the last <MB> megabytes of\n"
+"                             the trace.  Replay starts from a snapshot\n"
+"                             of the tracees taken at the start of the\n"
+"                             kept part.  Can't be used with -D\n"
+"  -s, --snapshot-interval=<NUM-EVENTS>\n"
+"                             snapshot the tracees about every\n"
+"                             <NUM-EVENTS> events, so that replay -g can\n"
+"                             start from the snapshot nearest its target\n"
+"  -S, --segment-size=<MB>    split each trace file into files of about\n"
+"                             <MB> megabytes, so that no one file grows\n"
+"                             too large\n"
+"  -t, --patch-rdtsc          rewrite rdtsc instructions the first time\n"
+"                             they trap, so that later executions are\n"
+"                             recorded by the syscall buffer instead\n"
 "\n"
 "Syntax for `replay'\n"
 " rr replay [OPTION]... [<trace-dir>]\n"
@@ -254,25 +278,50 @@ static int parse_record_args(int cmdi, int argc, char** argv,
 			     struct flags* flags)
 {
 	struct option opts[] = {
+		{ "adaptive-timeslice", no_argument, NULL, 'a' },
+		{ "dedup-data", no_argument, NULL, 'D' },
 		{ "force-syscall-buffer", no_argument, NULL, 'b' },
 		{ "ignore-signal", required_argument, NULL, 'i' },
+		{ "max-buffered-read", required_argument, NULL, 'R' },
 		{ "num-cpu-ticks", required_argument, NULL, 'c' },
 		{ "num-events", required_argument, NULL, 'e' },
 		{ "no-syscall-buffer", no_argument, NULL, 'n' },
+		{ "ring", required_argument, NULL, 'r' },
+		{ "segment-size", required_argument, NULL, 'S' },
+		{ "snapshot-interval", required_argument, NULL, 's' },
+		{ "patch-rdtsc", no_argument, NULL, 't' },
 		{ 0 }
 	};
 	optind = cmdi + 1;
 	while (1) {
 		int i = 0;
-		switch (getopt_long(argc, argv, "+c:be:i:n", opts, &i)) {
+		switch (getopt_long(argc, argv, "+ac:bDe:i:nr:R:s:S:t", opts, &i)) {
 		case -1:
+			if (flags->ring_size && flags->dedup_data) {
+				fprintf(stderr,
+					"rr: --ring can't be used with --dedup-data\n");
+				return -1;
+			}
+			if (flags->ring_size && !flags->segment_size) {
+				// Old data is discarded a segment at
+				// a time, so keep segments small
+				// relative to the ring.
+				flags->segment_size = MAX(flags->ring_size / 8,
+							  uint64_t(1) << 20);
+			}
 			return optind;
+		case 'a':
+			flags->adaptive_timeslice = true;
+			break;
 		case 'b':
 			flags->use_syscall_buffer = true;
 			break;
 		case 'c':
 			flags->max_rbc = MAX(1, atoi(optarg));
 			break;
+		case 'D':
+			flags->dedup_data = true;
+			break;
 		case 'e':
 			flags->max_events = MAX(1, atoi(optarg));
 			break;
@@ -283,6 +332,23 @@ static int parse_record_args(int cmdi, int argc, char** argv,
 		case 'n':
 			flags->use_syscall_buffer = false;
 			break;
+		case 'r':
+			flags->ring_size =
+				uint64_t(MAX(1, atoi(optarg))) << 20;
+			break;
+		case 'R':
+			flags->max_buffered_read = MAX(1, atoi(optarg));
+			break;
+		case 's':
+			flags->snapshot_interval = MAX(1, atoi(optarg));
+			break;
+		case 'S':
+			flags->segment_size =
+				uint64_t(MAX(1, atoi(optarg))) << 20;
+			break;
+		case 't':
+			flags->patch_rdtsc = true;
+			break;
 		default:
 			return -1;
 		}
@@ -312,6 +378,7 @@ static int parse_replay_args(int cmdi, int argc, char** argv,
 			flags->goto_event = numeric_limits<decltype(
 				flags->goto_event)>::max();
 			flags->dont_launch_debugger = true;
+			flags->autopilot = true;
 			break;
 		case 'f':
 			flags->target_process = atoi(optarg);
@@ -560,6 +627,17 @@ int main(int argc, char* argv[])
 			LOG(info) <<"Syscall buffer disabled by flag";
 			unsetenv(SYSCALLBUF_ENABLED_ENV_VAR);
 		}
+		if (flags->max_buffered_read) {
+			setenv(SYSCALLBUF_MAX_READ_ENV_VAR,
+			       to_string(flags->max_buffered_read).c_str(), 1);
+		} else {
+			unsetenv(SYSCALLBUF_MAX_READ_ENV_VAR);
+		}
+		if (flags->patch_rdtsc) {
+			setenv(SYSCALLBUF_PATCH_RDTSC_ENV_VAR, "1", 1);
+		} else {
+			unsetenv(SYSCALLBUF_PATCH_RDTSC_ENV_VAR);
+		}
 		flags->syscall_buffer_lib_path = find_syscall_buffer_library();
 	}
 
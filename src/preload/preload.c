@@ -30,7 +30,8 @@
  * system calls, the code is rather delicate.  The following rules
  * must be followed
  *
- * o No rr headers (other than seccomp-bpf.h and rr.h) may be included
+ * o No rr headers (other than seccomp-bpf.h, rr.h and the
+ *   syscall_defs.h table) may be included
  * o All syscalls invoked by this code must be called directly, not
  *   through libc wrappers (which this file may itself indirectly override)
  */
@@ -104,9 +105,18 @@ struct syscall_info {
 
 /* Nonzero when syscall buffering is enabled. */
 static int buffer_enabled;
+/* Reads of more than this many bytes go straight to rr, if
+ * nonzero. */
+static size_t max_buffered_read;
 /* Nonzero after process-global state like the seccomp-bpf has been
  * initialized. */
 static int process_inited;
+/* When rdtsc patching is enabled, the executable area that rr writes
+ * rdtsc patch stubs into.  Null otherwise. */
+static void* rdtsc_stubs;
+/* Size of the |rdtsc_stubs| area.  Each stub takes fewer than 32
+ * bytes, so this fits a couple thousand patched sites. */
+#define RDTSC_STUBS_SIZE (1 << 16)
 
 /* Nonzero when thread-local state like the syscallbuf has been
  * initialized.  */
@@ -183,7 +193,7 @@ static byte* buffer_last(void)
  */
 static byte* buffer_end(void)
 {
-	return buffer + SYSCALLBUF_BUFFER_SIZE;
+	return buffer + buffer_hdr()->num_buffer_bytes;
 }
 
 /**
@@ -192,11 +202,35 @@ static byte* buffer_end(void)
  */
 static void* local_memcpy(void* dest, const void* source, size_t n)
 {
-	char* dst = dest;
-	const char* src = source;
-
-	while (n--) *dst++ = *src++;
-
+	/* This is written with string instructions rather than as a
+	 * C loop so that the compiler can't "optimize" the loop into
+	 * a call to libc memcpy().  We don't use SSE: the vsyscall
+	 * hook promises to preserve all of its caller's registers,
+	 * and doesn't save the vector registers.
+	 *
+	 * Align the destination to a word boundary, then copy whole
+	 * words, then any trailing bytes.  Modern CPUs move larger
+	 * chunks than that internally for "rep movs". */
+	void* dst = dest;
+	const void* src = source;
+	size_t head = -(uintptr_t)dest & (sizeof(uint32_t) - 1);
+	size_t words, tail;
+
+	if (head > n) {
+		head = n;
+	}
+	words = (n - head) / sizeof(uint32_t);
+	tail = (n - head) & (sizeof(uint32_t) - 1);
+
+	__asm__ __volatile__("rep movsb"
+			     : "+D"(dst), "+S"(src), "+c"(head)
+			     : : "memory");
+	__asm__ __volatile__("rep movsl"
+			     : "+D"(dst), "+S"(src), "+c"(words)
+			     : : "memory");
+	__asm__ __volatile__("rep movsb"
+			     : "+D"(dst), "+S"(src), "+c"(tail)
+			     : : "memory");
 	return dest;
 }
 
@@ -417,14 +451,16 @@ extern void* get_untraced_syscall_entry_point(void);
  * return value from the kernel.  Callers must update errno
  * themselves if necessary.
  */
-static long untraced_socketcall(int call,
-				long a0, long a1, long a2, long a3, long a4)
+static long untraced_socketcall(int call, long a0, long a1, long a2,
+				long a3, long a4, long a5)
 {
-	unsigned long args[] = { a0, a1, a2, a3, a4 };
+	unsigned long args[] = { a0, a1, a2, a3, a4, a5 };
 	return untraced_syscall2(SYS_socketcall, call, args);
 }
-#define untraced_socketcall5(no, a0, a1, a2, a3, a4)			\
-	untraced_socketcall(no, (uintptr_t)a0, (uintptr_t)a1, (uintptr_t)a2, (uintptr_t)a3, (uintptr_t)a4)
+#define untraced_socketcall6(no, a0, a1, a2, a3, a4, a5)		\
+	untraced_socketcall(no, (uintptr_t)a0, (uintptr_t)a1, (uintptr_t)a2, (uintptr_t)a3, (uintptr_t)a4, (uintptr_t)a5)
+#define untraced_socketcall5(no, a0, a1, a2, a3, a4)	\
+	untraced_socketcall6(no, a0, a1, a2, a3, a4, 0)
 #define untraced_socketcall4(no, a0, a1, a2, a3)	\
 	untraced_socketcall5(no, a0, a1, a2, a3, 0)
 #define untraced_socketcall3(no, a0, a1, a2)	\
@@ -547,6 +583,79 @@ static void* get_vsyscall_hook_trampoline(void)
     return ret;
 }
 
+/**
+ * Record the value of the rdtsc executed by a patched rdtsc site in
+ * |*tsc|.  Return nonzero if the value was recorded, and zero if the
+ * caller should execute the rdtsc itself, which traps to rr.
+ */
+static int rdtsc_hook(uint64_t* tsc);
+
+/**
+ * rr patches rdtsc sites to call this from their stub.  This
+ * trampoline preserves all registers other than the $eax/$edx pair
+ * that rdtsc writes, and the flags.  When |rdtsc_hook()| declines to
+ * record the value, it returns two bytes past its return address, to
+ * the original rdtsc copied into the stub.
+ */
+__asm__(".text\n\t"
+	".globl _rdtsc_hook_trampoline\n\t"
+	".type _rdtsc_hook_trampoline, @function\n\t"
+	"_rdtsc_hook_trampoline:\n\t"
+	".cfi_startproc\n\t"
+
+	"pushfl\n\t"
+	".cfi_adjust_cfa_offset 4\n\t"
+	"pushl %ecx\n\t"
+	".cfi_adjust_cfa_offset 4\n\t"
+	".cfi_rel_offset %ecx, 0\n\t"
+
+	/* Make room for the tsc value and pass a pointer to it to
+	 * |rdtsc_hook()|. */
+	"subl $8, %esp\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	"movl %esp, %ecx\n\t"
+	"pushl %ecx\n\t"
+	".cfi_adjust_cfa_offset 4\n\t"
+
+	"movl $rdtsc_hook, %eax\n\t"
+	"call *%eax\n\t"	/* $eax = rdtsc_hook(&tsc); */
+
+	"addl $4, %esp\n\t"
+	".cfi_adjust_cfa_offset -4\n\t"
+
+	/* If the value wasn't recorded, return to the stub's rdtsc,
+	 * which follows the two-byte jump over it. */
+	"testl %eax, %eax\n\t"
+	"jnz 1f\n\t"
+	"addl $2, 16(%esp)\n\t"
+	"1:\n\t"
+
+	/* $edx:$eax = tsc; */
+	"popl %eax\n\t"
+	".cfi_adjust_cfa_offset -4\n\t"
+	"popl %edx\n\t"
+	".cfi_adjust_cfa_offset -4\n\t"
+	"popl %ecx\n\t"
+	".cfi_adjust_cfa_offset -4\n\t"
+	".cfi_restore %ecx\n\t"
+	"popfl\n\t"
+	".cfi_adjust_cfa_offset -4\n\t"
+
+	"ret\n\t"
+	".cfi_endproc\n\t"
+	".size _rdtsc_hook_trampoline, .-_rdtsc_hook_trampoline\n\t");
+
+static void* get_rdtsc_hook_trampoline(void)
+{
+    void *ret;
+    __asm__ __volatile__(
+	    "call .L_get_rdtsc_hook_trampoline__pic_helper\n\t"
+	    ".L_get_rdtsc_hook_trampoline__pic_helper: pop %0\n\t"
+	    "addl $(_rdtsc_hook_trampoline - .L_get_rdtsc_hook_trampoline__pic_helper),%0"
+	    : "=a"(ret));
+    return ret;
+}
+
 /**
  * Do what's necessary to set up buffers for the caller.
  * |untraced_syscall_ip| lets rr know where our untraced syscalls will
@@ -710,6 +819,15 @@ static void set_up_buffer(void)
 	args.msg = &msg;
 	args.fdptr = cmsg_fdptr;
 	args.args_vec = &args_vec;
+	if (rdtsc_stubs) {
+		args.rdtsc_hook_trampoline = get_rdtsc_hook_trampoline();
+		args.rdtsc_stubs = rdtsc_stubs;
+		args.rdtsc_stubs_size = RDTSC_STUBS_SIZE;
+	} else {
+		args.rdtsc_hook_trampoline = NULL;
+		args.rdtsc_stubs = NULL;
+		args.rdtsc_stubs_size = 0;
+	}
 
 	/* Trap to rr: let the magic begin!  We've prepared the buffer
 	 * so that it's immediately ready to be sendmsg()'d to rr to
@@ -726,6 +844,25 @@ static void set_up_buffer(void)
 	buffer = args.syscallbuf_ptr;
 }
 
+/**
+ * Map the area that rr writes rdtsc patch stubs into.  rr only
+ * patches rdtsc sites in processes that have one.  The stubs are
+ * written by rr through ptrace, so the area doesn't need to be
+ * writable by the tracee.
+ */
+static void set_up_rdtsc_stubs(void)
+{
+	void* stubs = (void*)traced_syscall6(SYS_mmap2, NULL,
+					     RDTSC_STUBS_SIZE,
+					     PROT_READ | PROT_EXEC,
+					     MAP_PRIVATE | MAP_ANONYMOUS,
+					     -1, 0);
+	if (MAP_FAILED == stubs) {
+		fatal("Failed to map rdtsc stub area");
+	}
+	rdtsc_stubs = stubs;
+}
+
 /**
  * Initialize thread-local buffering state, if enabled.
  */
@@ -779,10 +916,17 @@ init_process(void)
 		return;
 	}
 
+	if (getenv(SYSCALLBUF_MAX_READ_ENV_VAR)) {
+		max_buffered_read = atol(getenv(SYSCALLBUF_MAX_READ_ENV_VAR));
+	}
+
 	pthread_atfork(NULL, NULL, post_fork_child);
 
 	install_syscall_filter();
 	rrcall_monkeypatch_vdso(get_vsyscall_hook_trampoline());
+	if (getenv(SYSCALLBUF_PATCH_RDTSC_ENV_VAR)) {
+		set_up_rdtsc_stubs();
+	}
 	process_inited = 1;
 
 	init_thread();
@@ -931,6 +1075,21 @@ static void disarm_desched_event(void)
 	}
 }
 
+/**
+ * Return nonzero if a read of |count| bytes should be traced rather
+ * than buffered.  The data of a buffered read is copied twice, once
+ * into the syscallbuf by the kernel and once out of it by us.  rr can
+ * record a traced read straight from the destination buffer, so for
+ * large reads the cost of the trap is less than the cost of the extra
+ * copy, and the read doesn't use up the buffer.
+ *
+ * Call this before |prep_syscall()|.
+ */
+static int is_read_too_big_to_buffer(size_t count)
+{
+	return max_buffered_read && count > max_buffered_read;
+}
+
 /**
  * Return 1 if it's ok to proceed with buffering this system call.
  * Return 0 if we should trace the system call.
@@ -1071,6 +1230,70 @@ static long commit_raw_syscall(int syscallno, void* record_end, int ret)
 	return ret;
 }
 
+/**
+ * The value of a patched rdtsc is recorded as the outparam of a
+ * buffered prctl(PR_SET_TSC) that re-enables rdtsc trapping after
+ * the rdtsc has executed.  That prctl is preceded by another
+ * buffered prctl that disables trapping, so that the rdtsc here
+ * doesn't fault.  Both prctls execute in replay too, and the
+ * recorded value is restored into the record at the exit of the
+ * second one, before it's copied out to |*tsc|.
+ *
+ * Both records are committed under one lock of the buffer, so that
+ * no signal handler can run while rdtsc doesn't trap.
+ */
+static int __attribute__((unused))
+rdtsc_hook(uint64_t* tsc)
+{
+	void* ptr = prep_syscall();
+	void* rec_end;
+	struct syscallbuf_record* rec;
+	uint64_t now;
+	long ret;
+
+	if (!ptr) {
+		return 0;
+	}
+	if (buffer_last()
+	    + stored_record_size(sizeof(struct syscallbuf_record))
+	    + stored_record_size(sizeof(struct syscallbuf_record) + sizeof(now))
+	    > buffer_end() - sizeof(struct syscallbuf_record)) {
+		/* There's not room for both records.  Let rr record
+		 * this rdtsc, which will also flush the buffer. */
+		buffer_hdr()->locked = 0;
+		return 0;
+	}
+	if (!start_commit_buffered_syscall(SYS_prctl, ptr, WONT_BLOCK)) {
+		return 0;
+	}
+	ret = untraced_syscall2(SYS_prctl, PR_SET_TSC, PR_TSC_ENABLE);
+	if (ret) {
+		commit_raw_syscall(SYS_prctl, ptr, ret);
+		return 0;
+	}
+	/* Commit the first record without unlocking the buffer. */
+	rec = (struct syscallbuf_record*)buffer_last();
+	rec->ret = ret;
+	buffer_hdr()->num_rec_bytes += stored_record_size(rec->size);
+
+	ptr = buffer_last() + sizeof(struct syscallbuf_record);
+	rec_end = ptr + sizeof(now);
+	if (!start_commit_buffered_syscall(SYS_prctl, rec_end, WONT_BLOCK)) {
+		fatal("No room for rdtsc record after checking for it");
+	}
+	__asm__ __volatile__("rdtsc" : "=A"(now));
+	local_memcpy(ptr, &now, sizeof(now));
+
+	ret = untraced_syscall2(SYS_prctl, PR_SET_TSC, PR_TSC_SIGSEGV);
+	if (ret) {
+		fatal("Failed to re-enable rdtsc trapping");
+	}
+	/* The record now holds the recorded value, in replay too. */
+	local_memcpy(tsc, ptr, sizeof(*tsc));
+	commit_raw_syscall(SYS_prctl, rec_end, ret);
+	return 1;
+}
+
 /* Keep syscalls in alphabetical order, please. */
 
 static long sys_access(const struct syscall_info* call)
@@ -1149,6 +1372,36 @@ static long sys_creat(const struct syscall_info* call)
 	return sys_open(&open_call);
 }
 
+static long sys_epoll_wait(const struct syscall_info* call)
+{
+	const int syscallno = SYS_epoll_wait;
+	int epfd = call->args[0];
+	struct epoll_event* events = (struct epoll_event*)call->args[1];
+	int maxevents = call->args[2];
+	int timeout = call->args[3];
+
+	void* ptr = prep_syscall();
+	struct epoll_event* events2 = NULL;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (events && maxevents > 0) {
+		events2 = ptr;
+		ptr += maxevents * sizeof(*events2);
+	}
+	if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_syscall4(syscallno, epfd, events2, maxevents, timeout);
+
+	if (events2 && ret > 0) {
+		local_memcpy(events, events2, ret * sizeof(*events));
+	}
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static int sys_fcntl64_no_outparams(const struct syscall_info* call)
 {
 	const int syscallno = SYS_fcntl64;
@@ -1344,6 +1597,37 @@ static long sys_futex(const struct syscall_info* call)
 	return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_getdents64(const struct syscall_info* call)
+{
+	const int syscallno = SYS_getdents64;
+	unsigned int fd = call->args[0];
+	void* dirp = (void*)call->args[1];
+	unsigned int count = call->args[2];
+
+	/* Like xstat64(), not arming the desched event; directory
+	 * reads don't block indefinitely. */
+	void* ptr = prep_syscall();
+	void* dirp2 = NULL;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (dirp && count > 0) {
+		dirp2 = ptr;
+		ptr += count;
+	}
+	if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_syscall3(syscallno, fd, dirp2, count);
+
+	if (dirp2 && ret > 0) {
+		local_memcpy(dirp, dirp2, ret);
+	}
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_gettimeofday(const struct syscall_info* call)
 {
 	const int syscallno = SYS_gettimeofday;
@@ -1435,6 +1719,70 @@ static long sys_madvise(const struct syscall_info* call)
 	return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_mprotect(const struct syscall_info* call)
+{
+	const int syscallno = SYS_mprotect;
+	void* addr = (void*)call->args[0];
+	size_t length = call->args[1];
+	int prot = call->args[2];
+
+	void* ptr = prep_syscall();
+	struct mprotect_record* mrec;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	/* rr has to know about the new protection to keep its model
+	 * of our address space up to date, so save the args for it to
+	 * read when the buffer is flushed. */
+	mrec = ptr;
+	ptr += sizeof(*mrec);
+	if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	mrec->addr = addr;
+	mrec->len = length;
+	mrec->prot = prot;
+	ret = untraced_syscall3(syscallno, addr, length, prot);
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_nanosleep(const struct syscall_info* call)
+{
+	const int syscallno = SYS_nanosleep;
+	const struct timespec* req = (const struct timespec*)call->args[0];
+	struct timespec* rem = (struct timespec*)call->args[1];
+
+	/* Unlike FUTEX_WAIT, there's a good chance that a sleep
+	 * doesn't block: zero-length sleeps used to yield, and sleeps
+	 * whose timer expires before we get around to scheduling.
+	 * Those are cheap to buffer.  Sleeps that do block cost one
+	 * desched trap, about the same as a traced call. */
+	void* ptr = prep_syscall();
+	struct timespec* rem2 = NULL;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (rem) {
+		rem2 = ptr;
+		ptr += sizeof(*rem2);
+	}
+	if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_syscall2(syscallno, req, rem2);
+
+	/* The kernel only writes |rem| when the sleep is
+	 * interrupted. */
+	if (rem2 && -EINTR == ret) {
+		local_memcpy(rem, rem2, sizeof(*rem));
+	}
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_open(const struct syscall_info* call)
 {
 	const int syscallno = SYS_open;
@@ -1509,6 +1857,70 @@ static long sys_poll(const struct syscall_info* call)
 	return commit_raw_syscall(syscallno, ptr, ret);	
 }
 
+static long sys_pread64(const struct syscall_info* call)
+{
+	const int syscallno = SYS_pread64;
+	int fd = call->args[0];
+	void* buf = (void*)call->args[1];
+	size_t count = call->args[2];
+	/* The 64-bit offset is passed in two registers. */
+	long offset_low = call->args[3];
+	long offset_high = call->args[4];
+
+	void* ptr;
+	void* buf2 = NULL;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (is_read_too_big_to_buffer(count)) {
+		return traced_raw_syscall(call);
+	}
+
+	ptr = prep_syscall();
+	if (buf && count > 0) {
+		buf2 = ptr;
+		ptr += count;
+	}
+	if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_syscall5(syscallno, fd, buf2, count,
+				offset_low, offset_high);
+
+	if (buf2 && ret > 0) {
+		local_memcpy(buf, buf2, ret);
+	}
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwrite64(const struct syscall_info* call)
+{
+	const int syscallno = SYS_pwrite64;
+	int fd = call->args[0];
+	const void* buf = (const void*)call->args[1];
+	size_t count = call->args[2];
+	long offset_low = call->args[3];
+	long offset_high = call->args[4];
+
+	void* ptr = prep_syscall();
+	long ret;
+
+	assert(syscallno == call->no);
+
+	/* See sys_write(). */
+	if (RR_MAGIC_SAVE_DATA_FD == fd ||
+	    !start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_syscall5(syscallno, fd, buf, count,
+				offset_low, offset_high);
+
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_read(const struct syscall_info* call)
 {
 	const int syscallno = SYS_read;
@@ -1516,12 +1928,17 @@ static long sys_read(const struct syscall_info* call)
 	void* buf = (void*)call->args[1];
 	size_t count = call->args[2];
 
-	void* ptr = prep_syscall();
+	void* ptr;
 	void* buf2 = NULL;
 	long ret;
 
 	assert(syscallno == call->no);
 
+	if (is_read_too_big_to_buffer(count)) {
+		return traced_raw_syscall(call);
+	}
+
+	ptr = prep_syscall();
 	if (buf && count > 0) {
 		buf2 = ptr;
 		ptr += count;
@@ -1575,12 +1992,17 @@ static long sys_recv(const struct syscall_info* call)
 	size_t len = args[2];
 	unsigned int flags = args[3];
 
-	void* ptr = prep_syscall();
+	void* ptr;
 	void* buf2 = NULL;
 	long ret;
 
 	assert(syscallno == call->no);
 
+	if (is_read_too_big_to_buffer(len)) {
+		return traced_raw_syscall(call);
+	}
+
+	ptr = prep_syscall();
 	if (buf && len > 0) {
 		buf2 = ptr;
 		ptr += len;
@@ -1592,16 +2014,226 @@ static long sys_recv(const struct syscall_info* call)
 	ret = untraced_socketcall4(SYS_RECV, sockfd, buf2, len, flags);
 
 	if (buf2 && ret > 0) {
-		local_memcpy(buf, buf2, ret);
+		/* With MSG_TRUNC, the kernel reports the full length
+		 * of a datagram that didn't fit in |len| bytes. */
+		local_memcpy(buf, buf2, (size_t)ret < len ? (size_t)ret : len);
+	}
+	return commit_raw_syscall(SYS_socketcall, ptr, ret);
+}
+
+static long sys_recvfrom(const struct syscall_info* call)
+{
+	const int syscallno = SYS_socketcall;
+	long* args = (long*)call->args[1];
+	int sockfd = args[0];
+	void* buf = (void*)args[1];
+	size_t len = args[2];
+	unsigned int flags = args[3];
+	struct sockaddr* src_addr = (struct sockaddr*)args[4];
+	socklen_t* addrlen = (socklen_t*)args[5];
+
+	void* ptr;
+	void* buf2 = NULL;
+	struct sockaddr* src_addr2 = NULL;
+	socklen_t* addrlen2 = NULL;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (is_read_too_big_to_buffer(len)) {
+		return traced_raw_syscall(call);
+	}
+
+	ptr = prep_syscall();
+	if (src_addr && addrlen) {
+		addrlen2 = ptr;
+		ptr += sizeof(*addrlen2);
+		src_addr2 = ptr;
+		ptr += *addrlen;
+	}
+	if (buf && len > 0) {
+		buf2 = ptr;
+		ptr += len;
+	}
+	if (!start_commit_buffered_syscall(SYS_socketcall, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+	if (addrlen2) {
+		*addrlen2 = *addrlen;
+	}
+
+	ret = untraced_socketcall6(SYS_RECVFROM, sockfd, buf2, len, flags,
+				   src_addr2, addrlen2);
+
+	if (ret >= 0) {
+		if (addrlen2) {
+			/* The kernel truncates the address to the
+			 * space we gave it, but reports the untruncated
+			 * length. */
+			socklen_t copy_len = *addrlen2 < *addrlen ?
+					     *addrlen2 : *addrlen;
+			local_memcpy(src_addr, src_addr2, copy_len);
+			*addrlen = *addrlen2;
+		}
+		if (buf2) {
+			/* As in |sys_recv()|, |ret| may exceed |len|. */
+			local_memcpy(buf, buf2,
+				     (size_t)ret < len ? (size_t)ret : len);
+		}
 	}
 	return commit_raw_syscall(SYS_socketcall, ptr, ret);
 }
 
+static long sys_recvmsg(const struct syscall_info* call)
+{
+	const int syscallno = SYS_socketcall;
+	long* args = (long*)call->args[1];
+	int sockfd = args[0];
+	struct msghdr* msg = (struct msghdr*)args[1];
+	unsigned int flags = args[2];
+
+	void* ptr;
+	struct msghdr* msg2;
+	struct iovec* iov2;
+	void* name2 = NULL;
+	void* control2 = NULL;
+	byte* data2;
+	size_t num_data_bytes = 0;
+	size_t i;
+	long ret;
+
+	assert(syscallno == call->no);
+
+	for (i = 0; i < msg->msg_iovlen; ++i) {
+		num_data_bytes += msg->msg_iov[i].iov_len;
+	}
+	if (is_read_too_big_to_buffer(num_data_bytes)) {
+		return traced_raw_syscall(call);
+	}
+
+	/* Receive into a single scratch iovec, and scatter the data
+	 * back out to the caller's iovecs afterwards.  The msghdr
+	 * itself has to live in the buffer too, so that the replayed
+	 * name/control lengths and flags are restored along with the
+	 * data. */
+	ptr = prep_syscall();
+	msg2 = ptr;
+	ptr += sizeof(*msg2);
+	iov2 = ptr;
+	ptr += sizeof(*iov2);
+	if (msg->msg_name) {
+		name2 = ptr;
+		ptr += msg->msg_namelen;
+	}
+	if (msg->msg_control) {
+		control2 = ptr;
+		ptr += msg->msg_controllen;
+	}
+	data2 = ptr;
+	ptr += num_data_bytes;
+	if (!start_commit_buffered_syscall(SYS_socketcall, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+	iov2->iov_base = data2;
+	iov2->iov_len = num_data_bytes;
+	msg2->msg_name = name2;
+	msg2->msg_namelen = msg->msg_namelen;
+	msg2->msg_iov = iov2;
+	msg2->msg_iovlen = 1;
+	msg2->msg_control = control2;
+	msg2->msg_controllen = msg->msg_controllen;
+	msg2->msg_flags = 0;
+
+	ret = untraced_socketcall3(SYS_RECVMSG, sockfd, msg2, flags);
+
+	if (ret >= 0) {
+		size_t bytes_left = ret;
+		const byte* src = data2;
+		for (i = 0; i < msg->msg_iovlen && bytes_left > 0; ++i) {
+			struct iovec* iov = &msg->msg_iov[i];
+			size_t n = bytes_left < iov->iov_len ?
+				   bytes_left : iov->iov_len;
+			local_memcpy(iov->iov_base, src, n);
+			src += n;
+			bytes_left -= n;
+		}
+		if (msg->msg_name) {
+			local_memcpy(msg->msg_name, msg2->msg_name,
+				     msg2->msg_namelen < msg->msg_namelen ?
+				     msg2->msg_namelen : msg->msg_namelen);
+		}
+		msg->msg_namelen = msg2->msg_namelen;
+		if (msg->msg_control) {
+			local_memcpy(msg->msg_control, msg2->msg_control,
+				     msg2->msg_controllen);
+		}
+		msg->msg_controllen = msg2->msg_controllen;
+		msg->msg_flags = msg2->msg_flags;
+	}
+	return commit_raw_syscall(SYS_socketcall, ptr, ret);
+}
+
+static long sys_sendmsg(const struct syscall_info* call)
+{
+	const int syscallno = SYS_socketcall;
+	long* args = (long*)call->args[1];
+	int sockfd = args[0];
+	const struct msghdr* msg = (const struct msghdr*)args[1];
+	unsigned int flags = args[2];
+
+	void* ptr = prep_syscall();
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (!start_commit_buffered_syscall(SYS_socketcall, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_socketcall3(SYS_SENDMSG, sockfd, msg, flags);
+
+	return commit_raw_syscall(SYS_socketcall, ptr, ret);
+}
+
+static long sys_sendto(const struct syscall_info* call)
+{
+	const int syscallno = SYS_socketcall;
+	long* args = (long*)call->args[1];
+	int sockfd = args[0];
+	const void* buf = (const void*)args[1];
+	size_t len = args[2];
+	unsigned int flags = args[3];
+	const struct sockaddr* dest_addr = (const struct sockaddr*)args[4];
+	socklen_t addrlen = args[5];
+
+	void* ptr = prep_syscall();
+	long ret;
+
+	assert(syscallno == call->no);
+
+	if (!start_commit_buffered_syscall(SYS_socketcall, ptr, MAY_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+
+	ret = untraced_socketcall6(SYS_SENDTO, sockfd, buf, len, flags,
+				   dest_addr, addrlen);
+
+	return commit_raw_syscall(SYS_socketcall, ptr, ret);
+}
+
 static long sys_socketcall(const struct syscall_info* call)
 {
 	switch (call->args[0]) {
 	case SYS_RECV:
 		return sys_recv(call);
+	case SYS_RECVFROM:
+		return sys_recvfrom(call);
+	case SYS_RECVMSG:
+		return sys_recvmsg(call);
+	case SYS_SENDMSG:
+		return sys_sendmsg(call);
+	case SYS_SENDTO:
+		return sys_sendto(call);
 	default:
 		return traced_raw_syscall(call);
 	}
@@ -1628,6 +2260,28 @@ static long sys_time(const struct syscall_info* call)
 	return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * Generic wrapper for the syscalls marked DEF0_TRIVIAL in
+ * syscall_defs.h.  They have no outparams or side effects and can't
+ * block, so the record only has to save the return value.  Buffering
+ * them keeps calls like |getpid()| and |gettid()|, which some
+ * programs make very frequently, from trapping to rr.
+ */
+static long sys_trivial(const struct syscall_info* call)
+{
+	const int syscallno = call->no;
+	void* ptr = prep_syscall();
+	long ret;
+
+	if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+		return traced_raw_syscall(call);
+	}
+	ret = untraced_syscall6(syscallno, call->args[0], call->args[1],
+				call->args[2], call->args[3], call->args[4],
+				call->args[5]);
+	return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_xstat64(const struct syscall_info* call)
 {
 	const int syscallno = call->no;
@@ -1714,13 +2368,19 @@ vsyscall_hook(const struct syscall_info* call)
 	CASE(clock_gettime);
 	CASE(close);
 	CASE(creat);
+	CASE(epoll_wait);
 	CASE(fcntl64);
 	CASE(futex);
+	CASE(getdents64);
 	CASE(gettimeofday);
 	CASE(_llseek);
 	CASE(madvise);
+	CASE(mprotect);
+	CASE(nanosleep);
 	CASE(open);
 	CASE(poll);
+	CASE(pread64);
+	CASE(pwrite64);
 	CASE(read);
 	CASE(readlink);
 	CASE(socketcall);
@@ -1732,6 +2392,34 @@ vsyscall_hook(const struct syscall_info* call)
 	case SYS_lstat64:
 	case SYS_stat64:
 		return sys_xstat64(call);
+
+#define SYSCALLNO_X86(num)
+#define SYSCALL_DEF0(_name, _type)
+#define SYSCALL_DEF0_TRIVIAL(_name, _type)		\
+	case SYS_ ## _name:
+#define SYSCALL_DEF1(_name, _type, _1, _2)
+#define SYSCALL_DEF1_DYNSIZE(_name, _type, _1, _2)
+#define SYSCALL_DEF1_STR(_name, _type, _1)
+#define SYSCALL_DEF2(_name, _type, _1, _2, _3, _4)
+#define SYSCALL_DEF3(_name, _type, _1, _2, _3, _4, _5, _6)
+#define SYSCALL_DEF4(_name, _type, _1, _2, _3, _4, _5, _6, _7, _8)
+#define SYSCALL_DEF_IRREG(_name, _type)
+#define SYSCALL_DEF_UNSUPPORTED(_name)
+
+#include "../syscall_defs.h"
+
+#undef SYSCALLNO_X86
+#undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
+#undef SYSCALL_DEF1
+#undef SYSCALL_DEF1_DYNSIZE
+#undef SYSCALL_DEF1_STR
+#undef SYSCALL_DEF2
+#undef SYSCALL_DEF3
+#undef SYSCALL_DEF4
+#undef SYSCALL_DEF_IRREG
+#undef SYSCALL_DEF_UNSUPPORTED
+		return sys_trivial(call);
 	default:
 		return traced_raw_syscall(call);
 	}
@@ -23,11 +23,24 @@ extern "C" {
 #define SYSCALLBUF_DESCHED_SIGNAL SIGSYS
 
 #define SYSCALLBUF_LIB_FILENAME "librrpreload.so"
-/* This size counts the header along with record data. */
-#define SYSCALLBUF_BUFFER_SIZE (1 << 20)
+/* Each thread's syscallbuf starts out this big, counting the header
+ * along with record data.  rr grows the buffers of threads that fill
+ * them up, to at most SYSCALLBUF_MAX_BUFFER_SIZE; see
+ * |syscallbuf_hdr.num_buffer_bytes|. */
+#define SYSCALLBUF_INITIAL_BUFFER_SIZE (1 << 16)
+/* Space for this much is mapped for each syscallbuf, but only the
+ * part in use is ever touched.  Records' |size| field must be able to
+ * represent anything that fits. */
+#define SYSCALLBUF_MAX_BUFFER_SIZE (1 << 21)
 
 /* Set this env var to enable syscall buffering. */
 #define SYSCALLBUF_ENABLED_ENV_VAR "_RR_USE_SYSCALLBUF"
+/* If this env var is set, reads of more than its value in bytes
+ * aren't buffered. */
+#define SYSCALLBUF_MAX_READ_ENV_VAR "_RR_SYSCALLBUF_MAX_READ"
+/* Set this env var to have rr patch rdtsc instructions into calls to
+ * the syscallbuf lib's rdtsc hook. */
+#define SYSCALLBUF_PATCH_RDTSC_ENV_VAR "_RR_PATCH_RDTSC"
 
 /* "Magic" (rr-implemented) syscall that we use to initialize the
  * syscallbuf.
@@ -71,6 +84,12 @@ struct rrcall_init_buffers_params {
 	/* Preallocated space the tracer can use to make socketcall
 	 * syscalls. */
 	struct socketcall_args* args_vec;
+	/* Entry point that patched rdtsc sites call, and the
+	 * executable area rr writes the patch stubs into.  Both are
+	 * null unless rdtsc patching is enabled. */
+	void* rdtsc_hook_trampoline;
+	void* rdtsc_stubs;
+	size_t rdtsc_stubs_size;
 
 	/* "Out" params. */
 	/* Returned pointer to and size of the shared syscallbuf
@@ -109,6 +128,17 @@ struct syscallbuf_record {
 	byte extra_data[0];
 } __attribute__((__packed__));
 
+/**
+ * Buffered mprotect() calls save their arguments as the record's
+ * extra data, so that rr can update its model of the tracee's address
+ * space when it processes the record.
+ */
+struct mprotect_record {
+	void* addr;
+	size_t len;
+	int prot;
+};
+
 /**
  * This struct summarizes the state of the syscall buffer.  It happens
  * to be located at the start of the buffer.
@@ -130,10 +160,14 @@ struct syscallbuf_hdr {
 	 * When it's zero, the desched signal can safely be
 	 * discarded. */
 	uint32_t desched_signal_may_be_relevant : 1;
+	/* The number of bytes of the buffer, counting this header,
+	 * that records may use.  Only rr changes this, when it
+	 * initializes or resets the buffer. */
+	uint32_t num_buffer_bytes;
 
 	struct syscallbuf_record recs[0];
 } __attribute__((__packed__));
-/* TODO: static_assert(sizeof(uint32_t) ==
+/* TODO: static_assert(2 * sizeof(uint32_t) ==
  *                     sizeof(struct syscallbuf_hdr)) */
 
 /**
@@ -13,6 +13,8 @@
 #include <sys/mman.h>
 #include <sys/user.h>
 
+#include <vector>
+
 #include "preload/syscall_buffer.h"
 
 #include "hpc.h"
@@ -22,6 +24,8 @@
 #include "trace.h"
 #include "util.h"
 
+using namespace std;
+
 static void handle_siginfo(Task* t, siginfo_t* si);
 
 static __inline__ unsigned long long rdtsc(void)
@@ -137,6 +141,229 @@ static int try_handle_rdtsc(Task *t)
 	return 1;
 }
 
+/* Size of a |jmp rel32| or |call rel32|. */
+static const size_t rel32_insn_size = 5;
+/* Patched rdtsc stubs begin with
+ *
+ *   call rdtsc_hook_trampoline
+ *   jmp 1f
+ *   rdtsc
+ * 1:
+ *
+ * The trampoline returns to the |jmp| if it recorded the tsc value,
+ * and otherwise to the |rdtsc|, which then traps to rr.  This is the
+ * size of that code. */
+static const size_t rdtsc_stub_prologue_size =
+	rel32_insn_size + 2 + sizeof(rdtsc_insn);
+/* Don't look further than this past an rdtsc for instructions to
+ * move into its stub. */
+static const size_t max_rdtsc_patch_size = 16;
+
+/**
+ * Return the size of the ModRM byte at |p| and the SIB byte and
+ * displacement following it, or 0 if that's more than |avail|
+ * bytes.
+ */
+static size_t modrm_size(const byte* p, size_t avail)
+{
+	if (avail < 1) {
+		return 0;
+	}
+	int mod = p[0] >> 6;
+	int rm = p[0] & 7;
+	size_t size = 1;
+	if (3 != mod && 4 == rm) {
+		if (avail < 2) {
+			return 0;
+		}
+		size += 1;
+		if (0 == mod && 5 == (p[1] & 7)) {
+			size += 4;
+		}
+	}
+	if ((0 == mod && 5 == rm) || 2 == mod) {
+		size += 4;
+	} else if (1 == mod) {
+		size += 1;
+	}
+	return size <= avail ? size : 0;
+}
+
+/**
+ * Return the size of the instruction at |p| if it can be moved to
+ * another address and execute the same way there, or 0 if it can't
+ * or doesn't fit in |avail| bytes.  Only the common register and
+ * memory moves and arithmetic that follow rdtscs are recognized;
+ * x86 has no IP-relative data addressing, so these are all
+ * relocatable.
+ */
+static size_t relocatable_insn_size(const byte* p, size_t avail)
+{
+	if (avail < 1) {
+		return 0;
+	}
+	byte op = p[0];
+	size_t size;
+	if ((0x40 <= op && op <= 0x5f) || 0x90 == op) {
+		// inc/dec/push/pop reg, nop
+		size = 1;
+	} else if (0xb8 <= op && op <= 0xbf) {
+		// mov $imm32, reg
+		size = 5;
+	} else {
+		size_t modrm = modrm_size(p + 1, avail - 1);
+		if (!modrm) {
+			return 0;
+		}
+		switch (op) {
+		case 0x01: case 0x03:	// add
+		case 0x09: case 0x0b:	// or
+		case 0x21: case 0x23:	// and
+		case 0x29: case 0x2b:	// sub
+		case 0x31: case 0x33:	// xor
+		case 0x39: case 0x3b:	// cmp
+		case 0x85:		// test
+		case 0x89: case 0x8b:	// mov
+		case 0x8d:		// lea
+			size = 1 + modrm;
+			break;
+		case 0x83:		// arith $imm8
+		case 0xc1:		// shift $imm8
+			size = 1 + modrm + 1;
+			break;
+		case 0xc7:		// mov $imm32
+			if ((p[1] >> 3) & 7) {
+				return 0;
+			}
+			size = 1 + modrm + 4;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return size <= avail ? size : 0;
+}
+
+/**
+ * Append the instruction |opcode rel32|, located at |from| and
+ * targeting |to|, to |code|.
+ */
+static void append_rel32_insn(vector<byte>& code, byte opcode,
+			      const byte* from, const void* to)
+{
+	int32_t rel = (const byte*)to - (from + rel32_insn_size);
+	const byte* p = reinterpret_cast<const byte*>(&rel);
+	code.push_back(opcode);
+	code.insert(code.end(), p, p + sizeof(rel));
+}
+
+/**
+ * Try to replace the rdtsc at |site|, which |t| just trapped on, with
+ * a jump to a new stub that calls the syscallbuf lib's rdtsc hook.
+ * The jump needs more space than the rdtsc, so the instructions
+ * following the rdtsc are moved into the stub, which then jumps back
+ * to the instruction after them.  The caller moves |t| to the same
+ * point in the stub that it's at in the original code.
+ *
+ * Return the stub, and the code written to it and to |site| in
+ * |stub_code| and |site_code|, or null if the site can't be patched.
+ *
+ * Tasks in the address space that are stopped within the code being
+ * replaced are checked for.  Saved signal-handler frames returning
+ * into that code, and jumps into it, can't be checked for, which is
+ * why patching isn't enabled by default.
+ */
+static byte* patch_rdtsc_site(Task* t, byte* site, vector<byte>& stub_code,
+			      vector<byte>& site_code)
+{
+	AddressSpace& vm = *t->vm();
+	if (!vm.has_rdtsc_stubs() || t->is_in_syscallbuf()
+	    || vm.is_in_rdtsc_stubs(site)) {
+		return nullptr;
+	}
+
+	byte code[max_rdtsc_patch_size];
+	ssize_t nread = t->read_bytes_fallible(site, sizeof(code), code);
+	size_t size = sizeof(rdtsc_insn);
+	while (size < rel32_insn_size) {
+		size_t avail = nread > ssize_t(size) ? nread - size : 0;
+		size_t insn_size = relocatable_insn_size(code + size, avail);
+		if (!insn_size) {
+			LOG(debug) <<"  can't relocate code after rdtsc at "
+				   << site;
+			return nullptr;
+		}
+		size += insn_size;
+	}
+	for (Task* other : vm.task_set()) {
+		byte* ip = (byte*)other->ip();
+		if (other != t && site < ip && ip < site + size) {
+			LOG(debug) <<"  "<< other->tid <<" is within rdtsc at "
+				   << site <<"; not patching";
+			return nullptr;
+		}
+	}
+
+	size_t stub_size = rdtsc_stub_prologue_size
+			   + (size - sizeof(rdtsc_insn)) + rel32_insn_size;
+	byte* stub = (byte*)vm.alloc_rdtsc_stub(stub_size);
+	if (!stub) {
+		LOG(debug) <<"  rdtsc stub area is full";
+		return nullptr;
+	}
+
+	append_rel32_insn(stub_code, 0xe8, stub, vm.rdtsc_hook_trampoline());
+	stub_code.push_back(0xeb);
+	stub_code.push_back(sizeof(rdtsc_insn));
+	stub_code.insert(stub_code.end(), rdtsc_insn,
+			 rdtsc_insn + sizeof(rdtsc_insn));
+	stub_code.insert(stub_code.end(), code + sizeof(rdtsc_insn),
+			 code + size);
+	append_rel32_insn(stub_code, 0xe9, stub + stub_code.size(),
+			  site + size);
+	assert(stub_code.size() == stub_size);
+
+	append_rel32_insn(site_code, 0xe9, site, stub);
+	site_code.resize(size, AddressSpace::breakpoint_insn);
+
+	t->write_bytes_helper(stub, stub_code.size(), stub_code.data());
+	t->write_bytes_helper(site, site_code.size(), site_code.data());
+
+	LOG(debug) <<"  patched rdtsc at "<< site <<" to jump to stub "
+		   << stub;
+	return stub;
+}
+
+void record_rdtsc_trap(Task* t)
+{
+	assert(EV_SEGV_RDTSC == t->ev().type());
+
+	// The emulated rdtsc is recorded as it happened, before any
+	// code is patched, so that its registers and memory checksum
+	// are what replay sees when it retires the trap.
+	t->record_current_event();
+	t->pop_event(EV_SEGV_RDTSC);
+
+	byte* site = (byte*)t->ip() - sizeof(rdtsc_insn);
+	vector<byte> stub_code, site_code;
+	byte* stub = patch_rdtsc_site(t, site, stub_code, site_code);
+	if (!stub) {
+		return;
+	}
+	// Execution resumes in the stub, just after the rdtsc it
+	// emulates.  Replay writes the code recorded here and then
+	// restores these registers.
+	Registers r = t->regs();
+	r.set_ip((uintptr_t)(stub + rdtsc_stub_prologue_size));
+	t->set_regs(r);
+
+	t->push_event(Event(EV_PATCH_RDTSC, HAS_EXEC_INFO));
+	t->record_local(stub, stub_code.size(), stub_code.data());
+	t->record_local(site, site_code.size(), site_code.data());
+	t->record_current_event();
+	t->pop_event(EV_PATCH_RDTSC);
+}
+
 static void disarm_desched_event(Task* t)
 {
 	if (ioctl(t->desched_fd, PERF_EVENT_IOC_DISABLE, 0)) {
@@ -15,4 +15,13 @@ struct flags;
  */
 void handle_signal(Task* t, siginfo_t* si = nullptr);
 
+/**
+ * Record the EV_SEGV_RDTSC event at the top of |t|'s event stack,
+ * and pop it.  If rdtsc patching is enabled, the trapping rdtsc is
+ * then patched to call into the syscallbuf lib in the future, and the
+ * patch and the move of |t| into its stub are recorded as an
+ * EV_PATCH_RDTSC event.
+ */
+void record_rdtsc_trap(Task* t);
+
 #endif /* RR_HANDLE_SIGNAL_H__ */
@@ -39,6 +39,7 @@
 #include <termios.h>
 
 #include <limits>
+#include <sstream>
 #include <utility>
 
 #include <rr/rr.h>
@@ -1083,7 +1084,9 @@ static void init_scratch_memory(Task *t)
 	file.tid = t->tid;
 	file.start = t->scratch_ptr;
 	file.end = (byte*)t->scratch_ptr + scratch_size;
-	sprintf(file.filename,"scratch for thread %d",t->tid);
+	stringstream name;
+	name <<"scratch for thread "<< t->tid;
+	file.filename = name.str();
 	t->ofstream() << file;
 
 	r.set_syscall_result(saved_result);
@@ -1540,20 +1543,21 @@ static void process_mmap(Task* t, int syscallno,
 		// for the resource.
 		file.time = t->trace_time();
 		file.tid = t->tid;
-		if (!t->fdstat(fd, &file.stat,
-			       file.filename, sizeof(file.filename))) {
+		char filename[PATH_MAX];
+		if (!t->fdstat(fd, &file.stat, filename, sizeof(filename))) {
 			FATAL() <<"Failed to fdstat "<< fd;
 		}
+		file.filename = filename;
 		file.start = addr;
 		file.end = (byte*)addr + size;
 
-		if (strstr(file.filename, SYSCALLBUF_LIB_FILENAME)
+		if (strstr(filename, SYSCALLBUF_LIB_FILENAME)
 		    && (prot & PROT_EXEC) ) {
 			t->syscallbuf_lib_start = file.start;
 			t->syscallbuf_lib_end = file.end;
 		}
 
-		file.copied = should_copy_mmap_region(file.filename,
+		file.copied = should_copy_mmap_region(filename,
 						      &file.stat,
 						      prot, flags,
 						      WARN_DEFAULT);
@@ -1564,8 +1568,7 @@ static void process_mmap(Task* t, int syscallno,
 		t->ofstream() << file;
 
 		t->vm()->map(addr, size, prot, flags, offset,
-			     MappableResource(FileId(file.stat),
-					      file.filename));
+			     MappableResource(FileId(file.stat), filename));
 }
 
 static void process_socketcall(Task* t, int call, void* base_addr)
@@ -1734,30 +1737,41 @@ static void process_socketcall(Task* t, int call, void* base_addr)
 			t->remote_memcpy(msg.msg_name, tmpmsg.msg_name,
 					 tmpmsg.msg_namelen);
 		}
-		t->record_remote(msg.msg_name, msg.msg_namelen);
 
 		ASSERT(t, msg.msg_iovlen == tmpmsg.msg_iovlen)
 		       << "Scratch msg should have "<< msg.msg_iovlen
 		       <<" iovs, but has "<< tmpmsg.msg_iovlen;
-		struct iovec iovs[msg.msg_iovlen];
-		read_iovs(t, msg, iovs);
+		// |ranges| will hold the name, the iovecs' buffers and
+		// the control data, to be recorded together.
+		struct iovec ranges[msg.msg_iovlen + 2];
+		struct iovec* iovs = &ranges[1];
 		struct iovec tmpiovs[tmpmsg.msg_iovlen];
-		read_iovs(t, tmpmsg, tmpiovs);
+		struct iovec iov_arrays[2] = {
+			{ msg.msg_iov, msg.msg_iovlen * sizeof(*iovs) },
+			{ tmpmsg.msg_iov, tmpmsg.msg_iovlen * sizeof(*iovs) }
+		};
+		byte iovs_buf[2 * msg.msg_iovlen * sizeof(*iovs)];
+		t->read_ranges(iov_arrays, 2, iovs_buf);
+		memcpy(iovs, iovs_buf, iov_arrays[0].iov_len);
+		memcpy(tmpiovs, iovs_buf + iov_arrays[0].iov_len,
+		       iov_arrays[1].iov_len);
 		for (size_t i = 0; i < msg.msg_iovlen; ++i) {
 			struct iovec* iov = &iovs[i];
 			const struct iovec& tmpiov = tmpiovs[i];
 			t->remote_memcpy(iov->iov_base, tmpiov.iov_base,
 					 tmpiov.iov_len);
 			iov->iov_len = tmpiov.iov_len;
-
-			t->record_remote(iov->iov_base, iov->iov_len);
 		}
 
 		if (msg.msg_control) {
 			t->remote_memcpy(msg.msg_control, tmpmsg.msg_control,
 					 tmpmsg.msg_controllen);
 		}
-		t->record_remote(msg.msg_control, msg.msg_controllen);
+		ranges[0].iov_base = msg.msg_name;
+		ranges[0].iov_len = msg.msg_namelen;
+		ranges[msg.msg_iovlen + 1].iov_base = msg.msg_control;
+		ranges[msg.msg_iovlen + 1].iov_len = msg.msg_controllen;
+		t->record_remote_ranges(ranges, msg.msg_iovlen + 2);
 
 		r.set_arg2((uintptr_t)argsp);
 		t->set_regs(r);
@@ -1933,6 +1947,8 @@ void rec_process_syscall(Task *t)
 #define SYSCALL_DEF0(_call, _)						\
 	case static_cast<int>(SyscallsX86::_call):			\
 		break;
+#define SYSCALL_DEF0_TRIVIAL(_call, _)	\
+	SYSCALL_DEF0(_call, _)
 #define SYSCALL_DEF1(_call, _, _t0, _r0)				\
 	case static_cast<int>(SyscallsX86::_call):			\
 		t->record_remote((void*)t->regs()._r0(), sizeof(_t0));	\
@@ -1969,6 +1985,7 @@ void rec_process_syscall(Task *t)
 #include "syscall_defs.h"
 
 #undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
 #undef SYSCALL_DEF1
 #undef SYSCALL_DEF1_STR
 #undef SYSCALL_DEF2
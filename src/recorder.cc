@@ -156,7 +156,7 @@ static void handle_ptrace_event(Task** tp)
 			stack, tls, ctid, new_tid);
 		// Wait until the new task is ready.
 		new_task->wait();
-		start_hpc(new_task, rr_flags()->max_rbc);
+		start_hpc(new_task, new_task->rbc_budget);
 		// Skip past the ptrace event.
 		t->cont_syscall();
 		assert(t->pending_sig() == 0);
@@ -349,7 +349,7 @@ static void desched_state_changed(Task* t)
 		 * aborted record, and won't touch the syscallbuf
 		 * during this (aborted) transaction again.  So now is
 		 * a good time for us to reset the record counter. */
-		t->syscallbuf_hdr->num_rec_bytes = 0;
+		t->reset_syscallbuf();
 		t->delay_syscallbuf_reset = 0;
 		t->delay_syscallbuf_flush = 0;
 		t->record_event(Event(EV_SYSCALLBUF_RESET, NO_EXEC_INFO));
@@ -542,6 +542,9 @@ static void syscall_state_changed(Task* t, int by_waitpid)
 		 * restart_syscall */
 		if (!may_restart) {
 			rec_process_syscall(t);
+			if (SYS_futex == syscallno) {
+				rec_sched_note_futex_wake(t);
+			}
 			if (t->session().can_validate()
 			    && rr_flags()->check_cached_mmaps) {
 				t->vm()->verify(t);
@@ -655,7 +658,7 @@ static bool signal_state_changed(Task* t, int by_waitpid)
 		// This event is used by the replayer to advance to
 		// the point of signal delivery.
 		t->record_current_event();
-		reset_hpc(t, rr_flags()->max_rbc);
+		reset_hpc(t, t->rbc_budget);
 
 		t->ev().transform(EV_SIGNAL_DELIVERY);
 		ssize_t sigframe_size;
@@ -795,10 +798,14 @@ static void runnable_state_changed(Task* t)
 	case EV_NOOP:
 		t->pop_noop();
 		break;
-	case EV_SEGV_RDTSC:
 	case EV_SCHED:
+		rec_sched_note_timeslice_expired(t);
 		t->record_current_event();
-		t->pop_event(t->ev().type());
+		t->pop_event(EV_SCHED);
+		t->switchable = 1;
+		break;
+	case EV_SEGV_RDTSC:
+		record_rdtsc_trap(t);
 		t->switchable = 1;
 		break;
 	case EV_SIGNAL:
@@ -814,6 +821,7 @@ static void runnable_state_changed(Task* t)
 			rec_before_record_syscall_entry(t, t->ev().Syscall().no);
 		}
 		ASSERT(t, EV_SYSCALL == t->ev().type());
+		rec_sched_note_syscall(t);
 		check_rbc(t);
 		t->ev().Syscall().state = ENTERING_SYSCALL;
 		t->record_current_event();
@@ -921,12 +929,13 @@ void record(const char* rr_exe, int argc, char* argv[], char** envp)
 	install_termsig_handlers();
 
 	Task* t = session->create_task(ae, session);
-	start_hpc(t, rr_flags()->max_rbc);
+	start_hpc(t, t->rbc_budget);
 
 	while (session->tasks().size() > 0) {
 		int by_waitpid;
 
 		maybe_process_term_request(t);
+		session->maybe_write_snapshot();
 
 		Task* next = rec_sched_get_active_thread(*session,
 							 t, &by_waitpid);
@@ -983,6 +992,8 @@ void record(const char* rr_exe, int argc, char* argv[], char** envp)
 	}
 
 	LOG(info) <<"Done recording -- cleaning up";
+	session->ofstream().report_dedup_stats();
+	rec_sched_report_stats();
 	session = nullptr;
 	close_libpfm();
 }
@@ -999,7 +1010,10 @@ void terminate_recording(Task* t)
 	frame.ev = Event(EV_TRACE_TERMINATION,
 			 BaseEvent(NO_EXEC_INFO)).encode();
 	session->ofstream() << frame;
+	// The trace writer thread won't get a chance to finish after
+	// we exit(), so wait for it here.
 	session->ofstream().flush();
+	session->ofstream().report_dedup_stats();
 
 	// TODO: Task::killall() here?
 
@@ -6,6 +6,7 @@
 #include "recorder_sched.h"
 
 #include <assert.h>
+#include <linux/futex.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,6 +16,10 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <algorithm>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "config.h"
 #include "log.h"
@@ -30,26 +35,297 @@ using namespace std;
  */
 static Task* current;
 
-static void note_switch(Task* prev_t, Task* t, int max_events)
+/**
+ * Counts of scheduling events over the whole recording, for
+ * |rec_sched_report_stats()|.
+ */
+static struct {
+	uint64_t switches;
+	uint64_t timeslice_interrupts;
+	uint64_t syscalls;
+	// Timeslice level changes made by the adaptive policy, and
+	// changes it clamped to its range.
+	uint64_t budgets_grown;
+	uint64_t budgets_shrunk;
+	uint64_t levels_clamped;
+} stats;
+
+/**
+ * Decides how long each task may run before it's interrupted or
+ * switched away from, by setting its |rbc_budget| and
+ * |max_succ_events|.  The scheduler notifies the policy of what
+ * stopped each task.
+ */
+class TimeslicePolicy {
+public:
+	virtual ~TimeslicePolicy() {}
+
+	virtual const char* name() const = 0;
+	/** |t| used up its rbc budget. */
+	virtual void timeslice_expired(Task* t) = 0;
+	/** |t| is entering a traced syscall. */
+	virtual void syscall(Task* t) = 0;
+};
+
+/**
+ * Give every task the same timeslice, from the -c and -e options.
+ */
+class FixedTimeslicePolicy : public TimeslicePolicy {
+public:
+	virtual const char* name() const { return "fixed"; }
+	virtual void timeslice_expired(Task* t) {}
+	virtual void syscall(Task* t) {}
+};
+
+/**
+ * Scale tasks' rbc budgets and successive-event limits in opposite
+ * directions, by powers of two, so that the amount of work a task may
+ * do before it yields stays about the same as with the fixed policy.
+ *
+ * A task that keeps using up its rbc budget is CPU-bound.  Each
+ * timeslice interrupt costs a trap, so it gets a bigger budget and
+ * correspondingly fewer successive events, i.e., fewer interrupts
+ * for the same slice.  A task that keeps making syscalls is
+ * I/O-bound, and its events are cheap syscalls rather than
+ * interrupts; it gets more successive events, so it isn't switched
+ * away from in the middle of a burst of I/O, and a smaller rbc budget
+ * so that it can't hog the CPU if it turns CPU-bound.
+ */
+class AdaptiveTimeslicePolicy : public TimeslicePolicy {
+public:
+	virtual const char* name() const { return "adaptive"; }
+	virtual void timeslice_expired(Task* t) {
+		set_level(t, t->timeslice_level + 1);
+	}
+	virtual void syscall(Task* t) {
+		set_level(t, t->timeslice_level - 1);
+	}
+
+private:
+	/* Budgets range from 1/8 to 8 times the fixed budget. */
+	static const int MAX_LEVEL = 3;
+
+	static void set_level(Task* t, int level)
+	{
+		int clamped = max(-MAX_LEVEL, min(MAX_LEVEL, level));
+		if (clamped != level) {
+			++stats.levels_clamped;
+		}
+		level = clamped;
+		if (level == t->timeslice_level) {
+			return;
+		}
+		if (level > t->timeslice_level) {
+			++stats.budgets_grown;
+		} else {
+			++stats.budgets_shrunk;
+		}
+		t->timeslice_level = level;
+		int64_t max_rbc = rr_flags()->max_rbc;
+		int max_events = rr_flags()->max_events;
+		if (level >= 0) {
+			t->rbc_budget = max_rbc << level;
+			t->max_succ_events = max(1, max_events >> level);
+		} else {
+			t->rbc_budget = max(int64_t(1), max_rbc >> -level);
+			t->max_succ_events = max_events << -level;
+		}
+		LOG(debug) <<"  "<< t->tid <<" now has rbc budget "
+			   << t->rbc_budget <<" and event limit "
+			   << t->max_succ_events;
+	}
+};
+
+static TimeslicePolicy& timeslice_policy()
+{
+	static unique_ptr<TimeslicePolicy> policy;
+	if (!policy) {
+		if (rr_flags()->adaptive_timeslice) {
+			policy.reset(new AdaptiveTimeslicePolicy());
+		} else {
+			policy.reset(new FixedTimeslicePolicy());
+		}
+	}
+	return *policy;
+}
+
+/**
+ * Tids of tasks that have been woken, or were likely woken, from
+ * FUTEX_WAIT, in the order they were woken.  The scheduler runs these
+ * ahead of the other tasks of their priority as soon as their status
+ * changes, so that a thread that was handed a lock or signaled on a
+ * condition variable gets to use it promptly, instead of after the
+ * waker's timeslice.  Each live task is listed at most once (see
+ * |Task::futex_waiter_woken|), and tasks that stop waiting are
+ * dropped at the next scheduling decision, so this stays no longer
+ * than the task list.
+ */
+static vector<pid_t> woken_futex_waiters;
+
+/**
+ * Return true if |t| is blocked in a FUTEX_WAIT.
+ */
+static bool is_in_futex_wait(Task* t)
+{
+	if (EV_SYSCALL != t->ev().type()
+	    || PROCESSING_SYSCALL != t->ev().Syscall().state
+	    || SYS_futex != t->ev().Syscall().no) {
+		return false;
+	}
+	const Registers& r = t->ev().Syscall().regs;
+	switch (r.arg2_signed() & FUTEX_CMD_MASK) {
+	case FUTEX_WAIT:
+	case FUTEX_WAIT_BITSET:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Tids of tasks that entered a traced FUTEX_WAIT, by address space
+ * and futex, so that a traced wake finds the waiters it may have woken
+ * without checking every task.  Each task is listed under at most one
+ * futex, the one its |futex_wait_uaddr| and |futex_wait_vm| name.
+ * Listed tasks may have stopped waiting since; that's checked when
+ * their futex is woken.
+ */
+typedef pair<AddressSpace*, void*> FutexKey;
+static map<FutexKey, vector<pid_t> > futex_waiters;
+
+static void unindex_futex_waiter(Task* t)
+{
+	if (!t->futex_wait_uaddr) {
+		return;
+	}
+	auto it = futex_waiters.find(FutexKey(t->futex_wait_vm,
+					      t->futex_wait_uaddr));
+	if (it != futex_waiters.end()) {
+		vector<pid_t>& tids = it->second;
+		tids.erase(remove(tids.begin(), tids.end(), t->tid),
+			   tids.end());
+		if (tids.empty()) {
+			futex_waiters.erase(it);
+		}
+	}
+	t->futex_wait_uaddr = nullptr;
+	t->futex_wait_vm = nullptr;
+}
+
+static void index_futex_waiter(Task* t, void* uaddr)
+{
+	unindex_futex_waiter(t);
+	t->futex_wait_uaddr = uaddr;
+	t->futex_wait_vm = t->vm().get();
+	futex_waiters[FutexKey(t->futex_wait_vm, uaddr)].push_back(t->tid);
+}
+
+static void note_futex_waiter_woken(Task* t)
+{
+	if (t->futex_waiter_woken) {
+		return;
+	}
+	LOG(debug) <<"  "<< t->tid <<" was woken from FUTEX_WAIT";
+	t->futex_waiter_woken = 1;
+	woken_futex_waiters.push_back(t->tid);
+}
+
+/**
+ * Return a task woken from FUTEX_WAIT whose status change we've
+ * collected, or null if there isn't one.  Forget about tasks that are
+ * no longer waiting.
+ */
+static Task* take_woken_futex_waiter(Session& session)
+{
+	Task* woken = nullptr;
+	auto keep = woken_futex_waiters.begin();
+	for (pid_t tid : woken_futex_waiters) {
+		Task* t = session.find_task(tid);
+		if (!t || !t->futex_waiter_woken) {
+			// Dead, or the tid was reused by a new task.
+			continue;
+		}
+		if (is_in_futex_wait(t)) {
+			if (woken || !t->has_pending_wait_status()) {
+				*keep++ = tid;
+				continue;
+			}
+			woken = t;
+		}
+		t->futex_waiter_woken = 0;
+	}
+	woken_futex_waiters.erase(keep, woken_futex_waiters.end());
+	return woken;
+}
+
+static void note_switch(Task* prev_t, Task* t)
 {
 	if (prev_t == t) {
 		t->succ_event_counter++;
 	} else {
 		t->succ_event_counter = 0;
+		++stats.switches;
 	}
 }
 
 static Task*
 get_next_task_with_same_priority(Task* t)
 {
-	auto tasks = t->session().tasks_by_priority();
-	auto it = tasks.find(make_pair(t->priority, t));
-	assert(it != tasks.end());
-	++it;
-	if (it == tasks.end() || it->first != t->priority) {
-		it = tasks.lower_bound(make_pair(t->priority, nullptr));
+	return t->next_same_priority;
+}
+
+/**
+ * Reap every tracee status change that's ready, without blocking, and
+ * save each with its task.  This costs one waitpid() per change
+ * (plus one), instead of one per blocked task, so afterward
+ * |Task::has_pending_wait_status()| tells which blocked tasks are
+ * ready.
+ */
+static void collect_status_changes(Session& session)
+{
+	int status;
+	pid_t tid;
+	while (0 < (tid = waitpid(-1, &status,
+				  WNOHANG | __WALL | WSTOPPED))) {
+		Task* t = session.find_task(tid);
+		if (!t) {
+			LOG(debug) <<"  "<< tid <<" changed status to "
+				   << HEX(status) <<", but it's dead";
+			continue;
+		}
+		LOG(debug) <<"  "<< tid <<" changed status to "<< HEX(status);
+		t->set_pending_wait_status(status);
+		if (is_in_futex_wait(t)) {
+			note_futex_waiter_woken(t);
+		}
+	}
+	if (-1 == tid && ECHILD != errno && EINTR != errno) {
+		FATAL() <<"Failed to waitpid(-1, NOHANG)";
+	}
+}
+
+/**
+ * Return the first task with a collected status change, in the order
+ * |find_next_runnable_task()| considers tasks: highest priority
+ * first, and round-robin from |current| within its priority.  Return
+ * null if there's no such task.
+ */
+static Task* find_task_with_pending_status(Session& session)
+{
+	for (const auto& same_priority : session.tasks_by_priority()) {
+		Task* begin_at = same_priority.second;
+		if (current && same_priority.first == current->priority) {
+			begin_at = current;
+		}
+		Task* t = begin_at;
+		do {
+			if (t->has_pending_wait_status()) {
+				return t;
+			}
+			t = t->next_same_priority;
+		} while (t != begin_at);
 	}
-	return it->second;
+	return nullptr;
 }
 
 /**
@@ -64,25 +340,59 @@ find_next_runnable_task(Session& session, int* by_waitpid)
 {
 	*by_waitpid = 0;
 
-	auto tasks = session.tasks_by_priority();
+	// Tasks that aren't blocked or unstable are stopped with
+	// their status already reaped, so they have nothing to
+	// report.  Don't ask the kernel for status changes until we
+	// reach a task that might have one, unless we need them to
+	// find a woken futex waiter.
+	bool collected = false;
+	Task* woken = nullptr;
+	if (!woken_futex_waiters.empty()) {
+		collect_status_changes(session);
+		collected = true;
+		woken = take_woken_futex_waiter(session);
+	}
+
 	// The outer loop has one iteration per unique priority value.
 	// The inner loop iterates over all tasks with that priority.
-	for (auto same_priority_start = tasks.begin();
-		same_priority_start != tasks.end();) {
-		int priority = same_priority_start->first;
-		auto same_priority_end =
-			tasks.lower_bound(make_pair(same_priority_start->first + 1, nullptr));
+	for (const auto& same_priority : session.tasks_by_priority()) {
+		int priority = same_priority.first;
 
-		auto begin_at = same_priority_start;
-	        if (current && priority == current->priority) {
-			begin_at = tasks.find(make_pair(priority, current));
+		Task* begin_at = same_priority.second;
+		if (woken && priority == woken->priority) {
+			LOG(debug) <<"  preferring woken futex waiter "
+				   << woken->tid;
+			begin_at = woken;
+		} else if (current && priority == current->priority) {
+			begin_at = current;
 		}
 
-		auto task_iterator = begin_at;
+		Task* t = begin_at;
 		do {
-			Task* t = task_iterator->second;
+			if (!collected && (t->unstable || t->may_be_blocked())) {
+				collect_status_changes(session);
+				collected = true;
+				woken = take_woken_futex_waiter(session);
+				// Every task before this one would have
+				// been runnable and returned, so |t| is
+				// where the walk began and it can
+				// start over from |woken| instead.
+				if (woken && priority == woken->priority) {
+					LOG(debug) <<"  preferring woken futex waiter "
+						   << woken->tid;
+					begin_at = t = woken;
+				}
+			}
 
 			if (t->unstable) {
+				if (t->has_pending_wait_status()) {
+					t->wait();
+					*by_waitpid = 1;
+					LOG(debug) <<"  "<< t->tid
+						   <<" is unstable, with status "
+						   << HEX(t->status());
+					return t;
+				}
 				LOG(debug) <<"  "<< t->tid
 					   <<" is unstable, doing waitpid(-1)";
 				return NULL;
@@ -95,8 +405,11 @@ find_next_runnable_task(Session& session, int* by_waitpid)
 
 			LOG(debug) <<"  "<< t->tid <<" is blocked on "
 				   << t->ev() << "checking status ...";
+			// Blocked tasks without a pending status didn't
+			// change state when we just collected changes,
+			// so there's no need to ask the kernel again.
 			if ((t->pseudo_blocked && t->wait())
-			    || t->try_wait()) {
+			    || (t->has_pending_wait_status() && t->try_wait())) {
 				t->pseudo_blocked = 0;
 				*by_waitpid = 1;
 				LOG(debug) <<"  ready with status "
@@ -105,13 +418,8 @@ find_next_runnable_task(Session& session, int* by_waitpid)
 			}
 			LOG(debug) <<"  still blocked";
 
-			++task_iterator;
-			if (task_iterator == same_priority_end) {
-				task_iterator = same_priority_start;
-			}
-		} while (task_iterator != begin_at);
-
-		same_priority_start = same_priority_end;
+			t = t->next_same_priority;
+		} while (t != begin_at);
 	}
 
 	return NULL;
@@ -120,8 +428,6 @@ find_next_runnable_task(Session& session, int* by_waitpid)
 Task* rec_sched_get_active_thread(RecordSession& session,
 				  Task* t, int* by_waitpid)
 {
-	int max_events = rr_flags()->max_events;
-
 	LOG(debug) <<"Scheduling next task";
 
 	*by_waitpid = 0;
@@ -163,7 +469,7 @@ Task* rec_sched_get_active_thread(RecordSession& session,
 
 	/* Prefer switching to the next task if the current one
 	 * exceeded its event limit. */
-	if (current && current->succ_event_counter > max_events) {
+	if (current && current->succ_event_counter > current->max_succ_events) {
 		LOG(debug) <<"  previous task exceeded event limit, preferring next";
 		current->succ_event_counter = 0;
 		current = get_next_task_with_same_priority(current);
@@ -176,14 +482,19 @@ Task* rec_sched_get_active_thread(RecordSession& session,
 	} else {
 		// All the tasks are blocked. Wait for the next one to
 		// change state.
-		int status;
-		pid_t tid;
-
 		LOG(debug) <<"  all tasks blocked or some unstable, waiting for runnable ("
 			   << session.tasks().size() <<" total)";
+		// An unstable task may have stopped us from looking
+		// at statuses we've already collected.  Those won't
+		// be reported by waitpid() again.
+		next = find_task_with_pending_status(session);
+		if (next) {
+			next->wait();
+		}
 		while (!next) {
-			tid = waitpid(-1, &status,
-				      __WALL | WSTOPPED | WUNTRACED);
+			int status;
+			pid_t tid = waitpid(-1, &status,
+					    __WALL | WSTOPPED | WUNTRACED);
 			if (-1 == tid) {
 				if (EINTR == errno) {
 					LOG(debug) <<"  waitpid(-1) interrupted";
@@ -197,15 +508,16 @@ Task* rec_sched_get_active_thread(RecordSession& session,
 			next = session.find_task(tid);
 			if (!next) {
 				LOG(debug) <<"    ... but it's dead";
+			} else {
+				next->force_status(status);
 			}
 		}
 		ASSERT(next, next->unstable || next->may_be_blocked())
 			<< "Scheduled task should have been blocked or unstable";
-		next->force_status(status);
 		*by_waitpid = 1;
 	}
 
-	note_switch(current, next, max_events);
+	note_switch(current, next);
 	current = next;
 	return current;
 }
@@ -224,6 +536,114 @@ void rec_sched_deregister_thread(Task** t_ptr)
 			current = NULL;
 		}
 	}
+	unindex_futex_waiter(t);
 	delete t;
 	*t_ptr = NULL;
 }
+
+void rec_sched_note_timeslice_expired(Task* t)
+{
+	++stats.timeslice_interrupts;
+	timeslice_policy().timeslice_expired(t);
+}
+
+void rec_sched_note_syscall(Task* t)
+{
+	++stats.syscalls;
+	timeslice_policy().syscall(t);
+
+	const Registers& r = t->regs();
+	if (SYS_futex != t->ev().Syscall().no
+	    || SYS_futex != r.original_syscallno()) {
+		return;
+	}
+	switch (r.arg2_signed() & FUTEX_CMD_MASK) {
+	case FUTEX_WAIT:
+	case FUTEX_WAIT_BITSET:
+		index_futex_waiter(t, (void*)r.arg1());
+		break;
+	}
+}
+
+/**
+ * The traced futex call of |t| may have woken waiters on |uaddr|.  We
+ * can't tell which of them the kernel woke, so treat them all as
+ * likely woken.  That's only a hint: they won't be preferred until
+ * their status actually changes.  If |requeue_to| is non-null, the
+ * waiters that weren't woken now wait on that futex instead.
+ */
+static void note_futex_wake(Task* t, void* uaddr, void* requeue_to = nullptr)
+{
+	auto it = futex_waiters.find(FutexKey(t->vm().get(), uaddr));
+	if (it == futex_waiters.end()) {
+		return;
+	}
+	vector<pid_t> tids;
+	swap(tids, it->second);
+	futex_waiters.erase(it);
+	for (pid_t tid : tids) {
+		Task* waiter = t->session().find_task(tid);
+		if (!waiter || waiter->futex_wait_uaddr != uaddr
+		    || waiter->futex_wait_vm != t->vm().get()) {
+			// Dead, or the tid was reused by a new task.
+			continue;
+		}
+		waiter->futex_wait_uaddr = nullptr;
+		waiter->futex_wait_vm = nullptr;
+		if (!is_in_futex_wait(waiter)) {
+			continue;
+		}
+		if (waiter != t) {
+			note_futex_waiter_woken(waiter);
+		}
+		if (requeue_to) {
+			index_futex_waiter(waiter, requeue_to);
+		}
+	}
+}
+
+void rec_sched_note_futex_wake(Task* t)
+{
+	const Registers& r = t->regs();
+	if (r.syscall_result_signed() <= 0) {
+		return;
+	}
+	void* uaddr = (void*)r.arg1();
+	void* uaddr2 = (void*)r.arg5();
+	switch (r.arg2_signed() & FUTEX_CMD_MASK) {
+	case FUTEX_WAKE:
+	case FUTEX_WAKE_BITSET:
+		note_futex_wake(t, uaddr);
+		break;
+	case FUTEX_WAKE_OP:
+		note_futex_wake(t, uaddr);
+		note_futex_wake(t, uaddr2);
+		break;
+	case FUTEX_REQUEUE:
+	case FUTEX_CMP_REQUEUE:
+		note_futex_wake(t, uaddr, uaddr2);
+		break;
+	}
+}
+
+void rec_sched_report_stats()
+{
+	LOG(info) <<"Scheduler ("<< timeslice_policy().name() <<" timeslices): "
+		  << stats.switches <<" task switches, "
+		  << stats.timeslice_interrupts <<" timeslice interrupts, "
+		  << stats.syscalls <<" traced syscalls";
+	if (!rr_flags()->adaptive_timeslice) {
+		return;
+	}
+	fprintf(stderr,
+		"rr: %s timeslices: %llu task switches, %llu timeslice"
+		" interrupts, %llu traced syscalls; %llu budgets grown,"
+		" %llu shrunk, %llu clamped\n",
+		timeslice_policy().name(),
+		(unsigned long long)stats.switches,
+		(unsigned long long)stats.timeslice_interrupts,
+		(unsigned long long)stats.syscalls,
+		(unsigned long long)stats.budgets_grown,
+		(unsigned long long)stats.budgets_shrunk,
+		(unsigned long long)stats.levels_clamped);
+}
@@ -21,4 +21,25 @@ Task* rec_sched_get_active_thread(RecordSession& session,
 
 void rec_sched_deregister_thread(Task** t);
 
+/**
+ * Tell the scheduler that |t| was interrupted because it used up its
+ * rbc budget, or that it's entering a traced syscall.  The timeslice
+ * policy uses these to set |t|'s rbc budget and successive-event
+ * limit.
+ */
+void rec_sched_note_timeslice_expired(Task* t);
+void rec_sched_note_syscall(Task* t);
+
+/**
+ * Tell the scheduler that |t| is exiting a traced futex() call, so
+ * that tasks it woke can be scheduled promptly.
+ */
+void rec_sched_note_futex_wake(Task* t);
+
+/**
+ * Print statistics about the scheduling decisions made during
+ * recording.
+ */
+void rec_sched_report_stats();
+
 #endif /* RR_REC_SCHED_H_ */
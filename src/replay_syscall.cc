@@ -75,6 +75,8 @@ struct syscall_def {
 #define SYSCALL_NUM(_name) static_cast<int>(SyscallsX86::_name)
 #define SYSCALL_DEF0(_name, _type)		\
 	{ SYSCALL_NUM(_name), rep_##_type, 0 },
+#define SYSCALL_DEF0_TRIVIAL(_name, _type)	\
+	SYSCALL_DEF0(_name, _type)
 #define SYSCALL_DEF1(_name, _type, _, _1)	\
 	{ SYSCALL_NUM(_name), rep_##_type, 1 },
 #define SYSCALL_DEF1_DYNSIZE(_name, _type, _, _1)	\
@@ -99,6 +101,7 @@ static struct syscall_def syscall_defs[] = {
 
 #undef SYSCALLNO_X86
 #undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
 #undef SYSCALL_DEF1
 #undef SYSCALL_DEF1_DYNSIZE
 #undef SYSCALL_DEF1_STR
@@ -132,6 +135,8 @@ static void init_syscall_table()
 		      "Incorrect syscall number for " #_name);
 #define SYSCALL_DEF0(_name, _type)		\
 	CHECK_SYSCALL_NUM(_name)
+#define SYSCALL_DEF0_TRIVIAL(_name, _type)	\
+	SYSCALL_DEF0(_name, _type)
 #define SYSCALL_DEF1(_name, _type, _, _1)	\
 	CHECK_SYSCALL_NUM(_name)
 #define SYSCALL_DEF1_DYNSIZE(_name, _type, _, _1)	\
@@ -154,6 +159,7 @@ static void init_syscall_table()
 #undef SYSCALLNO_X86
 #undef CHECK_SYSCALL_NUM
 #undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
 #undef SYSCALL_DEF1
 #undef SYSCALL_DEF1_DYNSIZE
 #undef SYSCALL_DEF1_STR
@@ -285,10 +291,8 @@ static void exit_syscall_emu_ret(Task* t, int syscall)
 static void exit_syscall_emu(Task* t,
 			     int syscall, int num_emu_args)
 {
-	int i;
-
-	for (i = 0; i < num_emu_args; ++i) {
-		t->set_data_from_trace();
+	if (num_emu_args > 0) {
+		t->set_data_from_trace_records(num_emu_args);
 	}
 	exit_syscall_emu_ret(t, syscall);
 }
@@ -753,7 +757,7 @@ static void* finish_private_mmap(Task* t,
 		     // device/inode info for this anonymous mapping.
 		     // Preserve the mapping name though, so
 		     // AddressSpace::dump() shows something useful.
-		     MappableResource(FileId(), file->filename));
+		     MappableResource(FileId(), file->filename.c_str()));
 
 	return mapped_addr;
 }
@@ -762,7 +766,7 @@ static void verify_backing_file(const struct mmapped_file* file,
 				int prot, int flags)
 {
 	struct stat metadata;
-	if (stat(file->filename, &metadata)) {
+	if (stat(file->filename.c_str(), &metadata)) {
 		FATAL() <<"Failed to stat "<< file->filename
 			<<": replay is impossible";
 	}
@@ -775,8 +779,8 @@ static void verify_backing_file(const struct mmapped_file* file,
 	    || metadata.st_ctime != file->stat.st_ctime) {
 		LOG(error) <<"Metadata of "<< file->filename <<" changed: replay divergence likely, but continuing anyway ...";
 	}
-	if (should_copy_mmap_region(file->filename, &metadata, prot, flags,
-				    WARN_DEFAULT)) {
+	if (should_copy_mmap_region(file->filename.c_str(), &metadata,
+				    prot, flags, WARN_DEFAULT)) {
 		LOG(error) << file->filename <<" wasn't copied during recording, but now it should be?";
 	}
 
@@ -809,7 +813,8 @@ static void* finish_direct_mmap(Task* t,
 	 * recording. */
 	{
 		struct restore_mem restore;
-		void* child_str = push_tmp_str(t, state, file->filename,
+		void* child_str = push_tmp_str(t, state,
+					       file->filename.c_str(),
 					       &restore);
 		/* We only need RDWR for shared writeable mappings.
 		 * Private mappings will happily COW from the mapped
@@ -844,7 +849,7 @@ static void* finish_direct_mmap(Task* t,
 		t->vm()->map(mapped_addr, length, prot, flags,
 			     page_size() * offset_pages,
 			     MappableResource(FileId(file->stat),
-					      file->filename));
+					      file->filename.c_str()));
 	}
 
 	return mapped_addr;
@@ -869,8 +874,7 @@ static void* finish_shared_mmap(Task* t,
 	// no "real" name for the file anywhere, to ensure that when
 	// we exit/crash the kernel will clean up for us.
 	struct mmapped_file vfile = *file;
-	strncpy(vfile.filename, emufile->proc_path().c_str(),
-		sizeof(vfile.filename));
+	vfile.filename = emufile->proc_path();
 	void* mapped_addr = finish_direct_mmap(t, state, trace, prot, flags,
 					       offset_pages,
 					       &vfile, DONT_VERIFY,
@@ -882,7 +886,7 @@ static void* finish_shared_mmap(Task* t,
 	// TODO: this is a poor man's shared segment synchronization.
 	// For full generality, we also need to emulate direct file
 	// modifications through write/splice/etc.
-	struct raw_data buf;
+	struct raw_data_view buf;
 	t->ifstream() >> buf;
 	assert(mapped_addr == buf.addr
 	       && rec_num_bytes == ceil_page_size(buf.data.size()));
@@ -1149,7 +1153,7 @@ static void maybe_verify_tracee_saved_data(Task* t,
 		return;
 	}
 
-	struct raw_data rec;
+	struct raw_data_view rec;
 	t->ifstream() >> rec;
 
 	// If the data address changed, something disastrous happened
@@ -1552,10 +1556,10 @@ void rep_process_syscall(Task* t, struct rep_trace_step* step)
 			step->action = TSTEP_ENTER_SYSCALL;
 			return;
 		}
-		struct mmsghdr* msg = (struct mmsghdr*)rec_regs->arg2();
+		struct mmsghdr* msgs = (struct mmsghdr*)rec_regs->arg2();
 		int nmmsgs = rec_regs->syscall_result_signed();
-		for (int i = 0; i < nmmsgs; ++i, ++msg) {
-			restore_struct_mmsghdr(t, msg);
+		if (nmmsgs > 0) {
+			restore_struct_mmsghdrs(t, msgs, nmmsgs);
 		}
 		step->action = TSTEP_EXIT_SYSCALL;
 		return;
@@ -1576,8 +1580,8 @@ void rep_process_syscall(Task* t, struct rep_trace_step* step)
 			return;
 		}
 		int nmmsgs = rec_regs->syscall_result_signed();
-		for (int i = 0; i < nmmsgs; ++i) {
-			t->set_data_from_trace();
+		if (nmmsgs > 0) {
+			t->set_data_from_trace_records(nmmsgs);
 		}
 		step->action = TSTEP_EXIT_SYSCALL;
 		return;
@@ -1216,21 +1216,22 @@ static void prepare_syscallbuf_records(Task* t)
 
 	// Read the recorded syscall buffer back into the buffer
 	// region.
-	struct raw_data buf;
+	struct raw_data_view buf;
 	t->ifstream() >> buf;
 	flush->num_rec_bytes_remaining = buf.data.size();
 
-	assert(flush->num_rec_bytes_remaining <= SYSCALLBUF_BUFFER_SIZE);
-	memcpy(t->replay_session().syscallbuf_flush_buffer(), buf.data.data(),
-		flush->num_rec_bytes_remaining);
+	assert(flush->num_rec_bytes_remaining <= SYSCALLBUF_MAX_BUFFER_SIZE);
+	t->replay_session().set_syscallbuf_flush_buffer(buf.data.data(),
+							flush->num_rec_bytes_remaining);
 
 	// The stored num_rec_bytes in the header doesn't include the
 	// header bytes, but the stored trace data does.
-	flush->num_rec_bytes_remaining -= sizeof(sizeof(struct syscallbuf_hdr));
+	flush->num_rec_bytes_remaining -= sizeof(struct syscallbuf_hdr);
 	assert(buf.addr == t->syscallbuf_child);
 	const syscallbuf_hdr* flush_hdr =
 		t->replay_session().syscallbuf_flush_buffer_hdr();
 	assert(flush_hdr->num_rec_bytes == flush->num_rec_bytes_remaining);
+	t->note_syscallbuf_flushed(*flush_hdr);
 
 	flush->syscall_record_offset = 0;
 
@@ -1317,7 +1318,10 @@ static int flush_one_syscall(Task* t, int stepi)
 	int call = rec_rec->syscallno;
 	int ret;
 	// TODO: use syscall_defs table information to determine this.
-	int emu = (SYS_madvise == call) ? EXEC : EMU;
+	// The prctls around a patched rdtsc toggle rdtsc trapping,
+	// so they have to be executed.
+	int emu = (SYS_madvise == call || SYS_mprotect == call
+		   || SYS_prctl == call) ? EXEC : EMU;
 
 	switch (flush->state) {
 	case FLUSH_START:
@@ -1400,6 +1404,12 @@ static int flush_one_syscall(Task* t, int stepi)
 		case SYS_futex:
 			restore_futex_words(t, rec_rec);
 			break;
+		case SYS_mprotect: {
+			const struct mprotect_record* mrec =
+				(const struct mprotect_record*)rec_rec->extra_data;
+			t->vm()->protect(mrec->addr, mrec->len, mrec->prot);
+			break;
+		}
 		case SYS_write:
 			rep_maybe_replay_stdio_write(t);
 			break;
@@ -1639,7 +1649,7 @@ static bool setup_replay_one_trace_frame(struct dbg_context* dbg, Task* t)
 		step.flush.num_rec_bytes_remaining = 0;
 		break;
 	case EV_SYSCALLBUF_RESET:
-		t->syscallbuf_hdr->num_rec_bytes = 0;
+		t->reset_syscallbuf();
 		step.action = TSTEP_RETIRE;
 		break;
 	case EV_SCHED:
@@ -1651,6 +1661,13 @@ static bool setup_replay_one_trace_frame(struct dbg_context* dbg, Task* t)
 		step.action = TSTEP_DETERMINISTIC_SIGNAL;
 		step.signo = SIGSEGV;
 		break;
+	case EV_PATCH_RDTSC:
+		// The stub, then the patched site.  The recorded ip
+		// is in the stub, so it has to be written first.
+		t->set_data_from_trace_records(2);
+		t->set_regs(t->current_trace_frame().recorded_regs);
+		step.action = TSTEP_RETIRE;
+		break;
 	case EV_INTERRUPTED_SYSCALL_NOT_RESTARTED:
 		LOG(debug) <<"  popping interrupted but not restarted "
 			   << t->ev();
@@ -1994,6 +2011,15 @@ static void init_session()
 			putenv(strdup(*it));
 		}
 	}
+	if (session->ifstream().starts_at_snapshot()) {
+		// The start of a ring-buffer recording was discarded,
+		// so begin from the state saved in its oldest
+		// snapshot.
+		struct trace_snapshot snapshot;
+		session->ifstream().read_start_snapshot(snapshot);
+		session->restore_snapshot(ae, snapshot, session);
+		return;
+	}
 	session->create_task(ae, session,
 			     session->ifstream().peek_frame().tid);
 }
@@ -2084,6 +2110,12 @@ static void serve_replay(int argc, char* argv[], char** envp)
 	init_libpfm();
 
 	init_session();
+	if (rr_flags()->autopilot) {
+		// Without a debugger the trace is read straight
+		// through, nothing clones it and we won't fork any
+		// more tasks, so reading ahead is safe and pays off.
+		session->ifstream().enable_read_ahead();
+	}
 	replay_trace_frames();
 
 	close_libpfm();
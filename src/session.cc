@@ -4,6 +4,8 @@
 
 #include "session.h"
 
+#include <sched.h>
+#include <string.h>
 #include <syscall.h>
 #include <sys/prctl.h>
 
@@ -124,22 +126,59 @@ void
 Session::on_destroy(Task* t)
 {
 	task_map.erase(t->rec_tid);
-	task_priority_set.erase(make_pair(t->priority, t));
+	unlink_by_priority(t);
 }
 
 void
 Session::track(Task* t)
 {
 	task_map[t->rec_tid] = t;
-	task_priority_set.insert(make_pair(t->priority, t));
+	link_by_priority(t);
 }
 
 void
 Session::update_task_priority(Task* t, int value)
 {
-	task_priority_set.erase(make_pair(t->priority, t));
+	unlink_by_priority(t);
 	t->priority = value;
-	task_priority_set.insert(make_pair(t->priority, t));
+	link_by_priority(t);
+}
+
+/**
+ * Add |t| to the end of its priority's round-robin list, just before
+ * the task that the list starts at.
+ */
+void
+Session::link_by_priority(Task* t)
+{
+	Task*& first = task_priority_map[t->priority];
+	if (!first) {
+		first = t->next_same_priority = t->prev_same_priority = t;
+		return;
+	}
+	t->next_same_priority = first;
+	t->prev_same_priority = first->prev_same_priority;
+	first->prev_same_priority->next_same_priority = t;
+	first->prev_same_priority = t;
+}
+
+void
+Session::unlink_by_priority(Task* t)
+{
+	auto it = task_priority_map.find(t->priority);
+	assert(it != task_priority_map.end());
+	if (t->next_same_priority == t) {
+		task_priority_map.erase(it);
+	} else {
+		if (it->second == t) {
+			it->second = t->next_same_priority;
+		}
+		t->prev_same_priority->next_same_priority =
+			t->next_same_priority;
+		t->next_same_priority->prev_same_priority =
+			t->prev_same_priority;
+	}
+	t->next_same_priority = t->prev_same_priority = nullptr;
 }
 
 Task*
@@ -160,13 +199,107 @@ RecordSession::create(const string& exe_path)
 	return session;
 }
 
-static void
-remap_shared_mmap(Task* t, struct current_state_buffer* state,
-		  ReplaySession& session,
+bool
+RecordSession::can_snapshot()
+{
+	if (!can_validate()) {
+		return false;
+	}
+	for (auto& kv : tasks()) {
+		Task* t = kv.second;
+		if (EV_SENTINEL != t->ev().type() || t->has_stashed_sig()
+		    || t->unstable
+		    || t->flushed_syscallbuf || t->delay_syscallbuf_reset
+		    || (t->syscallbuf_hdr && t->syscallbuf_hdr->num_rec_bytes)
+		    // Replay recreates each process from its group
+		    // leader.
+		    || !find_task(t->tgid())) {
+			return false;
+		}
+	}
+	for (auto vm : vms()) {
+		pid_t tgid = (*vm->task_set().begin())->tgid();
+		for (auto t : vm->task_set()) {
+			if (t->tgid() != tgid) {
+				return false;
+			}
+		}
+		for (auto& kv : vm->memmap()) {
+			if ((MAP_SHARED & kv.first.flags)
+			    && PSEUDODEVICE_SYSCALLBUF != kv.second.id.psdev) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+/* Bounds on the number of events to wait before checking again
+ * whether a due snapshot can be taken. */
+#define MIN_SNAPSHOT_RETRY_EVENTS 16
+#define MAX_SNAPSHOT_RETRY_EVENTS 1024
+
+void
+RecordSession::maybe_write_snapshot()
+{
+	if (!ofstream().snapshot_due()
+	    || ofstream().time() < next_snapshot_attempt) {
+		return;
+	}
+	if (!can_snapshot()) {
+		snapshot_retry_events = (snapshot_retry_events ?
+					 MIN(2 * snapshot_retry_events,
+					     MAX_SNAPSHOT_RETRY_EVENTS) :
+					 MIN_SNAPSHOT_RETRY_EVENTS);
+		next_snapshot_attempt = ofstream().time() + snapshot_retry_events;
+		LOG(debug) <<"Can't snapshot before event "<< ofstream().time()
+			   <<"; retrying in "<< snapshot_retry_events
+			   <<" events";
+		return;
+	}
+	snapshot_retry_events = 0;
+	next_snapshot_attempt = 0;
+	struct trace_snapshot s;
+	s.global_time = ofstream().time();
+	LOG(debug) <<"Writing snapshot before event "<< s.global_time;
+	for (auto vm : vms()) {
+		Task* leader = find_task((*vm->task_set().begin())->tgid());
+		s.vms.push_back(vm_snapshot());
+		vm_snapshot& vs = s.vms.back();
+		vm->save_snapshot(leader, vs);
+		vs.tasks.push_back(task_snapshot());
+		leader->save_snapshot(vs.tasks.back());
+		for (auto t : vm->task_set()) {
+			if (t != leader) {
+				vs.tasks.push_back(task_snapshot());
+				t->save_snapshot(vs.tasks.back());
+			}
+		}
+	}
+	ofstream() << s;
+}
+
+/** A shared mapping being remapped by a |RemoteSyscallBatch|. */
+struct shared_mmap_remap {
+	Mapping m;
+	string path;
+	// The batched open() and mmap2() calls.
+	RemoteSyscallBatch::Arg fd;
+	RemoteSyscallBatch::Arg addr;
+};
+
+/**
+ * Add to |batch| the syscalls that remap the shared region |m| of
+ * |r| onto the clone of its emulated file in |session|.  The results
+ * have to be checked with |check_shared_mmap_remap()| after the
+ * batch runs.
+ */
+static shared_mmap_remap
+remap_shared_mmap(RemoteSyscallBatch& batch, ReplaySession& session,
 		  const Mapping& m, const MappableResource& r)
 {
 	LOG(debug) <<"    remapping shared region at "<< m.start <<"-"<< m.end;
-	remote_syscall2(t, state, SYS_munmap, m.start, m.num_bytes());
+	batch.add(SYS_munmap, m.start, m.num_bytes());
 	// NB: we don't have to unmap then re-map |t->vm()|'s idea of
 	// the emulated file mapping.  Though we'll be remapping the
 	// *real* OS mapping in |t| to a different file, that new
@@ -176,34 +309,32 @@ remap_shared_mmap(Task* t, struct current_state_buffer* state,
 	auto emufile = session.emufs().at(r.id);
 	// TODO: this duplicates some code in replay_syscall.cc, but
 	// it's somewhat nontrivial to factor that code out.
-	int remote_fd;
-	{
-		string path = emufile->proc_path();
-		struct restore_mem restore_path;
-		void* child_path = push_tmp_str(t, state, path.c_str(),
-						&restore_path);
-		int oflags = (MAP_SHARED & m.flags) && (PROT_WRITE & m.prot) ?
-			     O_RDWR : O_RDONLY;
-		remote_fd = remote_syscall2(t, state, SYS_open,
-					    child_path, oflags);
-		if (0 > remote_fd) {
-			FATAL() <<"Couldn't open "<< path <<" in tracee";
-		}
-		pop_tmp_mem(t, state, &restore_path);
+	string path = emufile->proc_path();
+	int oflags = (MAP_SHARED & m.flags) && (PROT_WRITE & m.prot) ?
+		     O_RDWR : O_RDONLY;
+	RemoteSyscallBatch::Arg fd =
+		batch.add(SYS_open, batch.push_str(path.c_str()), oflags);
+	RemoteSyscallBatch::Arg addr =
+		batch.add(SYS_mmap2, m.start, m.num_bytes(), m.prot,
+			  // The remapped segment *must* be
+			  // remapped at the same address, or else
+			  // many things will go haywire.
+			  m.flags | MAP_FIXED,
+			  fd, m.offset / page_size());
+	batch.add(SYS_close, fd);
+
+	shared_mmap_remap remap = { m, path, fd, addr };
+	return remap;
+}
+
+static void
+check_shared_mmap_remap(Task* t, const RemoteSyscallBatch& batch,
+			const shared_mmap_remap& remap)
+{
+	if (0 > batch.result(remap.fd)) {
+		FATAL() <<"Couldn't open "<< remap.path <<" in tracee";
 	}
-	void* addr = (void*)
-		     remote_syscall6(t, state, SYS_mmap2,
-				     m.start, m.num_bytes(),
-				     m.prot,
-				     // The remapped segment *must* be
-				     // remapped at the same address,
-				     // or else many things will go
-				     // haywire.
-				     m.flags | MAP_FIXED,
-				     remote_fd, m.offset / page_size());
-	ASSERT(t, addr == m.start);
-
-	remote_syscall1(t, state, SYS_close, remote_fd);
+	ASSERT(t, (void*)batch.result(remap.addr) == remap.m.start);
 }
 
 ReplaySession::shr_ptr
@@ -221,8 +352,7 @@ ReplaySession::clone()
 	session->trace_frame = trace_frame;
 	session->replay_step = replay_step;
 	session->trace_frame_reached = trace_frame_reached;
-	memcpy(session->syscallbuf_flush_buffer_array, syscallbuf_flush_buffer_array,
-		sizeof(syscallbuf_flush_buffer_array));
+	session->syscallbuf_flush_buffer_array = syscallbuf_flush_buffer_array;
 
 	for (auto vm : sas) {
 		// Creating a checkpoint of a session with active breakpoints
@@ -248,14 +378,20 @@ ReplaySession::clone()
 		struct current_state_buffer state;
 		prepare_remote_syscalls(clone_leader, &state);
 
+		RemoteSyscallBatch remaps;
+		vector<shared_mmap_remap> remapped;
 		for (auto& kv : clone_leader->vm()->memmap()) {
 			const Mapping& m = kv.first;
 			const MappableResource& r = kv.second;
 			if (!r.is_shared_mmap_file()) {
 				continue;
 			}
-			remap_shared_mmap(clone_leader, &state, *session,
-					  m, r);
+			remapped.push_back(remap_shared_mmap(remaps, *session,
+							     m, r));
+		}
+		remaps.run(clone_leader, &state);
+		for (auto& remap : remapped) {
+			check_shared_mmap_remap(clone_leader, remaps, remap);
 		}
 
 		for (auto t : group_leader->task_group()->task_set()) {
@@ -293,6 +429,72 @@ ReplaySession::create_task(const struct args_env& ae, shr_ptr self,
 	return t;
 }
 
+void
+ReplaySession::restore_snapshot(const struct args_env& ae,
+				const struct trace_snapshot& s, shr_ptr self)
+{
+	assert(self.get() == this && tasks().empty());
+	LOG(debug) <<"Restoring snapshot taken before event "<< s.global_time;
+
+	for (auto& vs : s.vms) {
+		const task_snapshot& leader_snapshot = vs.tasks[0];
+		// exec() the recorded image, so that the kernel sets
+		// up the process like it did during recording.  The
+		// arguments don't matter, because all of the memory
+		// is replaced, but $PATH may be needed to find the
+		// image.
+		struct args_env exe_ae;
+		exe_ae.exe_image = vs.exe_image;
+		exe_ae.argv.push_back(strdup(vs.exe_image.c_str()));
+		exe_ae.argv.push_back(nullptr);
+		for (auto it = ae.envp.begin(); it != ae.envp.end() && *it;
+		     ++it) {
+			exe_ae.envp.push_back(strdup(*it));
+		}
+		exe_ae.envp.push_back(nullptr);
+
+		Task* leader = Task::spawn(exe_ae, *this,
+					   leader_snapshot.rec_tid);
+		track(leader);
+		leader->session_replay = self.get();
+		while (PTRACE_EVENT_EXEC != leader->ptrace_event()) {
+			leader->cont_syscall();
+		}
+		// Finish the execve.
+		leader->cont_syscall();
+		after_exec();
+		leader->execve_file = vs.exe_image;
+		leader->post_exec();
+		LOG(debug) <<"  restoring address space of "
+			   << leader_snapshot.rec_tid
+			   <<" (real: "<< leader->tid <<")";
+		leader->vm()->restore_snapshot(leader, vs);
+
+		// Create the other threads from the leader's restored
+		// state, like |clone()| does.
+		leader->set_regs(leader_snapshot.regs);
+		struct current_state_buffer state;
+		prepare_remote_syscalls(leader, &state);
+		for (size_t i = 1; i < vs.tasks.size(); ++i) {
+			const task_snapshot& ts = vs.tasks[i];
+			LOG(debug) <<"    cloning "<< ts.rec_tid;
+			Task* t = Task::os_clone(leader, this, &state,
+						 ts.rec_tid,
+						 (CLONE_VM | CLONE_FS |
+						  CLONE_FILES | CLONE_SIGHAND |
+						  CLONE_THREAD |
+						  CLONE_SYSVSEM),
+						 ts.top_of_stack);
+			t->session_replay = self.get();
+			track(t);
+			t->restore_snapshot(ts);
+		}
+		finish_remote_syscalls(leader, &state);
+		leader->restore_snapshot(leader_snapshot);
+	}
+	assert(vms().size() > 0);
+}
+
 void
 ReplaySession::gc_emufs()
 {
@@ -320,5 +522,14 @@ ReplaySession::create(int argc, char* argv[])
 	shr_ptr session(new ReplaySession());
 	session->emu_fs = EmuFs::create();
 	session->trace_ifstream = TraceIfstream::open(argc, argv);
+	// Skip replaying the part of the trace before the goto
+	// target, if a snapshot lets us.  Finding a target process
+	// requires seeing it being created, so that can't skip.
+	const struct flags* flags = rr_flags();
+	if (flags->goto_event > 0 && !flags->autopilot
+	    && !flags->target_process) {
+		session->trace_ifstream->start_at_snapshot_before(
+			flags->goto_event);
+	}
 	return session;
 }
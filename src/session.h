@@ -8,6 +8,7 @@
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "preload/syscall_buffer.h"
 
@@ -38,8 +39,11 @@ class Session {
 public:
 	typedef std::set<AddressSpace*> AddressSpaceSet;
 	typedef std::map<pid_t, Task*> TaskMap;
-	// Tasks sorted by priority.
-	typedef std::set<std::pair<int, Task*> > TaskPrioritySet;
+	// Maps each priority in use to one of its tasks.  The tasks
+	// of each priority are linked in a circular list through
+	// |Task::next_same_priority|, so walking the list from any of
+	// them visits all of them in round-robin order.
+	typedef std::map<int, Task*> TaskPriorityMap;
 
 	/**
 	 * Call |after_exec()| after a tracee has successfully
@@ -100,8 +104,8 @@ public:
 	/** Return the set of Tasks being tracekd in this session. */
 	const TaskMap& tasks() const { return task_map; }
 
-	/** Get tasks organized by priority. */
-	const TaskPrioritySet& tasks_by_priority() { return task_priority_set;}
+	/** Get tasks organized by priority, highest priority first. */
+	const TaskPriorityMap& tasks_by_priority() { return task_priority_map; }
 
 	/**
 	 * Set the priority of |t| to |value| and update related
@@ -119,10 +123,12 @@ protected:
 	~Session();
 
 	void track(Task* t);
+	void link_by_priority(Task* t);
+	void unlink_by_priority(Task* t);
 
 	AddressSpaceSet sas;
 	TaskMap task_map;
-	TaskPrioritySet task_priority_set;
+	TaskPriorityMap task_priority_map;
 	bool tracees_consistent;
 
 	Session(const Session&) = delete;
@@ -142,6 +148,13 @@ public:
 
 	TraceOfstream& ofstream() { return *trace_ofstream; }
 
+	/**
+	 * If the trace is due a snapshot of the tracees (see
+	 * |TraceOfstream::snapshot_due()|), and they're all at a
+	 * point where one can be taken, write one.
+	 */
+	void maybe_write_snapshot();
+
 	/**
 	 * Create a recording session for the initial exe image
 	 * |exe_path|.  (That argument is used to name the trace
@@ -150,7 +163,28 @@ public:
 	static shr_ptr create(const std::string& exe_path);
 
 private:
+	RecordSession()
+		: next_snapshot_attempt(0)
+		, snapshot_retry_events(0)
+	{}
+
+	/**
+	 * Return true iff replay can recreate the current state of all
+	 * tracees from a snapshot: no task is in the middle of
+	 * processing an event, and there's nothing replay can't
+	 * restore, like shared mappings.
+	 */
+	bool can_snapshot();
+
 	std::shared_ptr<TraceOfstream> trace_ofstream;
+	// When a due snapshot can't be taken, checking again at every
+	// event is wasted work if the tracees stay in that state, as
+	// when they have a shared mapping.  So the check is put off
+	// until |next_snapshot_attempt|, |snapshot_retry_events|
+	// events later, and that delay doubles each time the check
+	// fails again.
+	uint32_t next_snapshot_attempt;
+	uint32_t snapshot_retry_events;
 };
 
 /** Encapsulates additional session state related to replay. */
@@ -177,6 +211,14 @@ public:
 	Task* create_task(const struct args_env& ae, shr_ptr self,
 			  pid_t rec_tid);
 
+	/**
+	 * Instead of |create_task()|, recreate the tracees saved in
+	 * |s|.  The environment of the initial tracee, |ae|, is used
+	 * to exec() each restored process.
+	 */
+	void restore_snapshot(const struct args_env& ae,
+			      const struct trace_snapshot& s, shr_ptr self);
+
 	EmuFs& emufs() { return *emu_fs; }
 
 	/** Collect garbage files from this session's emufs. */
@@ -194,11 +236,12 @@ public:
 	 */
 	struct rep_trace_step& current_replay_step() { return replay_step; }
 
-	byte* syscallbuf_flush_buffer() {
-		return syscallbuf_flush_buffer_array;
+	void set_syscallbuf_flush_buffer(const byte* data, size_t len) {
+		syscallbuf_flush_buffer_array.assign(data, data + len);
 	}
 	const struct syscallbuf_hdr* syscallbuf_flush_buffer_hdr() {
-		return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer_array;
+		return (const struct syscallbuf_hdr*)
+			syscallbuf_flush_buffer_array.data();
 	}
 
 	bool& reached_trace_frame() { return trace_frame_reached; }
@@ -239,7 +282,9 @@ public:
 
 	/**
 	 * Create a replay session that will use the trace specified
-	 * by the commad-line args |argc|/|argv|.  Return it.
+	 * by the commad-line args |argc|/|argv|.  Return it.  When
+	 * going to an event, replay starts at the latest recorded
+	 * snapshot before it, if there is one.
 	 */
 	static shr_ptr create(int argc, char* argv[]);
 
@@ -264,9 +309,9 @@ private:
 	 * tracees.  At the start of the flush, the recorded bytes are read
 	 * back into this buffer.  Then they're copied back to the tracee
 	 * record-by-record, as the tracee exits those syscalls.
-	 * This needs to be word-aligned.
+	 * This needs to be word-aligned, which vector storage is.
 	 */
-	byte syscallbuf_flush_buffer_array[SYSCALLBUF_BUFFER_SIZE];
+	std::vector<byte> syscallbuf_flush_buffer_array;
 	/**
 	 * True when the session has reached the state in trace_frame.
 	 * False when the session is working towards the state in trace_frame.
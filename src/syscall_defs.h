@@ -21,6 +21,11 @@
  *   specify the size of each argument, for example |t->regs().syscall_result() *
  *   sizeof(int)|.
  *
+ *   DEF0_TRIVIAL(name, semantics) -> like DEF0(), but additionally
+ *   the syscall has no side effects and can't block, so recording it
+ *   only requires saving its return value.  The preload library does
+ *   that itself for these syscalls, without trapping to rr.
+ *
  *   DEF_IRREG(name, irreg_semantics) -> the syscall doesn't fit a
  *   regular pattern; hand-written code is needed to process the
  *   syscall args.
@@ -202,7 +207,7 @@ SYSCALL_DEF0(lseek, EMU)
  * often used by routines that generate unique temporary
  * filenames.)
  */
-SYSCALL_DEF0(getpid, EMU)
+SYSCALL_DEF0_TRIVIAL(getpid, EMU)
 
 SYSCALL_DEF_UNSUPPORTED(mount)
 SYSCALL_DEF_UNSUPPORTED(umount)
@@ -420,14 +425,14 @@ SYSCALL_DEF0(dup2, EMU)
  * getppid() returns the process ID of the parent of the calling
  * process.
  */
-SYSCALL_DEF0(getppid, EMU)
+SYSCALL_DEF0_TRIVIAL(getppid, EMU)
 
 /**
  *  pid_t getpgrp(void)
  *
  * The POSIX.1 getpgrp() always returns the PGID of the caller.
  */
-SYSCALL_DEF0(getpgrp, EMU)
+SYSCALL_DEF0_TRIVIAL(getpgrp, EMU)
 
 /**
  *  pid_t setsid(void)
@@ -906,7 +911,7 @@ SYSCALL_DEF0(sched_setscheduler, EMU)
  * applied to the process identified by pid.  If pid equals zero, the
  * policy of the calling process will be retrieved.
  */
-SYSCALL_DEF0(sched_getscheduler, EMU)
+SYSCALL_DEF0_TRIVIAL(sched_getscheduler, EMU)
 
 /**
  *  int sched_yield(void)
@@ -923,7 +928,7 @@ SYSCALL_DEF0(sched_yield, EMU)
  * sched_get_priority_max() returns the maximum priority value that
  * can be used with the scheduling algorithm identified by policy.
  */
-SYSCALL_DEF0(sched_get_priority_max, EMU)
+SYSCALL_DEF0_TRIVIAL(sched_get_priority_max, EMU)
 
 /**
  *  int sched_get_priority_min(int policy)
@@ -931,7 +936,7 @@ SYSCALL_DEF0(sched_get_priority_max, EMU)
  * sched_get_priority_min() returns the minimum priority value that
  * can be used with the scheduling algorithm identified by policy.
  */
-SYSCALL_DEF0(sched_get_priority_min, EMU)
+SYSCALL_DEF0_TRIVIAL(sched_get_priority_min, EMU)
 
 SYSCALL_DEF_UNSUPPORTED(sched_rr_get_interval)
 
@@ -1108,28 +1113,28 @@ SYSCALL_DEF_UNSUPPORTED(lchown32)
  *
  * getuid() returns the real user ID of the calling process
  */
-SYSCALL_DEF0(getuid32, EMU)
+SYSCALL_DEF0_TRIVIAL(getuid32, EMU)
 
 /**
  *  gid_t getgid(void);
  *
  * getgid() returns the real group ID of the calling process.
  */
-SYSCALL_DEF0(getgid32, EMU)
+SYSCALL_DEF0_TRIVIAL(getgid32, EMU)
 
 /**
  *  uid_t geteuid(void);
  *
  * geteuid() returns the effective user ID of the calling process.
  */
-SYSCALL_DEF0(geteuid32, EMU)
+SYSCALL_DEF0_TRIVIAL(geteuid32, EMU)
 
 /**
  *  gid_t getegid(void);
  *
  * getegid() returns the effective group ID of the calling process.
  */
-SYSCALL_DEF0(getegid32, EMU)
+SYSCALL_DEF0_TRIVIAL(getegid32, EMU)
 
 SYSCALL_DEF_UNSUPPORTED(setreuid32)
 
@@ -1245,7 +1250,7 @@ SYSCALLNO_X86(224)
  *
  * gettid() returns the caller's thread ID (TID).
  */
-SYSCALL_DEF0(gettid, EMU)
+SYSCALL_DEF0_TRIVIAL(gettid, EMU)
 
 /**
  *  ssize_t readahead(int fd, off64_t offset, size_t count);
@@ -9,6 +9,8 @@ enum class SyscallsX86 {
 		dummy_ ## num = num - 1,
 #define SYSCALL_DEF0(_name, _type)			\
 		_name,
+#define SYSCALL_DEF0_TRIVIAL(_name, _type)	\
+		SYSCALL_DEF0(_name, _type)
 #define SYSCALL_DEF1(_name, _type, _1, _2)		\
 		_name,
 #define SYSCALL_DEF1_DYNSIZE(_name, _type, _1, _2)	\
@@ -30,6 +32,7 @@ enum class SyscallsX86 {
 
 #undef SYSCALLNO_X86
 #undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
 #undef SYSCALL_DEF1
 #undef SYSCALL_DEF1_DYNSIZE
 #undef SYSCALL_DEF1_STR
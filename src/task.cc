@@ -6,6 +6,7 @@
 
 #include <errno.h>
 #include <linux/kdev_t.h>
+#include <limits.h>
 #include <linux/net.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,7 @@
 #include <sys/personality.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 
 #include <limits>
@@ -106,7 +108,7 @@ MappableResource::shared_mmap_file(const struct mmapped_file& file)
 {
 	return MappableResource(
 		FileId(file.stat, PSEUDODEVICE_SHARED_MMAP_FILE),
-		file.filename);
+		file.filename.c_str());
 }
 
 /*static*/ MappableResource
@@ -750,6 +752,29 @@ AddressSpace::vdso() const
 	return mapping_of(vdso_start_addr, 1).first;
 }
 
+void
+AddressSpace::set_rdtsc_stubs(void* hook_trampoline, void* stubs,
+			      size_t num_bytes)
+{
+	if (rdtsc_stubs_start == stubs) {
+		return;
+	}
+	rdtsc_hook = hook_trampoline;
+	rdtsc_stubs_start = rdtsc_stubs_next = (byte*)stubs;
+	rdtsc_stubs_end = rdtsc_stubs_start + num_bytes;
+}
+
+void*
+AddressSpace::alloc_rdtsc_stub(size_t num_bytes)
+{
+	if (size_t(rdtsc_stubs_end - rdtsc_stubs_next) < num_bytes) {
+		return nullptr;
+	}
+	byte* stub = rdtsc_stubs_next;
+	rdtsc_stubs_next += num_bytes;
+	return stub;
+}
+
 void
 AddressSpace::verify(Task* t) const
 {
@@ -763,8 +788,167 @@ AddressSpace::verify(Task* t) const
 	vas.assert_segments_match(t);
 }
 
+/**
+ * Return true iff snapshot restoring leaves the mapping of |r| that
+ * exec() created alone.  The vdso is patched by the tracee, so its
+ * contents are restored but its mapping isn't.
+ */
+static bool is_kept_by_exec(const MappableResource& r)
+{
+	return PSEUDODEVICE_VDSO == r.id.psdev || "[vvar]" == r.fsname;
+}
+
+/**
+ * Return true iff snapshots save the memory of the mapping of |r|.
+ * Replay maps its own syscallbufs and (inaccessible) scratch buffers,
+ * and [vvar] can't be read.
+ */
+static bool snapshot_saves_contents(const MappableResource& r)
+{
+	return !(PSEUDODEVICE_SYSCALLBUF == r.id.psdev
+		 || PSEUDODEVICE_SCRATCH == r.id.psdev
+		 || "[vvar]" == r.fsname);
+}
+
+void
+AddressSpace::save_snapshot(Task* t, struct vm_snapshot& s) const
+{
+	s.exe_image = exe;
+	s.heap_start = heap.start;
+	s.heap_end = heap.end;
+	s.mappings.clear();
+	for (auto& kv : mem) {
+		const Mapping& m = kv.first;
+		const MappableResource& r = kv.second;
+		s.mappings.push_back(mapping_snapshot());
+		mapping_snapshot& ms = s.mappings.back();
+		ms.start = m.start;
+		ms.end = m.end;
+		ms.prot = m.prot;
+		ms.flags = m.flags;
+		ms.offset = m.offset;
+		ms.device = r.id.device;
+		ms.inode = r.id.inode;
+		ms.psdev = r.id.psdev;
+		ms.fsname = r.fsname;
+		if (!snapshot_saves_contents(r)) {
+			continue;
+		}
+		// Parts of file mappings past the end of the file
+		// can't be read, and don't need to be restored.
+		ms.contents.resize(m.num_bytes());
+		ssize_t nread = t->read_bytes_fallible(m.start, m.num_bytes(),
+						       ms.contents.data());
+		ms.contents.resize(MAX(nread, ssize_t(0)));
+	}
+}
+
+void
+AddressSpace::restore_snapshot(Task* t, const struct vm_snapshot& s)
+{
+	assert(task_set().end() != task_set().find(t));
+
+	// The remote syscalls below unmap the code and stack the
+	// task was exec()d with, so run them from the vdso, which
+	// stays put.
+	Registers r = t->regs();
+	r.set_ip(uintptr_t(vdso().start));
+	t->set_regs(r);
+	struct current_state_buffer state;
+	prepare_remote_syscalls(t, &state);
+
+	vector<Mapping> exec_mappings;
+	for (auto& kv : mem) {
+		if (!is_kept_by_exec(kv.second)) {
+			exec_mappings.push_back(kv.first);
+		}
+	}
+	for (auto& m : exec_mappings) {
+		long err = remote_syscall2(t, &state, SYS_munmap,
+					   m.start, m.num_bytes());
+		ASSERT(t, 0 == err) <<"Failed to unmap "<< m;
+		unmap(m.start, m.num_bytes());
+	}
+
+	// exec() of the same image puts the start of the heap in the
+	// same place, so growing it recreates the recorded heap.
+	ASSERT(t, s.heap_start == heap.start)
+		<<"Heap starts at "<< heap.start <<", but was recorded at "
+		<< s.heap_start;
+	if (s.heap_end != heap.end) {
+		void* end = (void*)remote_syscall1(t, &state, SYS_brk,
+						   s.heap_end);
+		ASSERT(t, end == s.heap_end)
+			<<"Failed to restore heap end "<< s.heap_end;
+		update_heap(s.heap_start, s.heap_end);
+	}
+
+	const mapping_snapshot* vdso_snapshot = nullptr;
+	for (auto& ms : s.mappings) {
+		MappableResource res(FileId(ms.device, ms.inode,
+					    PseudoDevice(ms.psdev)),
+				     ms.fsname.c_str());
+		size_t num_bytes = (byte*)ms.end - (byte*)ms.start;
+		if (is_kept_by_exec(res)) {
+			ASSERT(t, PSEUDODEVICE_VDSO != ms.psdev
+			       || ms.start == vdso().start)
+				<<"vdso is at "<< vdso().start
+				<<", but was recorded at "<< ms.start;
+			if (PSEUDODEVICE_VDSO == ms.psdev) {
+				vdso_snapshot = &ms;
+			}
+			continue;
+		}
+		if (PSEUDODEVICE_SYSCALLBUF == ms.psdev) {
+			continue;
+		}
+		// Replay only reserves the address space of scratch
+		// buffers; see |init_scratch_memory()|.
+		int prot = PSEUDODEVICE_SCRATCH == ms.psdev ?
+			   PROT_NONE : ms.prot;
+		if (PSEUDODEVICE_HEAP == ms.psdev) {
+			long err = remote_syscall3(t, &state, SYS_mprotect,
+						   ms.start, num_bytes, prot);
+			ASSERT(t, 0 == err) <<"Failed to mprotect heap";
+		} else {
+			// File contents may have changed since
+			// recording, so everything is restored from
+			// the snapshot into anonymous memory.  The
+			// main stack has to keep growing.
+			int flags = (MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED
+				     | (ms.flags & MAP_NORESERVE));
+			if (PSEUDODEVICE_STACK == ms.psdev
+			    && FileId::NO_INODE == ms.inode) {
+				flags |= MAP_GROWSDOWN;
+			}
+			void* addr = (void*)remote_syscall6(t, &state,
+							    SYS_mmap2,
+							    ms.start,
+							    num_bytes, prot,
+							    flags, -1, 0);
+			ASSERT(t, addr == ms.start)
+				<<"Failed to restore mapping at "<< ms.start;
+		}
+		map(ms.start, num_bytes, prot, ms.flags, ms.offset, res);
+		// /proc/[tid]/mem can write pages the tracee can't.
+		t->write_bytes_helper(ms.start, ms.contents.size(),
+				      ms.contents.data());
+	}
+
+	finish_remote_syscalls(t, &state);
+	// That restored the bytes of the vdso we stomped, so only
+	// now can we restore the tracee's patches to it.
+	if (vdso_snapshot) {
+		t->write_bytes_helper(vdso_snapshot->start,
+				      vdso_snapshot->contents.size(),
+				      vdso_snapshot->contents.data());
+	}
+}
+
 AddressSpace::AddressSpace(Task* t, const string& exe, Session& session)
 	: exe(exe), is_clone(false), session(&session), vdso_start_addr()
+	, rdtsc_hook(), rdtsc_stubs_start(), rdtsc_stubs_end()
+	, rdtsc_stubs_next()
 {
 	// TODO: this is a workaround of
 	// https://github.com/mozilla/rr/issues/1113 .
@@ -785,6 +969,9 @@ AddressSpace::AddressSpace(const AddressSpace& o)
 	, exe(o.exe), heap(o.heap), is_clone(true)
 	, mem(o.mem), session(nullptr)
 	, vdso_start_addr(o.vdso_start_addr)
+	, rdtsc_hook(o.rdtsc_hook), rdtsc_stubs_start(o.rdtsc_stubs_start)
+	, rdtsc_stubs_end(o.rdtsc_stubs_end)
+	, rdtsc_stubs_next(o.rdtsc_stubs_next)
 {
 	for (auto it = breakpoints.begin(); it != breakpoints.end(); ++it) {
 		it->second = it->second->clone();
@@ -1096,11 +1283,20 @@ TaskGroup::TaskGroup(pid_t tgid, pid_t real_tgid)
 
 Task::Task(pid_t _tid, pid_t _rec_tid, int _priority)
 	: thread_time(1)
-	, switchable(), pseudo_blocked(), succ_event_counter(), unstable()
+	, switchable(), pseudo_blocked(), succ_event_counter()
+	, rbc_budget(rr_flags()->max_rbc)
+	, max_succ_events(rr_flags()->max_events)
+	, timeslice_level(0)
+	, futex_waiter_woken()
+	, futex_wait_uaddr(), futex_wait_vm()
+	, unstable()
 	, priority(_priority)
+	, next_same_priority(), prev_same_priority()
 	, scratch_ptr(), scratch_size()
 	, flushed_syscallbuf()
 	, delay_syscallbuf_reset(), delay_syscallbuf_flush()
+	, grow_syscallbuf(false)
+	, initial_syscallbuf_size(SYSCALLBUF_INITIAL_BUFFER_SIZE)
 	  // These will be initialized when the syscall buffer is.
 	, desched_fd(-1), desched_fd_child(-1)
 	, seccomp_bpf_enabled()
@@ -1342,6 +1538,11 @@ Task::init_buffers(void* map_hint, int share_desched_fd)
 		// not be the same across record/replay.
 		write_socketcall_args(this, args.args_vec, 0, 0, 0);
 		write_mem(args.fdptr, 0);
+		if (args.rdtsc_stubs) {
+			vm()->set_rdtsc_stubs(args.rdtsc_hook_trampoline,
+					      args.rdtsc_stubs,
+					      args.rdtsc_stubs_size);
+		}
 	} else {
 		args.syscallbuf_ptr = nullptr;
 	}
@@ -1667,7 +1868,7 @@ Task::record_event(const Event& ev)
 
 	ofstream() << frame;
 	if (ev.has_exec_info()) {
-		reset_hpc(this, rr_flags()->max_rbc);
+		reset_hpc(this, rbc_budget);
 	}
 }
 
@@ -1693,12 +1894,12 @@ Task::record_local(void* addr, ssize_t num_bytes, const void* data)
 {
 	maybe_flush_syscallbuf();
 
-	struct raw_data buf;
-	buf.addr = addr;
-	buf.data.assign((const byte*)data, (const byte*)data + num_bytes);
-	buf.ev = ev().encode();
-	buf.global_time = ofstream().time();
-	ofstream() << buf;
+	const byte* p = static_cast<const byte*>(data);
+	ofstream().write_raw_data(addr, num_bytes, ev().encode(),
+				  ofstream().time(),
+				  [p](byte* dest, size_t offset, size_t n) {
+					  memcpy(dest, p + offset, n);
+				  });
 }
 
 void
@@ -1709,15 +1910,57 @@ Task::record_remote(void* addr, ssize_t num_bytes)
 
 	maybe_flush_syscallbuf();
 
-	struct raw_data buf;
-	buf.addr = addr;
-	buf.ev = ev().encode();
-	buf.global_time = ofstream().time();
- 	if (addr && num_bytes > 0) {
-		buf.data.resize(num_bytes);
-		read_bytes_helper(addr, buf.data.size(), buf.data.data());
+	if (!addr || num_bytes < 0) {
+		num_bytes = 0;
+	}
+	// Read the tracee's memory straight into the trace buffer,
+	// without staging it in a copy.
+	ofstream().write_raw_data(addr, num_bytes, ev().encode(),
+				  ofstream().time(),
+				  [this, addr](byte* dest, size_t offset,
+					       size_t n) {
+					  struct iovec range = {
+						  (byte*)addr + offset, n
+					  };
+					  read_ranges(&range, 1, dest);
+				  });
+}
+
+void
+Task::record_remote_ranges(const struct iovec* ranges, size_t num_ranges)
+{
+	maybe_flush_syscallbuf();
+
+	// Null ranges are recorded as empty, like |record_remote()|
+	// does, so they don't need to be read.
+	vector<struct iovec> to_read;
+	size_t num_bytes = 0;
+	for (size_t i = 0; i < num_ranges; ++i) {
+		const struct iovec& range = ranges[i];
+		// We shouldn't be recording a scratch address.
+		ASSERT(this, !range.iov_base || range.iov_base != scratch_ptr);
+		if (range.iov_base && range.iov_len > 0) {
+			to_read.push_back(range);
+			num_bytes += range.iov_len;
+		}
+	}
+	vector<byte> data(num_bytes);
+	read_ranges(to_read.data(), to_read.size(), data.data());
+
+	// Copy each range from |data| straight into the trace
+	// buffer, like |record_local()|.
+	const byte* next = data.data();
+	for (size_t i = 0; i < num_ranges; ++i) {
+		const struct iovec& range = ranges[i];
+		size_t len = range.iov_base ? range.iov_len : 0;
+		const byte* p = next;
+		ofstream().write_raw_data(range.iov_base, len, ev().encode(),
+					  ofstream().time(),
+					  [p](byte* dest, size_t offset, size_t n) {
+						  memcpy(dest, p + offset, n);
+					  });
+		next += len;
 	}
-	ofstream() << buf;
 }
 
 void
@@ -1726,13 +1969,8 @@ Task::record_remote_str(void* str)
 	maybe_flush_syscallbuf();
 
 	string s = read_c_str(str);
-	struct raw_data buf;
-	buf.addr = str;
 	// Record the \0 byte.
-	buf.data.assign(s.c_str(), s.c_str() + s.size() + 1);
-	buf.ev = ev().encode();
-	buf.global_time = ofstream().time();
-	ofstream() << buf;
+	record_local(str, s.size() + 1, s.c_str());
 }
 
 string
@@ -1859,7 +2097,7 @@ Task::current_trace_frame()
 ssize_t
 Task::set_data_from_trace()
 {
-	struct raw_data buf;
+	struct raw_data_view buf;
 	ifstream() >> buf;
 	if (buf.addr && buf.data.size() > 0) {
 		write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
@@ -1867,6 +2105,45 @@ Task::set_data_from_trace()
 	return buf.data.size();
 }
 
+ssize_t
+Task::set_data_from_trace_records(size_t num_records)
+{
+	if (1 == num_records) {
+		// Nothing to batch; write straight from the trace.
+		return set_data_from_trace();
+	}
+	// Views into the trace are only valid until the next read, so
+	// small records are copied out and written together.  Records
+	// big enough that the copy would cost more than the write
+	// saves are written straight from the trace, after the ones
+	// queued before them, so that the writes stay in order.
+	vector<struct iovec> ranges;
+	vector<byte> data;
+	ssize_t num_bytes = 0;
+	for (size_t i = 0; i < num_records; ++i) {
+		struct raw_data_view buf;
+		ifstream() >> buf;
+		num_bytes += buf.data.size();
+		if (!buf.addr || 0 == buf.data.size()) {
+			continue;
+		}
+		if (buf.data.size() >= page_size()) {
+			write_ranges(ranges.data(), ranges.size(), data.data());
+			ranges.clear();
+			data.clear();
+			write_bytes_helper(buf.addr, buf.data.size(),
+					   buf.data.data());
+			continue;
+		}
+		struct iovec range = { buf.addr, buf.data.size() };
+		ranges.push_back(range);
+		data.insert(data.end(), buf.data.data(),
+			    buf.data.data() + buf.data.size());
+	}
+	write_ranges(ranges.data(), ranges.size(), data.data());
+	return num_bytes;
+}
+
 void
 Task::set_return_value_from_trace()
 {
@@ -2127,9 +2404,31 @@ Task::update_sigmask()
 static Task* waiter;
 static bool waiter_was_interrupted;
 
+void
+Task::set_pending_wait_status(int status)
+{
+	pending_wait_statuses.push_back(status);
+}
+
+bool
+Task::consume_pending_wait_status()
+{
+	if (pending_wait_statuses.empty()) {
+		return false;
+	}
+	wait_status = pending_wait_statuses.front();
+	pending_wait_statuses.pop_front();
+	LOG(debug) <<"Using status "<< HEX(wait_status) <<" of "<< tid
+		   <<" reaped earlier";
+	return true;
+}
+
 bool
 Task::wait()
 {
+	if (consume_pending_wait_status()) {
+		return true;
+	}
 	LOG(debug) <<"going into blocking waitpid("<< tid <<") ...";
 
 	// We only need this during recording.  If tracees go runaway
@@ -2194,6 +2493,9 @@ Task::wait()
 bool
 Task::try_wait()
 {
+	if (consume_pending_wait_status()) {
+		return true;
+	}
 	pid_t ret = waitpid(tid, &wait_status, WNOHANG | __WALL | WSTOPPED);
 	LOG(debug) <<"waitpid("<< tid <<", NOHANG) returns "<< ret
 		   <<", status "<< HEX(wait_status);
@@ -2281,6 +2583,9 @@ Task::clone(int flags, void* stack, void* tls, void* cleartid_addr,
 	t->syscallbuf_lib_start = syscallbuf_lib_start;
 	t->syscallbuf_lib_end = syscallbuf_lib_end;
 	t->blocked_sigs = blocked_sigs;
+	t->initial_syscallbuf_size = syscallbuf_hdr ?
+				     syscallbuf_hdr->num_buffer_bytes :
+				     initial_syscallbuf_size;
 	if (CLONE_SHARE_SIGHANDLERS & flags) {
 		t->sighandlers = sighandlers;
 	} else {
@@ -2378,52 +2683,61 @@ Task::os_clone_into(Task* task_leader, struct current_state_buffer* state)
 void
 Task::copy_state(Task* from)
 {
-	long err;
 	set_regs(from->regs());
 	struct current_state_buffer state;
 	prepare_remote_syscalls(this, &state);
-	{
-		struct restore_mem restore_prname;
-		char prname[16];
-		strncpy(prname, from->name().c_str(), sizeof(prname));
-		void* remote_prname = push_tmp_mem(this, &state,
-						   (const byte*)prname,
-						   sizeof(prname),
-						   &restore_prname);
-		LOG(debug) <<"    setting name to "<< prname;
-		err = remote_syscall2(this, &state, SYS_prctl,
-				      PR_SET_NAME, remote_prname);
-		ASSERT(this, 0 == err);
-		update_prname(remote_prname);
-		pop_tmp_mem(this, &state, &restore_prname);
-	}
-
+	// These syscalls don't depend on each other, so make them in
+	// one batch.
+	RemoteSyscallBatch batch;
+
+	char name[16];
+	strncpy(name, from->name().c_str(), sizeof(name));
+	LOG(debug) <<"    setting name to "<< name;
+	RemoteSyscallBatch::Arg set_name =
+		batch.add(SYS_prctl, PR_SET_NAME,
+			  batch.push_data(name, sizeof(name)));
+
+	RemoteSyscallBatch::Arg set_robust_list_ret = 0;
 	if (from->robust_list()) {
 		set_robust_list(from->robust_list(), from->robust_list_len());
 		LOG(debug) <<"    setting robust-list "<< this->robust_list()
 			   <<" (size "<< this->robust_list_len() <<")";
-		err = remote_syscall2(this, &state, SYS_set_robust_list,
-				      this->robust_list(),
-				      this->robust_list_len());
-		ASSERT(this, 0 == err);
+		set_robust_list_ret =
+			batch.add(SYS_set_robust_list, this->robust_list(),
+				  this->robust_list_len());
 	}
 
-	if (const struct user_desc* tls = from->tls()) {
-		struct restore_mem restore_tls;
-		void* remote_tls = push_tmp_mem(this, &state,
-						(const byte*)tls, sizeof(*tls),
-						&restore_tls);
-		LOG(debug) <<"    setting tls "<< remote_tls;
-		err = remote_syscall1(this, &state, SYS_set_thread_area,
-				      remote_tls);
-		ASSERT(this, 0 == err);
-		set_thread_area(remote_tls);
-		pop_tmp_mem(this, &state, &restore_tls);
+	const struct user_desc* tls = from->tls();
+	RemoteSyscallBatch::Arg set_tls = 0;
+	if (tls) {
+		LOG(debug) <<"    setting tls "<< tls->entry_number;
+		set_tls = batch.add(SYS_set_thread_area,
+				    batch.push_data(tls, sizeof(*tls)));
 	}
 
-	if (void* ctid = from->tid_addr()) {
-		err = remote_syscall1(this, &state, SYS_set_tid_address, ctid);
-		ASSERT(this, tid == err);
+	void* ctid = from->tid_addr();
+	RemoteSyscallBatch::Arg set_ctid = 0;
+	if (ctid) {
+		set_ctid = batch.add(SYS_set_tid_address, ctid);
+	}
+
+	batch.run(this, &state);
+
+	ASSERT(this, 0 == batch.result(set_name));
+	// The tracee's copy of the name is gone, so take it from
+	// ours, like |update_prname()| would.
+	name[sizeof(name) - 1] = '\0';
+	prname = name;
+	if (from->robust_list()) {
+		ASSERT(this, 0 == batch.result(set_robust_list_ret));
+	}
+	if (tls) {
+		ASSERT(this, 0 == batch.result(set_tls));
+		memcpy(&thread_area, tls, sizeof(thread_area));
+		thread_area_valid = true;
+	}
+	if (ctid) {
+		ASSERT(this, tid == batch.result(set_ctid));
 	}
 
 	if (from->syscallbuf_child) {
@@ -2445,9 +2759,10 @@ Task::copy_state(Task* from)
 		syscallbuf_child = init_syscall_buffer(&state, map_hint);
 		ASSERT(this, from->syscallbuf_child == syscallbuf_child);
 		// Ensure the copied syscallbuf has the same contents
-		// as the old one, for consistency checking.
+		// as the old one, for consistency checking.  Only the
+		// part in use can have any.
 		memcpy(syscallbuf_hdr, from->syscallbuf_hdr,
-		       num_syscallbuf_bytes);
+		       from->syscallbuf_hdr->num_buffer_bytes);
 	}
 
 	finish_remote_syscalls(this, &state);
@@ -2467,6 +2782,8 @@ Task::copy_state(Task* from)
 	// series of syscalls made by the trace so far.
 	blocked_sigs = from->blocked_sigs;
 	pending_events = from->pending_events;
+	grow_syscallbuf = from->grow_syscallbuf;
+	initial_syscallbuf_size = from->initial_syscallbuf_size;
 
 	rbcs = from->rbc_count();
 	tid_futex = from->tid_futex;
@@ -2474,6 +2791,124 @@ Task::copy_state(Task* from)
 	reset_hpc(this, 0);
 }
 
+void
+Task::save_snapshot(struct task_snapshot& s)
+{
+	s.rec_tid = rec_tid;
+	s.regs = regs();
+	s.rbcs = rbcs;
+	s.thread_time = thread_time;
+	s.blocked_sigs = blocked_sigs;
+	s.tid_futex = tid_futex;
+	s.robust_futex_list = robust_futex_list;
+	s.robust_futex_list_len = robust_futex_list_len;
+	s.thread_area_valid = thread_area_valid;
+	s.thread_area = thread_area;
+	s.top_of_stack = top_of_stack;
+	s.scratch_ptr = scratch_ptr;
+	s.scratch_size = scratch_size;
+	s.syscallbuf_child = syscallbuf_child;
+	s.num_syscallbuf_bytes = syscallbuf_child ? num_syscallbuf_bytes : 0;
+	s.traced_syscall_ip = traced_syscall_ip;
+	s.untraced_syscall_ip = untraced_syscall_ip;
+	s.syscallbuf_lib_start = syscallbuf_lib_start;
+	s.syscallbuf_lib_end = syscallbuf_lib_end;
+	s.initial_syscallbuf_size = initial_syscallbuf_size;
+	s.prname = prname;
+	s.syscallbuf_hdr.clear();
+	if (syscallbuf_child) {
+		const byte* hdr = (const byte*)syscallbuf_hdr;
+		s.syscallbuf_hdr.assign(hdr, hdr + sizeof(*syscallbuf_hdr));
+	}
+	const byte* handlers = (const byte*)sighandlers->handlers;
+	s.sighandlers.assign(handlers,
+			     handlers + sizeof(sighandlers->handlers));
+}
+
+void
+Task::restore_snapshot(const struct task_snapshot& s)
+{
+	long err;
+	set_regs(s.regs);
+	struct current_state_buffer state;
+	prepare_remote_syscalls(this, &state);
+	{
+		struct restore_mem restore_prname;
+		char name[16];
+		strncpy(name, s.prname.c_str(), sizeof(name));
+		void* remote_prname = push_tmp_mem(this, &state,
+						   (const byte*)name,
+						   sizeof(name),
+						   &restore_prname);
+		err = remote_syscall2(this, &state, SYS_prctl,
+				      PR_SET_NAME, remote_prname);
+		ASSERT(this, 0 == err);
+		update_prname(remote_prname);
+		pop_tmp_mem(this, &state, &restore_prname);
+	}
+
+	if (s.robust_futex_list) {
+		set_robust_list(s.robust_futex_list, s.robust_futex_list_len);
+		err = remote_syscall2(this, &state, SYS_set_robust_list,
+				      robust_futex_list,
+				      robust_futex_list_len);
+		ASSERT(this, 0 == err);
+	}
+
+	if (s.thread_area_valid) {
+		struct restore_mem restore_tls;
+		void* remote_tls = push_tmp_mem(this, &state,
+						(const byte*)&s.thread_area,
+						sizeof(s.thread_area),
+						&restore_tls);
+		err = remote_syscall1(this, &state, SYS_set_thread_area,
+				      remote_tls);
+		ASSERT(this, 0 == err);
+		set_thread_area(remote_tls);
+		pop_tmp_mem(this, &state, &restore_tls);
+	}
+
+	if (s.tid_futex) {
+		err = remote_syscall1(this, &state, SYS_set_tid_address,
+				      s.tid_futex);
+		ASSERT(this, tid == err);
+	}
+
+	if (s.syscallbuf_child) {
+		traced_syscall_ip = s.traced_syscall_ip;
+		untraced_syscall_ip = s.untraced_syscall_ip;
+		// See |init_desched_fd()|.
+		desched_fd_child = REPLAY_DESCHED_EVENT_FD;
+		syscallbuf_child = init_syscall_buffer(&state,
+						       s.syscallbuf_child);
+		ASSERT(this, s.syscallbuf_child == syscallbuf_child);
+		ASSERT(this, s.num_syscallbuf_bytes == num_syscallbuf_bytes
+		       && s.syscallbuf_hdr.size() == sizeof(*syscallbuf_hdr));
+		memcpy(syscallbuf_hdr, s.syscallbuf_hdr.data(),
+		       s.syscallbuf_hdr.size());
+	}
+
+	finish_remote_syscalls(this, &state);
+
+	// The rest is metadata inferred from the events recorded
+	// before the snapshot.
+	syscallbuf_lib_start = s.syscallbuf_lib_start;
+	syscallbuf_lib_end = s.syscallbuf_lib_end;
+	initial_syscallbuf_size = s.initial_syscallbuf_size;
+	scratch_ptr = s.scratch_ptr;
+	scratch_size = s.scratch_size;
+	top_of_stack = s.top_of_stack;
+	tid_futex = s.tid_futex;
+	blocked_sigs = s.blocked_sigs;
+	thread_time = s.thread_time;
+	ASSERT(this, s.sighandlers.size() == sizeof(sighandlers->handlers));
+	memcpy(sighandlers->handlers, s.sighandlers.data(),
+	       s.sighandlers.size());
+
+	rbcs = s.rbcs;
+	reset_hpc(this, 0);
+}
+
 void
 Task::destroy_local_buffers()
 {
@@ -2574,7 +3009,7 @@ Task::init_syscall_buffer(struct current_state_buffer* state, void* map_hint)
 	char shmem_name[PATH_MAX];
 	format_syscallbuf_shmem_path(tid, shmem_name);
 	int shmem_fd = create_shmem_segment(shmem_name,
-					    SYSCALLBUF_BUFFER_SIZE);
+					    SYSCALLBUF_MAX_BUFFER_SIZE);
 	// Map the shmem fd in the child.
 	int child_shmem_fd;
 	{
@@ -2595,7 +3030,7 @@ Task::init_syscall_buffer(struct current_state_buffer* state, void* map_hint)
 
 	// Map the segment in ours and the tracee's address spaces.
 	void* map_addr;
-	num_syscallbuf_bytes = SYSCALLBUF_BUFFER_SIZE;
+	num_syscallbuf_bytes = SYSCALLBUF_MAX_BUFFER_SIZE;
 	int prot = PROT_READ | PROT_WRITE;
 	int flags = MAP_SHARED;
 	off64_t offset_pages = 0;
@@ -2614,6 +3049,8 @@ Task::init_syscall_buffer(struct current_state_buffer* state, void* map_hint)
 	syscallbuf_hdr = (struct syscallbuf_hdr*)map_addr;
 	// No entries to begin with.
 	memset(syscallbuf_hdr, 0, sizeof(*syscallbuf_hdr));
+	syscallbuf_hdr->num_buffer_bytes = initial_syscallbuf_size;
+	grow_syscallbuf = false;
 
 	vm()->map(child_map_addr, num_syscallbuf_bytes,
 		  prot, flags, page_size() * offset_pages,
@@ -2785,6 +3222,30 @@ Task::kill()
 	tid_futex = nullptr;
 }
 
+/**
+ * Apply the address-space changes made by the syscalls buffered in
+ * |hdr| to |t|'s vm.  These calls never trapped to us, so this is
+ * the first we hear of them.
+ */
+static void update_vm_for_buffered_syscalls(Task* t,
+					    const struct syscallbuf_hdr* hdr)
+{
+	const byte* recs = (const byte*)hdr->recs;
+	for (size_t offset = 0; offset < hdr->num_rec_bytes;) {
+		const struct syscallbuf_record* rec =
+			(const struct syscallbuf_record*)(recs + offset);
+		if (SYS_mprotect == rec->syscallno) {
+			const struct mprotect_record* mrec =
+				(const struct mprotect_record*)rec->extra_data;
+			// Like traced mprotect()s, apply this even if
+			// it failed, because it may have partially
+			// succeeded.
+			t->vm()->protect(mrec->addr, mrec->len, mrec->prot);
+		}
+		offset += stored_record_size(rec->size);
+	}
+}
+
 void
 Task::maybe_flush_syscallbuf()
 {
@@ -2807,15 +3268,42 @@ Task::maybe_flush_syscallbuf()
 		     syscallbuf_hdr);
 	record_current_event();
 	pop_event(EV_SYSCALLBUF_FLUSH);
+	update_vm_for_buffered_syscalls(this, syscallbuf_hdr);
+	note_syscallbuf_flushed(*syscallbuf_hdr);
 
 	// Reset header.
 	assert(!syscallbuf_hdr->abort_commit);
 	if (!delay_syscallbuf_reset) {
-		syscallbuf_hdr->num_rec_bytes = 0;
+		reset_syscallbuf();
 	}
 	flushed_syscallbuf = 1;
 }
 
+void
+Task::note_syscallbuf_flushed(const struct syscallbuf_hdr& flushed)
+{
+	// A buffer that's more than half full when it's flushed has
+	// likely overflowed, forcing a flush and making the tracee
+	// trap for syscalls that could have been buffered.  So grow
+	// it, at the next reset.  Buffers of threads that make few
+	// buffered syscalls between traced events stay small.
+	grow_syscallbuf = (sizeof(flushed) + flushed.num_rec_bytes
+			   > flushed.num_buffer_bytes / 2);
+}
+
+void
+Task::reset_syscallbuf()
+{
+	syscallbuf_hdr->num_rec_bytes = 0;
+	if (grow_syscallbuf && (syscallbuf_hdr->num_buffer_bytes
+				< SYSCALLBUF_MAX_BUFFER_SIZE)) {
+		syscallbuf_hdr->num_buffer_bytes *= 2;
+		LOG(debug) <<"Growing syscallbuf of "<< tid <<" to "
+			   << syscallbuf_hdr->num_buffer_bytes <<" bytes";
+	}
+	grow_syscallbuf = false;
+}
+
 static off64_t to_offset(void* addr)
 {
 	off64_t offset = (uintptr_t)addr;
@@ -2855,6 +3343,90 @@ Task::read_bytes_helper(void* addr, ssize_t buf_size, byte* buf)
 		<<", but only read "<< nread;
 }
 
+void
+Task::read_ranges(const struct iovec* ranges, size_t num_ranges, byte* buf)
+{
+	// Not all kernels support process_vm_readv(), and it can't
+	// read pages that the tracee itself can't, unlike the mem fd.
+	// So read with it for as long as it works, and then read the
+	// rest through the mem fd.
+	static bool have_process_vm_readv = true;
+	size_t i = 0;
+	while (have_process_vm_readv && i < num_ranges) {
+		size_t count = MIN(num_ranges - i, size_t(IOV_MAX));
+		struct iovec local;
+		local.iov_base = buf;
+		local.iov_len = 0;
+		for (size_t j = i; j < i + count; ++j) {
+			local.iov_len += ranges[j].iov_len;
+		}
+		ssize_t nread = process_vm_readv(tid, &local, 1,
+						 &ranges[i], count, 0);
+		if (0 > nread) {
+			if (ENOSYS == errno || EPERM == errno) {
+				have_process_vm_readv = false;
+			}
+			break;
+		}
+		// A short read ends at the first range that couldn't
+		// be read in full.
+		size_t nleft = nread;
+		while (i < num_ranges && ranges[i].iov_len <= nleft) {
+			nleft -= ranges[i].iov_len;
+			buf += ranges[i].iov_len;
+			++i;
+		}
+		if (size_t(nread) < local.iov_len) {
+			break;
+		}
+	}
+	for (; i < num_ranges; ++i) {
+		read_bytes_helper(ranges[i].iov_base, ranges[i].iov_len, buf);
+		buf += ranges[i].iov_len;
+	}
+}
+
+void
+Task::write_ranges(const struct iovec* ranges, size_t num_ranges,
+		   const byte* buf)
+{
+	// process_vm_writev() can't write pages that the tracee
+	// itself can't, like text pages, which the mem fd can.  See
+	// |read_ranges()|.
+	static bool have_process_vm_writev = true;
+	size_t i = 0;
+	while (have_process_vm_writev && i < num_ranges) {
+		size_t count = MIN(num_ranges - i, size_t(IOV_MAX));
+		struct iovec local;
+		local.iov_base = const_cast<byte*>(buf);
+		local.iov_len = 0;
+		for (size_t j = i; j < i + count; ++j) {
+			local.iov_len += ranges[j].iov_len;
+		}
+		ssize_t nwritten = process_vm_writev(tid, &local, 1,
+						     &ranges[i], count, 0);
+		if (0 > nwritten) {
+			if (ENOSYS == errno || EPERM == errno) {
+				have_process_vm_writev = false;
+			}
+			break;
+		}
+		size_t nleft = nwritten;
+		while (i < num_ranges && ranges[i].iov_len <= nleft) {
+			nleft -= ranges[i].iov_len;
+			buf += ranges[i].iov_len;
+			++i;
+		}
+		if (size_t(nwritten) < local.iov_len) {
+			break;
+		}
+	}
+	for (; i < num_ranges; ++i) {
+		write_bytes_helper(ranges[i].iov_base, ranges[i].iov_len, buf);
+		buf += ranges[i].iov_len;
+	}
+}
+
 void
 Task::write_bytes_helper(void* addr, ssize_t buf_size, const byte* buf)
 {
@@ -2950,7 +3522,9 @@ Task::os_clone(Task* parent, Session* session,
 /*static*/ Task*
 Task::spawn(const struct args_env& ae, Session& session, pid_t rec_tid)
 {
-	assert(session.tasks().size() == 0);
+	// Only the initial tracee is spawned, unless replay is
+	// restoring a snapshot of several processes.
+	assert(session.tasks().size() == 0 || session.can_validate());
 
 	pid_t tid = fork();
 	if (0 == tid) {
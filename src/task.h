@@ -555,12 +555,51 @@ public:
 	/** Return the vdso mapping of this. */
 	Mapping vdso() const;
 
+	/**
+	 * Remember that the syscallbuf lib mapped the area
+	 * |[stubs, stubs + num_bytes)| for rdtsc patch stubs, which
+	 * call |hook_trampoline|.  Every thread reports the same area
+	 * when it initializes its buffers, so repeated calls for one
+	 * area don't change anything.
+	 */
+	void set_rdtsc_stubs(void* hook_trampoline, void* stubs,
+			     size_t num_bytes);
+	/** Return true if rdtsc sites in this can be patched. */
+	bool has_rdtsc_stubs() const { return rdtsc_stubs_start; }
+	/** Return true if |addr| is in the rdtsc stub area. */
+	bool is_in_rdtsc_stubs(void* addr) const {
+		return (rdtsc_stubs_start <= addr
+			&& addr < rdtsc_stubs_end);
+	}
+	/** Return the entry point that rdtsc patch stubs call. */
+	void* rdtsc_hook_trampoline() const { return rdtsc_hook; }
+	/**
+	 * Reserve |num_bytes| of the rdtsc stub area for a new stub,
+	 * and return its address.  Return nullptr if the area is
+	 * full.
+	 */
+	void* alloc_rdtsc_stub(size_t num_bytes);
+
 	/**
 	 * Verify that this cached address space matches what the
 	 * kernel thinks it should be.
 	 */
 	void verify(Task* t) const;
 
+	/**
+	 * Save the mappings of this and their contents to |s|,
+	 * reading memory through |t|, which uses this.  The mappings
+	 * that replay creates itself (syscallbufs and scratch
+	 * buffers) are saved without contents.
+	 */
+	void save_snapshot(Task* t, struct vm_snapshot& s) const;
+	/**
+	 * Replace the mappings of this, which |t| has just exec()d,
+	 * with those saved in |s|.  The caller restores the
+	 * syscallbufs.
+	 */
+	void restore_snapshot(Task* t, const struct vm_snapshot& s);
+
 	bool has_breakpoints()
 	{
 		return !breakpoints.empty();
@@ -645,6 +684,13 @@ private:
 	Session* session;
 	/* First mapped byte of the vdso. */
 	void* vdso_start_addr;
+	/* The entry point that rdtsc patch stubs call, the area the
+	 * stubs are written to, and the next unused byte of that
+	 * area.  All null unless rdtsc patching is enabled. */
+	void* rdtsc_hook;
+	byte* rdtsc_stubs_start;
+	byte* rdtsc_stubs_end;
+	byte* rdtsc_stubs_next;
 	// The watchpoints set for tasks in this VM.  Watchpoints are
 	// programmed per Task, but we track them per address space on
 	// behalf of debuggers that assume that model.
@@ -1225,6 +1271,13 @@ public:
 	void record_local(void* addr, ssize_t num_bytes, const void* buf);
 	void record_remote(void* addr, ssize_t num_bytes);
 	void record_remote_str(void* str);
+	/**
+	 * Like calling |record_remote()| for each of the
+	 * |num_ranges| |ranges| in turn, but reads all of them from
+	 * this at once.
+	 */
+	void record_remote_ranges(const struct iovec* ranges,
+				  size_t num_ranges);
 
 	/** Return the current regs of this. */
 	const Registers& regs();
@@ -1259,6 +1312,21 @@ public:
 	 */
 	std::string read_c_str(void* child_addr);
 
+	/**
+	 * Read the |num_ranges| |ranges| of this address space into
+	 * |buf|, one after the other, or don't return.  This gathers
+	 * all the ranges with as few syscalls as possible, so prefer
+	 * it to reading them one by one.
+	 */
+	void read_ranges(const struct iovec* ranges, size_t num_ranges,
+			 byte* buf);
+	/**
+	 * The reverse of |read_ranges()|: write consecutive bytes of
+	 * |buf| to each of the |ranges| in turn, or don't return.
+	 */
+	void write_ranges(const struct iovec* ranges, size_t num_ranges,
+			  const byte* buf);
+
 	/**
 	 * Return the word at |child_addr| in this address space.
 	 *
@@ -1294,8 +1362,29 @@ public:
 
 	const struct trace_frame& current_trace_frame();
 
+	/**
+	 * Note that the syscallbuf records described by |flushed|,
+	 * the header of the buffer at the time, have been flushed.
+	 * Both recording and replay call this, with the same
+	 * header.
+	 */
+	void note_syscallbuf_flushed(const struct syscallbuf_hdr& flushed);
+	/**
+	 * Empty the syscallbuf, and grow it if that's due.  This
+	 * happens at the same points in recording and replay, so the
+	 * tracee sees the same buffer sizes.
+	 */
+	void reset_syscallbuf();
+
 	/** Restore the next chunk of saved data from the trace to this. */
 	ssize_t set_data_from_trace();
+	/**
+	 * Restore the next |num_records| chunks of saved data, in
+	 * order, with as few writes to this as possible.  Small
+	 * chunks are batched; large ones are written without being
+	 * copied.  Return the total number of bytes restored.
+	 */
+	ssize_t set_data_from_trace_records(size_t num_records);
 
 	/**
 	 * Set the syscall-return-value register of this to what was
@@ -1456,6 +1545,18 @@ public:
 	 * block.
 	 */
 	bool try_wait();
+	/**
+	 * Save |status|, which a waitpid(-1) reaped on behalf of this,
+	 * to be returned by a later |wait()| or |try_wait()| instead
+	 * of asking the kernel again.  Statuses are returned in the
+	 * order they were reaped; a task can change state again
+	 * before its first status is consumed, e.g. when another
+	 * task's exit_group() SIGKILLs it out of a ptrace-stop.
+	 */
+	void set_pending_wait_status(int status);
+	bool has_pending_wait_status() const {
+		return !pending_wait_statuses.empty();
+	}
 
 	/**
 	 * Write |N| bytes from |buf| to |child_addr|, or don't
@@ -1533,6 +1634,22 @@ public:
 	 * it's processed in succession.  The scheduler maintains this
 	 * state and uses it to make scheduling decisions. */
 	int succ_event_counter;
+	/* The number of rbcs this may run before it's interrupted,
+	 * and the number of events it may process in succession
+	 * before the scheduler prefers another task.  The scheduler's
+	 * timeslice policy maintains these; |timeslice_level| is that
+	 * policy's private state. */
+	int64_t rbc_budget;
+	int max_succ_events;
+	int timeslice_level;
+	/* Nonzero while the scheduler's list of tasks woken from
+	 * FUTEX_WAIT holds this, so that it's listed at most
+	 * once. */
+	int futex_waiter_woken;
+	/* The futex, and the address space it's in, under which the
+	 * scheduler indexes this as a FUTEX_WAIT waiter, or null. */
+	void* futex_wait_uaddr;
+	AddressSpace* futex_wait_vm;
 	/* Nonzero when any assumptions made about the status of this
 	 * process have been invalidated, and must be re-established
 	 * with a waitpid() call. */
@@ -1543,6 +1660,10 @@ public:
 	   deliberately simple and unfair; a task never runs as long as there's
 	   another runnable task with a lower nice value. */
 	int priority;
+	/* The neighbours of this in its Session's circular list of
+	 * tasks with |priority|.  See |Session::tasks_by_priority()|. */
+	Task* next_same_priority;
+	Task* prev_same_priority;
 
 	/* Imagine that task A passes buffer |b| to the read()
 	 * syscall.  Imagine that, after A is switched out for task B,
@@ -1604,6 +1725,12 @@ public:
 	 * |delay_syscallbuf_reset| above to keep the syscallbuf
 	 * intact during possibly many "reentrant" events. */
 	int delay_syscallbuf_flush;
+	/* Set when a flush finds the syscallbuf filling up, so that
+	 * it's grown when it's next reset. */
+	bool grow_syscallbuf;
+	/* How big this task's next syscallbuf starts out.  Tasks
+	 * inherit the current size of their creator's buffer. */
+	uint32_t initial_syscallbuf_size;
 
 	/* The child's desched counter event fd number, and our local
 	 * dup. */
@@ -1686,6 +1813,19 @@ private:
 	 */
 	void copy_state(Task* from);
 
+	/**
+	 * Save the state of this that's needed to recreate it in
+	 * replay to |s|.  This must be at a point where it has no
+	 * event in progress.
+	 */
+	void save_snapshot(struct task_snapshot& s);
+	/**
+	 * Make this, whose address space has already been restored,
+	 * look like the task saved in |s|.  Like |copy_state()|, but
+	 * from a snapshot.
+	 */
+	void restore_snapshot(const struct task_snapshot& s);
+
 	/**
 	 * Destroy tracer-side state of this (as opposed to remote,
 	 * tracee-side state).
@@ -1751,6 +1891,12 @@ private:
 	 */
 	void maybe_flush_syscallbuf();
 
+	/**
+	 * If a status change was reaped for this by someone else,
+	 * make it the current |status()| and return true.
+	 */
+	bool consume_pending_wait_status();
+
 	/**
 	 * Make the OS-level calls to create a new fork or clone that
 	 * will eventually be a copy of this task and return that Task
@@ -1885,6 +2031,9 @@ private:
 	// The most recent status of this task as returned by
 	// waitpid().
 	int wait_status;
+	// Status changes reaped for this, but not yet consumed by
+	// wait()/try_wait(), oldest first.
+	std::deque<int> pending_wait_statuses;
 
 	Task(Task&) = delete;
 	Task operator=(Task&) = delete;
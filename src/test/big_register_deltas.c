@@ -0,0 +1,104 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define PAGE_SIZE 4096
+#define STACK_SIZE (16 * PAGE_SIZE)
+
+/**
+ * Make two getpid() syscalls from code and stacks mapped far apart,
+ * with every general-purpose register differing by more than 2^28
+ * between them and from the caller's frame.  That forces the widest
+ * exec-info deltas the trace can encode.  Returns the pid if both
+ * syscalls agreed, -1 otherwise.
+ */
+int far_syscalls(void* code1, void* stack1_top,
+		 void* code2, void* stack2_top);
+
+__asm__(".text\n\t"
+	".globl far_syscalls\n\t"
+	".type far_syscalls, @function\n"
+	"far_syscalls:\n\t"
+	"push %ebp\n\t"
+	"push %ebx\n\t"
+	"push %esi\n\t"
+	"push %edi\n\t"
+	"mov %esp, %ebp\n\t"
+	"mov 24(%ebp), %ecx\n\t"
+	"mov 32(%ebp), %edx\n\t"
+	/* Second frame: result of the first syscall, code2, our esp. */
+	"mov %ebp, -4(%edx)\n\t"
+	"mov 28(%ebp), %eax\n\t"
+	"mov %eax, -8(%edx)\n\t"
+	/* First frame: code1, pointer to the second frame. */
+	"lea -12(%edx), %eax\n\t"
+	"mov %eax, -4(%ecx)\n\t"
+	"mov 20(%ebp), %eax\n\t"
+	"mov %eax, -8(%ecx)\n\t"
+	"lea -8(%ecx), %esp\n\t"
+	"mov $0x01234567, %ebx\n\t"
+	"mov $0x12345678, %ecx\n\t"
+	"mov $0x23456789, %edx\n\t"
+	"mov $0x3456789a, %esi\n\t"
+	"mov $0x456789ab, %edi\n\t"
+	"mov $0x56789abc, %ebp\n\t"
+	"mov $20, %eax\n\t"	/* SYS_getpid */
+	"call *(%esp)\n\t"
+	"mov 4(%esp), %esp\n\t"
+	"mov %eax, (%esp)\n\t"
+	"mov $0xf1234567, %ebx\n\t"
+	"mov $0xe2345678, %ecx\n\t"
+	"mov $0xd3456789, %edx\n\t"
+	"mov $0xc456789a, %esi\n\t"
+	"mov $0xb56789ab, %edi\n\t"
+	"mov $0xa6789abc, %ebp\n\t"
+	"mov $20, %eax\n\t"
+	"call *4(%esp)\n\t"
+	"cmp (%esp), %eax\n\t"
+	"je 1f\n\t"
+	"mov $-1, %eax\n"
+	"1:\n\t"
+	"mov 8(%esp), %esp\n\t"
+	"pop %edi\n\t"
+	"pop %esi\n\t"
+	"pop %ebx\n\t"
+	"pop %ebp\n\t"
+	"ret\n\t"
+	".size far_syscalls, .-far_syscalls\n\t");
+
+static void* map_at(uintptr_t hint, size_t len, int prot) {
+	void* p = mmap((void*)hint, len, prot, MAP_PRIVATE | MAP_ANONYMOUS,
+		       -1, 0);
+	test_assert(p != MAP_FAILED);
+	return p;
+}
+
+static void* map_code_at(uintptr_t hint) {
+	/* int $0x80; ret */
+	static const byte code[] = { 0xcd, 0x80, 0xc3 };
+	byte* p = map_at(hint, PAGE_SIZE,
+			 PROT_READ | PROT_WRITE | PROT_EXEC);
+
+	memcpy(p, code, sizeof(code));
+	return p;
+}
+
+int main(int argc, char *argv[]) {
+	void* code1 = map_code_at(0x70000000);
+	void* code2 = map_code_at(0x20000000);
+	byte* stack1 = map_at(0x40000000, STACK_SIZE,
+			      PROT_READ | PROT_WRITE);
+	byte* stack2 = map_at(0x10000000, STACK_SIZE,
+			      PROT_READ | PROT_WRITE);
+	int i;
+
+	for (i = 0; i < 10; ++i) {
+		test_assert(getpid() == far_syscalls(code1,
+						     stack1 + STACK_SIZE,
+						     code2,
+						     stack2 + STACK_SIZE));
+	}
+
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define BUF_SIZE (64 * 1024)
+/* Enough to fill several trace segments of the smallest size. */
+#define NUM_READS 256
+
+/**
+ * Record about 16MB of incompressible data, so that the trace files
+ * span many blocks and segments.
+ */
+int main(int argc, char *argv[]) {
+	char* buf = malloc(BUF_SIZE);
+	uint32_t sum = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	int i;
+	size_t j;
+
+	test_assert(0 <= fd);
+	for (i = 0; i < NUM_READS; ++i) {
+		test_assert(BUF_SIZE == read(fd, buf, BUF_SIZE));
+		for (j = 0; j < BUF_SIZE; ++j) {
+			sum += (byte)buf[j];
+		}
+	}
+	atomic_printf("read %d bytes %d times, sum %u\n", BUF_SIZE,
+		      NUM_READS, sum);
+
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
@@ -0,0 +1,158 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define DUMMY_FILE "dummy.txt"
+#define NUM_ITERATIONS 100
+
+static void sockets(void) {
+	int sv[2];
+	char buf[64];
+	char part1[16];
+	char part2[16];
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	struct iovec iovs[2];
+	struct msghdr msg;
+	int i;
+
+	test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		test_assert(5 == sendto(sv[0], "hello", 5, 0, NULL, 0));
+		addrlen = sizeof(addr);
+		memset(buf, 0, sizeof(buf));
+		test_assert(5 == recvfrom(sv[1], buf, sizeof(buf), 0,
+					  (struct sockaddr*)&addr, &addrlen));
+		test_assert(!strcmp(buf, "hello"));
+
+		memset(&msg, 0, sizeof(msg));
+		iovs[0].iov_base = "0123456789abcdef";
+		iovs[0].iov_len = 16;
+		iovs[1].iov_base = "ABCDEF";
+		iovs[1].iov_len = 6;
+		msg.msg_iov = iovs;
+		msg.msg_iovlen = 2;
+		test_assert(22 == sendmsg(sv[0], &msg, 0));
+
+		memset(part1, 0, sizeof(part1));
+		memset(part2, 0, sizeof(part2));
+		iovs[0].iov_base = part1;
+		iovs[0].iov_len = 10;
+		iovs[1].iov_base = part2;
+		iovs[1].iov_len = sizeof(part2);
+		test_assert(22 == recvmsg(sv[1], &msg, 0));
+		test_assert(!memcmp(part1, "0123456789", 10));
+		test_assert(!memcmp(part2, "abcdefABCDEF", 12));
+	}
+	atomic_printf("received '%s' '%.10s' '%.12s'\n", buf, part1, part2);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void truncated_datagrams(void) {
+	int sv[2];
+	/* The bytes past the first four must survive the receives. */
+	char buf[8];
+	int i;
+
+	test_assert(0 == socketpair(AF_UNIX, SOCK_DGRAM, 0, sv));
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		test_assert(16 == send(sv[0], "0123456789abcdef", 16, 0));
+		memset(buf, 'x', sizeof(buf));
+		test_assert(16 == recv(sv[1], buf, 4, MSG_TRUNC));
+		test_assert(!memcmp(buf, "0123xxxx", sizeof(buf)));
+
+		test_assert(16 == send(sv[0], "fedcba9876543210", 16, 0));
+		memset(buf, 'x', sizeof(buf));
+		test_assert(16 == recvfrom(sv[1], buf, 4, MSG_TRUNC,
+					   NULL, NULL));
+		test_assert(!memcmp(buf, "fedcxxxx", sizeof(buf)));
+	}
+	atomic_printf("received truncated '%.4s'\n", buf);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+static void files(void) {
+	char buf[32];
+	char dents[1024];
+	int fd = open(DUMMY_FILE, O_CREAT | O_RDWR, 0600);
+	int dirfd = open(".", O_RDONLY | O_DIRECTORY);
+	struct stat st;
+	int i;
+	long nread = 0;
+
+	test_assert(fd >= 0 && dirfd >= 0);
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		test_assert(10 == pwrite(fd, "0123456789", 10, i));
+		memset(buf, 0, sizeof(buf));
+		test_assert(10 == pread(fd, buf, 10, i));
+		test_assert(!strcmp(buf, "0123456789"));
+		test_assert(0 == fstat(fd, &st));
+		test_assert(st.st_size == i + 10);
+
+		test_assert(0 == lseek(dirfd, 0, SEEK_SET));
+		nread += syscall(SYS_getdents64, dirfd, dents, sizeof(dents));
+	}
+	atomic_printf("file size %lld; read %ld dirent bytes\n",
+		      (long long)st.st_size, nread);
+	unlink(DUMMY_FILE);
+	close(fd);
+	close(dirfd);
+}
+
+static void waits(void) {
+	int epfd = epoll_create(1);
+	struct epoll_event ev;
+	struct timespec ts = { 0, 0 };
+	int pipefds[2];
+	int i;
+
+	test_assert(epfd >= 0 && 0 == pipe(pipefds));
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = 42;
+	test_assert(0 == epoll_ctl(epfd, EPOLL_CTL_ADD, pipefds[0], &ev));
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		test_assert(0 == epoll_wait(epfd, &ev, 1, 0));
+		test_assert(0 == nanosleep(&ts, NULL));
+	}
+	test_assert(1 == write(pipefds[1], "x", 1));
+	memset(&ev, 0, sizeof(ev));
+	test_assert(1 == epoll_wait(epfd, &ev, 1, -1));
+	test_assert(42 == ev.data.u32 && (ev.events & EPOLLIN));
+	atomic_printf("epoll_wait reported %u\n", ev.data.u32);
+	close(pipefds[0]);
+	close(pipefds[1]);
+	close(epfd);
+}
+
+static void protections(void) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char* p = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	int i;
+
+	test_assert(p != MAP_FAILED);
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		test_assert(0 == mprotect(p + page_size, page_size,
+					  (i & 1) ? PROT_READ | PROT_WRITE
+						  : PROT_READ));
+		p[0] = i;
+	}
+	/* Leave the second page writable, and check that it is. */
+	p[page_size] = 1;
+	atomic_printf("wrote %d %d\n", p[0], p[page_size]);
+	munmap(p, 2 * page_size);
+}
+
+int main(int argc, char *argv[]) {
+	sockets();
+	truncated_datagrams();
+	files();
+	waits();
+	protections();
+
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define NUM_THREADS 16
+
+static volatile int num_running;
+
+/**
+ * Keep making traced syscalls, so that rr usually has a status
+ * change of this thread collected but not yet acted on when the main
+ * thread's exit_group() kills it.
+ */
+static void* thread(void* unused) {
+	__sync_fetch_and_add(&num_running, 1);
+	while (1) {
+		sched_yield();
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t threads[NUM_THREADS];
+	size_t i;
+
+	for (i = 0; i < ALEN(threads); ++i) {
+		test_assert(0 == pthread_create(&threads[i], NULL, thread,
+						NULL));
+	}
+	while (num_running < NUM_THREADS) {
+		sched_yield();
+	}
+	for (i = 0; i < 100; ++i) {
+		sched_yield();
+	}
+
+	atomic_puts("EXIT-SUCCESS");
+	/* exit_group() with all the threads still running. */
+	_exit(0);
+	return 0;		/* not reached */
+}
@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define DEFAULT_NUM_THREADS 64
+#define NUM_ROUNDS 4
+#define NUM_ITERATIONS 20
+#define NUM_PRIORITIES 4
+/* Small, so that thousands of threads fit in the address space. */
+#define STACK_SIZE (64 * 1024)
+#define SPIN_ITERATIONS (1 << 24)
+
+static int num_threads;
+static pthread_attr_t attr;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int counter;
+
+static pid_t* tids;
+static volatile int main_spinning;
+static volatile int main_done;
+static int num_at_priority[NUM_PRIORITIES + 1];
+static volatile int num_finished[NUM_PRIORITIES + 1];
+
+static long now_usec(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/**
+ * Lots of threads at a few different priorities, some of which move
+ * to another priority partway through, all contending for a lock.
+ * That keeps the recorder adding, removing and re-linking tasks in
+ * its per-priority runqueues while it schedules them.
+ */
+static void* contend(void* idp) {
+	int id = (uintptr_t)idp;
+	int i;
+
+	test_assert(0 == setpriority(PRIO_PROCESS, 0, id % NUM_PRIORITIES));
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		if (i == NUM_ITERATIONS / 2 && 0 == id % 8) {
+			test_assert(0 == setpriority(PRIO_PROCESS, 0,
+						     NUM_PRIORITIES));
+		}
+		pthread_mutex_lock(&lock);
+		++counter;
+		pthread_mutex_unlock(&lock);
+		sched_yield();
+	}
+	return NULL;
+}
+
+/**
+ * rr never runs a task while one with a lower nice value is
+ * runnable.  These threads lower their priority below the main
+ * thread's and then spin without making syscalls, so they're always
+ * runnable.  So none of them may run while the main thread spins, and
+ * once it's done, all the threads at each priority must finish before
+ * any thread at a lower priority gets to notice.
+ */
+static void* check_order(void* idp) {
+	int id = (uintptr_t)idp;
+	int priority = 1 + id % NUM_PRIORITIES;
+	int p;
+
+	tids[id] = sys_gettid();
+	test_assert(0 == setpriority(PRIO_PROCESS, 0, priority));
+	while (!main_done) {
+		test_assert(!main_spinning);
+	}
+	for (p = 1; p < priority; ++p) {
+		test_assert(num_finished[p] == num_at_priority[p]);
+	}
+	__sync_fetch_and_add(&num_finished[priority], 1);
+	return NULL;
+}
+
+static void run_threads(void* (*fn)(void*), pthread_t* threads) {
+	int i;
+
+	for (i = 0; i < num_threads; ++i) {
+		test_assert(0 == pthread_create(&threads[i], &attr, fn,
+						(void*)(uintptr_t)i));
+	}
+}
+
+static void join_threads(pthread_t* threads) {
+	int i;
+
+	for (i = 0; i < num_threads; ++i) {
+		test_assert(0 == pthread_join(threads[i], NULL));
+	}
+}
+
+static void check_priority_order(pthread_t* threads) {
+	volatile int dummy = 0;
+	int i;
+
+	tids = calloc(num_threads, sizeof(*tids));
+	for (i = 0; i < num_threads; ++i) {
+		++num_at_priority[1 + i % NUM_PRIORITIES];
+	}
+	run_threads(check_order, threads);
+	/* Wait until every thread has lowered its priority. */
+	for (i = 0; i < num_threads; ++i) {
+		while (!tids[i]
+		       || 1 + i % NUM_PRIORITIES
+		       != getpriority(PRIO_PROCESS, tids[i])) {
+			sched_yield();
+		}
+	}
+
+	/* No syscalls while spinning: a task in a traced syscall may
+	 * be blocked, and then lower-priority tasks can run. */
+	main_spinning = 1;
+	for (i = 0; i < SPIN_ITERATIONS; ++i) {
+		dummy += i % 7;
+	}
+	main_spinning = 0;
+	main_done = 1;
+
+	join_threads(threads);
+	for (i = 1; i <= NUM_PRIORITIES; ++i) {
+		test_assert(num_finished[i] == num_at_priority[i]);
+	}
+	free(tids);
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t* threads;
+	long start;
+	int round;
+
+	num_threads = argc > 1 ? atoi(argv[1]) : DEFAULT_NUM_THREADS;
+	test_assert(num_threads > 0);
+	threads = calloc(num_threads, sizeof(*threads));
+	pthread_attr_init(&attr);
+	test_assert(0 == pthread_attr_setstacksize(&attr, STACK_SIZE));
+
+	for (round = 0; round < NUM_ROUNDS; ++round) {
+		start = now_usec();
+		run_threads(contend, threads);
+		join_threads(threads);
+		atomic_printf("round %d: %d threads, counter %d, %ld us\n",
+			      round, num_threads, counter, now_usec() - start);
+	}
+	test_assert(NUM_ROUNDS * num_threads * NUM_ITERATIONS == counter);
+
+	start = now_usec();
+	check_priority_order(threads);
+	atomic_printf("priority order: %d threads, %ld us\n",
+		      num_threads, now_usec() - start);
+
+	free(threads);
+	pthread_attr_destroy(&attr);
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
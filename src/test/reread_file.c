@@ -0,0 +1,34 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define DUMMY_FILE "dummy.txt"
+#define FILE_SIZE (64 * 1024)
+#define NUM_READS 16
+
+int main(int argc, char *argv[]) {
+	char* contents = malloc(FILE_SIZE);
+	char* buf = malloc(FILE_SIZE);
+	int fd;
+	int i;
+
+	for (i = 0; i < FILE_SIZE; ++i) {
+		contents[i] = i * 7;
+	}
+	fd = creat(DUMMY_FILE, 0600);
+	test_assert(FILE_SIZE == write(fd, contents, FILE_SIZE));
+	close(fd);
+	fd = open(DUMMY_FILE, O_RDONLY);
+	unlink(DUMMY_FILE);
+
+	/* Each read records the same bytes. */
+	for (i = 0; i < NUM_READS; ++i) {
+		memset(buf, 0, FILE_SIZE);
+		test_assert(FILE_SIZE == pread(fd, buf, FILE_SIZE, 0));
+		test_assert(!memcmp(buf, contents, FILE_SIZE));
+	}
+	atomic_printf("read %d bytes %d times\n", FILE_SIZE, NUM_READS);
+
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define DUMMY_FILE "dummy.txt"
+#define CHUNK_SIZE (16 * 1024)
+#define NUM_READS 512
+
+int main(int argc, char *argv[]) {
+	char contents[CHUNK_SIZE];
+	char buf[CHUNK_SIZE];
+	int fd;
+	int i;
+	uint32_t sum = 0;
+
+	for (i = 0; i < CHUNK_SIZE; ++i) {
+		contents[i] = i * 13;
+	}
+	fd = creat(DUMMY_FILE, 0600);
+	test_assert(CHUNK_SIZE == write(fd, contents, CHUNK_SIZE));
+	close(fd);
+	fd = open(DUMMY_FILE, O_RDONLY);
+	unlink(DUMMY_FILE);
+
+	/* Buffered reads whose data fills up the syscallbuf many
+	 * times over, so that rr grows it. */
+	for (i = 0; i < NUM_READS; ++i) {
+		test_assert(0 == lseek(fd, 0, SEEK_SET));
+		test_assert(CHUNK_SIZE == read(fd, buf, CHUNK_SIZE));
+		test_assert(!memcmp(buf, contents, CHUNK_SIZE));
+		sum += (unsigned char)buf[i % CHUNK_SIZE];
+	}
+	atomic_printf("read %d bytes %d times (sum %u)\n",
+		      CHUNK_SIZE, NUM_READS, sum);
+
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 8; indent-tabs-mode: t; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS 1000
+
+static pid_t main_tid;
+
+static void* thread(void* unused) {
+	pid_t tid = sys_gettid();
+
+	test_assert(tid != main_tid);
+	test_assert(getpid() == main_tid);
+	atomic_printf("thread %d\n", tid);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	pid_t pid = getpid();
+	pid_t ppid = getppid();
+	pid_t pgrp = getpgrp();
+	uid_t uid = getuid();
+	uid_t euid = geteuid();
+	gid_t gid = getgid();
+	gid_t egid = getegid();
+	int max_prio = sched_get_priority_max(SCHED_FIFO);
+	int min_prio = sched_get_priority_min(SCHED_FIFO);
+	pthread_t t;
+	int i;
+
+	main_tid = sys_gettid();
+	test_assert(main_tid == pid);
+	test_assert(max_prio >= min_prio);
+
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		test_assert(pid == getpid());
+		test_assert(main_tid == sys_gettid());
+		test_assert(ppid == getppid());
+		test_assert(pgrp == getpgrp());
+		test_assert(uid == getuid() && euid == geteuid());
+		test_assert(gid == getgid() && egid == getegid());
+		test_assert(SCHED_OTHER == sched_getscheduler(0));
+		test_assert(max_prio == sched_get_priority_max(SCHED_FIFO));
+		test_assert(min_prio == sched_get_priority_min(SCHED_FIFO));
+	}
+	atomic_printf("pid %d ppid %d uid %d gid %d\n", pid, ppid, uid, gid);
+
+	pthread_create(&t, NULL, thread, NULL);
+	pthread_join(t, NULL);
+
+	atomic_puts("EXIT-SUCCESS");
+	return 0;
+}
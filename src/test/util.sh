@@ -14,7 +14,7 @@
 #
 # Test runners may set the environment variable $RECORD_ARGS to pass
 # arguments to rr for recording.  This is only useful for tweaking the
-# scheduler, don't use it for anything else.
+# scheduler or the trace format, don't use it for anything else.
 #
 
 #  delay_kill <sig> <delay_secs> <proc>
@@ -6,6 +6,7 @@
 
 #include <sysexits.h>
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <sstream>
@@ -24,7 +25,11 @@ using namespace std;
 // MUST increment this version number.  Otherwise users' old traces
 // will become unreplayable and they won't know why.
 //
-#define TRACE_VERSION 3
+#define TRACE_VERSION 10
+
+// An index entry is written every this many events.  Seeking to an
+// arbitrary event reads and discards at most this many frames.
+#define TRACE_INDEX_INTERVAL 1000
 
 static ssize_t sizeof_trace_frame_event_info(void)
 {
@@ -32,11 +37,14 @@ static ssize_t sizeof_trace_frame_event_info(void)
 		offsetof(struct trace_frame, begin_event_info);
 }
 
-static ssize_t sizeof_trace_frame_exec_info(void)
-{
-	return offsetof(struct trace_frame, end_exec_info) -
-		offsetof(struct trace_frame, begin_exec_info);
-}
+/* Exec info is delta-encoded as this many 32-bit words. */
+#define EXEC_INFO_WORDS						\
+	((offsetof(struct trace_frame, end_exec_info)			\
+	  - offsetof(struct trace_frame, begin_exec_info))		\
+	 / sizeof(uint32_t))
+/* Worst-case size of encoded exec info: a keyframe flag and all the
+ * words verbatim. */
+#define EXEC_INFO_MAX_ENCODED (1 + EXEC_INFO_WORDS * sizeof(uint32_t))
 
 static string default_rr_trace_dir()
 {
@@ -175,18 +183,70 @@ args_env::destroy()
 	}
 }
 
-bool
-TraceFstream::good() const
+string
+TraceFstream::args_env_file_path() const
 {
-	return (events.good()
-		&& data.good() && data_header.good()
-		&& mmaps.good());
+	return trace_dir + "/args_env";
 }
 
 string
-TraceFstream::args_env_file_path() const
+TraceFstream::events_file_path() const
 {
-	return trace_dir + "/args_env";
+	return trace_dir + "/events";
+}
+
+string
+TraceFstream::data_file_path() const
+{
+	return trace_dir + "/data";
+}
+
+string
+TraceFstream::data_header_file_path() const
+{
+	return trace_dir + "/data_header";
+}
+
+string
+TraceFstream::mmaps_file_path() const
+{
+	return trace_dir + "/mmaps";
+}
+
+string
+TraceFstream::index_file_path() const
+{
+	return trace_dir + "/index";
+}
+
+string
+TraceFstream::blobs_file_path() const
+{
+	return trace_dir + "/blobs";
+}
+
+string
+TraceFstream::blob_index_file_path() const
+{
+	return trace_dir + "/blob_index";
+}
+
+string
+TraceFstream::snapshots_file_path() const
+{
+	return trace_dir + "/snapshots";
+}
+
+string
+TraceFstream::snapshot_index_file_path() const
+{
+	return trace_dir + "/snapshot_index";
+}
+
+string
+TraceFstream::ring_file_path() const
+{
+	return trace_dir + "/ring";
 }
 
 string
@@ -195,21 +255,175 @@ TraceFstream::version_file_path() const
 	return trace_dir + "/version";
 }
 
+static byte* put_varint(byte* p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static size_t varint_size(uint32_t v)
+{
+	size_t size = 1;
+	while (v >= 0x80) {
+		++size;
+		v >>= 7;
+	}
+	return size;
+}
+
+static bool get_varint(const byte** p, const byte* end, uint32_t* v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 32; shift += 7) {
+		if (*p >= end) {
+			return false;
+		}
+		byte b = *(*p)++;
+		*v |= uint32_t(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Map small negative and positive differences to small unsigned
+ * values. */
+static uint32_t zigzag(uint32_t v)
+{
+	return (v << 1) ^ uint32_t(int32_t(v) >> 31);
+}
+
+static uint32_t unzigzag(uint32_t v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+/**
+ * Most of a frame's exec info (rbc and registers) is unchanged since
+ * the same task's previous frame, or changed by a small amount.  So
+ * exec info is stored as a one-byte length followed by either
+ *  - a "keyframe": varint 1, followed by the exec info verbatim, or
+ *  - a delta: varint |mask << 1|, where bit i of |mask| is set if word
+ *    i of the exec info changed, followed by the zigzag varint
+ *    difference of each changed word.
+ * Keyframes are written for a task's first frame after each index
+ * entry, so that readers can start decoding at any index entry.
+ *
+ * Encode |words| into |out|, which must have room for
+ * |EXEC_INFO_MAX_ENCODED| bytes, relative to |prev|, update |prev|,
+ * and return the number of bytes written.
+ */
+static size_t encode_exec_info(const uint32_t* words,
+			       vector<uint32_t>& prev, byte* out)
+{
+	static_assert(EXEC_INFO_WORDS < 31, "Changed-word mask overflows");
+	static_assert(EXEC_INFO_MAX_ENCODED <= UINT8_MAX,
+		      "Encoded exec info length overflows");
+	byte* p = out;
+	uint32_t mask = 0;
+	size_t delta_size = EXEC_INFO_MAX_ENCODED + 1;
+	if (!prev.empty()) {
+		for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+			if (words[i] != prev[i]) {
+				mask |= 1 << i;
+			}
+		}
+		// Size the delta before writing it: when many words
+		// change by a lot, it's larger than a keyframe.
+		delta_size = varint_size(mask << 1);
+		for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+			if (mask & (1 << i)) {
+				delta_size +=
+					varint_size(zigzag(words[i] - prev[i]));
+			}
+		}
+	}
+	if (delta_size <= EXEC_INFO_MAX_ENCODED) {
+		p = put_varint(p, mask << 1);
+		for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+			if (mask & (1 << i)) {
+				p = put_varint(p, zigzag(words[i] - prev[i]));
+			}
+		}
+	} else {
+		p = put_varint(p, 1);
+		memcpy(p, words, EXEC_INFO_WORDS * sizeof(uint32_t));
+		p += EXEC_INFO_WORDS * sizeof(uint32_t);
+	}
+	assert(size_t(p - out) <= EXEC_INFO_MAX_ENCODED);
+	prev.assign(words, words + EXEC_INFO_WORDS);
+	return p - out;
+}
+
+/**
+ * Decode |len| bytes at |in|, which were written by
+ * |encode_exec_info()|, into |words|, and update |prev|.  Return
+ * false if the data is malformed.
+ */
+static bool decode_exec_info(const byte* in, size_t len,
+			     vector<uint32_t>& prev, uint32_t* words)
+{
+	const byte* end = in + len;
+	uint32_t flags;
+	if (!get_varint(&in, end, &flags)) {
+		return false;
+	}
+	if (flags & 1) {
+		if (size_t(end - in) != EXEC_INFO_WORDS * sizeof(uint32_t)) {
+			return false;
+		}
+		memcpy(words, in, EXEC_INFO_WORDS * sizeof(uint32_t));
+	} else {
+		uint32_t mask = flags >> 1;
+		if (prev.empty() || (mask >> EXEC_INFO_WORDS)) {
+			return false;
+		}
+		for (size_t i = 0; i < EXEC_INFO_WORDS; ++i) {
+			uint32_t diff = 0;
+			if ((mask & (1 << i)) && !get_varint(&in, end, &diff)) {
+				return false;
+			}
+			words[i] = prev[i] + unzigzag(diff);
+		}
+		if (in != end) {
+			return false;
+		}
+	}
+	prev.assign(words, words + EXEC_INFO_WORDS);
+	return true;
+}
+
 TraceOfstream& operator<<(TraceOfstream& tof, const struct trace_frame& frame)
 {
 	const char* begin_data = (const char*)&frame.begin_event_info;
 	ssize_t nbytes = sizeof_trace_frame_event_info();
+	tof.events.write(begin_data, nbytes);
 
 	// TODO: only store exec info for non-async-sig events when
 	// debugging assertions are enabled.
 	if (frame.ev.has_exec_info) {
-		nbytes += sizeof_trace_frame_exec_info();
+		uint32_t words[EXEC_INFO_WORDS];
+		memcpy(words, &frame.begin_exec_info, sizeof(words));
+		byte buf[1 + EXEC_INFO_MAX_ENCODED];
+		size_t len = encode_exec_info(words,
+					      tof.exec_info_history[frame.tid],
+					      buf + 1);
+		buf[0] = len;
+		tof.events.write(buf, 1 + len);
+		nbytes += 1 + len;
 	}
-	tof.events.write(begin_data, nbytes);
 	if (!tof.events.good()) {
 		FATAL() <<"Tried to save "<< nbytes <<" bytes to the trace, but failed";
 	}
-	tof.tick_time();
+	if (0 == tof.tick_time() % TRACE_INDEX_INTERVAL) {
+		tof.write_index_entry();
+		tof.exec_info_history.clear();
+	}
 	return tof;
 }
 TraceIfstream& operator>>(TraceIfstream& tif, struct trace_frame& frame)
@@ -220,57 +434,70 @@ TraceIfstream& operator>>(TraceIfstream& tif, struct trace_frame& frame)
 	tif.events.read((char*)&frame.begin_event_info,
 			sizeof_trace_frame_event_info());
 	if (frame.ev.has_exec_info) {
-		tif.events.read((char*)&frame.begin_exec_info,
-				sizeof_trace_frame_exec_info());
+		uint8_t len = 0;
+		const byte* encoded;
+		uint32_t words[EXEC_INFO_WORDS];
+		if (tif.events.read(&len, sizeof(len))
+		    && tif.events.read_view(len, &encoded)) {
+			vector<uint32_t>& prev =
+				tif.exec_info_history[frame.tid];
+			if (tif.exec_info_undo
+			    && !tif.exec_info_undo->count(frame.tid)) {
+				(*tif.exec_info_undo)[frame.tid] = prev;
+			}
+			if (!decode_exec_info(encoded, len, prev, words)) {
+				FATAL() <<"Corrupt exec info in trace frame "
+					<< frame.global_time;
+			}
+			memcpy(&frame.begin_exec_info, words, sizeof(words));
+		}
 	}
 	tif.tick_time();
 	assert(tif.time() == frame.global_time);
-	// Set the eofbit if we're at end-of-stream.
-	tif.events.peek();
 	return tif;
 }
 
-static ostream& operator<<(ostream& out, const struct timespec& ts)
-{
-	out << ts.tv_sec <<" "<< ts.tv_nsec;
-	return out;
-}
-static istream& operator>>(istream& in, struct timespec& ts)
-{
-	in >> ts.tv_sec >> ts.tv_nsec;
-	return in;
-}
-
-static ostream& operator<<(ostream& out, const struct stat& v)
-{
-	out << v.st_blksize <<" "<< v.st_blocks <<" "<< v.st_ctim
-	    <<" "<< v.st_dev <<" "<< v.st_gid <<" "<< v.st_ino
-	    <<" "<< v.st_mode <<" "<< v.st_mtim <<" "<< v.st_mtim.tv_nsec
-	    <<" "<< v.st_rdev <<" "<< v.st_size <<" "<< v.st_uid;
-	return out;
-}
-static istream& operator>>(istream& in, struct stat& v)
-{
-	in >> v.st_blksize >> v.st_blocks >> v.st_ctim
-	    >> v.st_dev >> v.st_gid >> v.st_ino
-	    >> v.st_mode >> v.st_mtim >> v.st_mtim.tv_nsec
-	    >> v.st_rdev >> v.st_size >> v.st_uid;
-	return in;
-}
+/**
+ * Fixed-size part of an |mmapped_file| record in the mmaps file.  The
+ * record continues with |filename_len| bytes of file name, without a
+ * terminating '\0'.
+ */
+struct mmapped_file_header {
+	uint32_t time;
+	int32_t tid;
+	int32_t copied;
+	uint32_t filename_len;
+	struct stat stat;
+	void* start;
+	void* end;
+};
 
 TraceOfstream& operator<<(TraceOfstream& tof, const struct mmapped_file& map)
 {
-	tof.mmaps << map.time <<" "<< map.tid <<" "<< map.copied
-		  <<" "<< map.filename <<'\0'
-		  <<" "<< map.stat <<" "<< map.start <<" "<< map.end << endl;
+	struct mmapped_file_header h;
+	h.time = map.time;
+	h.tid = map.tid;
+	h.copied = map.copied;
+	h.filename_len = map.filename.size();
+	h.stat = map.stat;
+	h.start = map.start;
+	h.end = map.end;
+	tof.mmaps.write(&h, sizeof(h));
+	tof.mmaps.write(map.filename.data(), map.filename.size());
 	return tof;
 }
 TraceIfstream& operator>>(TraceIfstream& tif, struct mmapped_file& map)
 {
-	tif.mmaps >> map.time >> map.tid >> map.copied;
-	tif.mmaps.ignore(1);
-	tif.mmaps.getline(map.filename, sizeof(map.filename), '\0');
-	tif.mmaps >> map.stat >> map.start >> map.end;
+	struct mmapped_file_header h;
+	tif.mmaps.read(&h, sizeof(h));
+	map.time = h.time;
+	map.tid = h.tid;
+	map.copied = h.copied;
+	map.stat = h.stat;
+	map.start = h.start;
+	map.end = h.end;
+	map.filename.resize(h.filename_len);
+	tif.mmaps.read(&map.filename[0], h.filename_len);
 	return tif;
 }
 
@@ -324,23 +551,319 @@ TraceIfstream& operator>>(TraceIfstream& tif, struct args_env& ae)
 	return tif;
 }
 
+/* Payloads at least this big are deduplicated.  Smaller ones aren't
+ * worth the cost of a hash reference and lookup. */
+#define DEDUP_MIN_SIZE 512
+
+/* The contents of recently used blobs, up to this many bytes, are kept
+ * to check hash matches against without reading the blobs file back.
+ * That's more than the writer thread can have queued, so blobs that
+ * have dropped out have usually reached the file. */
+#define BLOB_CACHE_SIZE (32 * 1024 * 1024)
+
+enum {
+	// The record's data is in the blobs file.  The record is
+	// followed by the |hash128| of its data.
+	RAW_DATA_IN_BLOB = 1 << 0,
+};
+
+/**
+ * A |raw_data| record in the data_header file.  Unless
+ * |RAW_DATA_IN_BLOB| is set, the record's |num_bytes| bytes of data
+ * are the next bytes in the data file.
+ */
+struct raw_data_header {
+	int32_t global_time;
+	EncodedEvent ev;
+	void* addr;
+	uint32_t num_bytes;
+	uint32_t flags;
+};
+
 TraceOfstream& operator<<(TraceOfstream& tof, const struct raw_data& d)
 {
-	tof.data_header << d.global_time <<" "<< d.ev.encoded
-			<<" "<< d.addr <<" "<< d.data.size() << endl;
-	tof.data.write((const char*)d.data.data(), d.data.size());
+	uint32_t flags = 0;
+	hash128 hash;
+	if (tof.dedup && d.data.size() >= DEDUP_MIN_SIZE) {
+		hash = hash_bytes(d.data.data(), d.data.size());
+		auto it = tof.stored_blobs.find(hash);
+		if (it == tof.stored_blobs.end()) {
+			struct blob_index_entry entry;
+			entry.hash = hash;
+			entry.num_bytes = d.data.size();
+			entry.pos = tof.blobs.tell();
+			tof.blobs.write(d.data.data(), d.data.size());
+			tof.blob_index.write(&entry, sizeof(entry));
+			TraceOfstream::stored_blob& b = tof.stored_blobs[hash];
+			b.begin = entry.pos;
+			b.end = tof.blobs.tell();
+			b.num_bytes = entry.num_bytes;
+			b.cached = tof.blob_cache.end();
+			tof.cache_blob(b, hash, d.data);
+			flags |= RAW_DATA_IN_BLOB;
+		} else if (tof.blob_matches(it->second, hash, d.data)) {
+			tof.deduped_bytes += d.data.size();
+			flags |= RAW_DATA_IN_BLOB;
+		}
+		// Otherwise it's a hash collision, the blob was
+		// discarded with its segment, or it couldn't be read
+		// back without waiting for the writer thread.  The
+		// hash can't name this data, so it's stored inline.
+	}
+
+	tof.write_raw_data_header(d.addr, d.data.size(), d.ev, d.global_time,
+				  flags);
+	if (flags & RAW_DATA_IN_BLOB) {
+		tof.data_header.write(&hash, sizeof(hash));
+	} else {
+		tof.data.write(d.data.data(), d.data.size());
+	}
 	return tof;
 }
-TraceIfstream& operator>>(TraceIfstream& tif, struct raw_data& d)
+
+bool
+TraceOfstream::blob_matches(stored_blob& b, const hash128& hash,
+			    const vector<byte>& data)
 {
-	size_t num_bytes;
-	tif.data_header >> d.global_time >> d.ev.encoded >> d.addr
-			>> num_bytes;
-	d.data.resize(num_bytes);
-	tif.data.read((char*)d.data.data(), num_bytes);
+	if (b.num_bytes != data.size()) {
+		return false;
+	}
+	if (b.cached != blob_cache.end()) {
+		blob_cache.splice(blob_cache.begin(), blob_cache, b.cached);
+		return b.cached->second == data;
+	}
+	if (!blobs.matches(b.begin, b.end, data.data(), data.size())) {
+		return false;
+	}
+	cache_blob(b, hash, data);
+	return true;
+}
+
+void
+TraceOfstream::cache_blob(stored_blob& b, const hash128& hash,
+			  const vector<byte>& data)
+{
+	blob_cache.push_front(make_pair(hash, data));
+	b.cached = blob_cache.begin();
+	blob_cache_bytes += data.size();
+	while (blob_cache_bytes > BLOB_CACHE_SIZE) {
+		auto& oldest = blob_cache.back();
+		blob_cache_bytes -= oldest.second.size();
+		stored_blobs[oldest.first].cached = blob_cache.end();
+		blob_cache.pop_back();
+	}
+}
+
+void
+TraceOfstream::write_raw_data_header(void* addr, size_t num_bytes,
+				     const EncodedEvent& ev,
+				     int32_t global_time, uint32_t flags)
+{
+	struct raw_data_header h;
+	h.global_time = global_time;
+	h.ev = ev;
+	h.addr = addr;
+	h.num_bytes = num_bytes;
+	h.flags = flags;
+	raw_data_bytes += num_bytes;
+	data_header.write(&h, sizeof(h));
+}
+
+void
+TraceOfstream::write_raw_data(void* addr, size_t num_bytes,
+			      const EncodedEvent& ev, int32_t global_time,
+			      const CompressedWriter::Filler& fill)
+{
+	if (dedup && num_bytes >= DEDUP_MIN_SIZE) {
+		// The data has to be hashed before we know whether
+		// it needs to be written at all.
+		struct raw_data d;
+		d.addr = addr;
+		d.ev = ev;
+		d.global_time = global_time;
+		d.data.resize(num_bytes);
+		fill(d.data.data(), 0, num_bytes);
+		*this << d;
+		return;
+	}
+
+	write_raw_data_header(addr, num_bytes, ev, global_time, 0);
+	data.write_in_place(num_bytes, fill);
+}
+
+TraceIfstream& operator>>(TraceIfstream& tif, struct raw_data_view& d)
+{
+	struct raw_data_header h;
+	tif.data_header.read(&h, sizeof(h));
+	d.global_time = h.global_time;
+	d.ev = h.ev;
+	d.addr = h.addr;
+	d.data.len = h.num_bytes;
+	if (!(h.flags & RAW_DATA_IN_BLOB)) {
+		tif.data.read_view(h.num_bytes, &d.data.ptr);
+		return tif;
+	}
+
+	hash128 hash;
+	tif.data_header.read(&hash, sizeof(hash));
+	tif.load_blob_index();
+	auto it = tif.blob_index->find(hash);
+	if (tif.blob_index->end() == it || it->second.num_bytes != h.num_bytes) {
+		FATAL() <<"Trace data at time "<< h.global_time
+			<<" refers to a missing blob";
+	}
+	tif.blobs.seek(it->second.pos);
+	tif.blobs.read_view(h.num_bytes, &d.data.ptr);
 	return tif;
 }
 
+/**
+ * Snapshots are stored as the fixed-size part of each struct (the
+ * fields between |begin_fixed| and |end_fixed|) verbatim, followed by
+ * its variable-size fields, each preceded by its 32-bit size.
+ */
+template<typename T>
+static void write_fixed(CompressedWriter& out, const T& v)
+{
+	out.write(&v.begin_fixed, v.end_fixed - v.begin_fixed);
+}
+template<typename T>
+static bool read_fixed(CompressedReader& in, T& v)
+{
+	return in.read(&v.begin_fixed, v.end_fixed - v.begin_fixed);
+}
+
+static void write_sized(CompressedWriter& out, const void* data, size_t len)
+{
+	uint32_t size = len;
+	out.write(&size, sizeof(size));
+	out.write(data, len);
+}
+template<typename C>
+static bool read_sized(CompressedReader& in, C& c)
+{
+	uint32_t size;
+	if (!in.read(&size, sizeof(size))) {
+		return false;
+	}
+	c.resize(size);
+	return 0 == size || in.read(&c[0], size);
+}
+
+TraceOfstream& operator<<(TraceOfstream& tof, const struct trace_snapshot& s)
+{
+	assert(s.global_time == tof.time());
+	snapshot_index_entry entry;
+	entry.pos.global_time = s.global_time;
+	entry.pos.events = tof.events.tell();
+	entry.pos.data = tof.data.tell();
+	entry.pos.data_header = tof.data_header.tell();
+	entry.pos.mmaps = tof.mmaps.tell();
+	entry.snapshot = tof.snapshots.tell();
+	// Readers starting here don't know the preceding frames.
+	tof.exec_info_history.clear();
+
+	CompressedWriter& out = tof.snapshots;
+	uint32_t num_vms = s.vms.size();
+	out.write(&num_vms, sizeof(num_vms));
+	for (auto& vm : s.vms) {
+		write_sized(out, vm.exe_image.data(), vm.exe_image.size());
+		out.write(&vm.heap_start, sizeof(vm.heap_start));
+		out.write(&vm.heap_end, sizeof(vm.heap_end));
+		uint32_t num_mappings = vm.mappings.size();
+		out.write(&num_mappings, sizeof(num_mappings));
+		for (auto& m : vm.mappings) {
+			write_fixed(out, m);
+			write_sized(out, m.fsname.data(), m.fsname.size());
+			write_sized(out, m.contents.data(), m.contents.size());
+		}
+		uint32_t num_tasks = vm.tasks.size();
+		out.write(&num_tasks, sizeof(num_tasks));
+		for (auto& t : vm.tasks) {
+			write_fixed(out, t);
+			write_sized(out, t.prname.data(), t.prname.size());
+			write_sized(out, t.syscallbuf_hdr.data(),
+				    t.syscallbuf_hdr.size());
+			write_sized(out, t.sighandlers.data(),
+				    t.sighandlers.size());
+		}
+	}
+	tof.snapshot_index.write(&entry, sizeof(entry));
+	tof.last_snapshot_time = s.global_time;
+
+	if (tof.ring_size) {
+		// Count the snapshot's own blocks as written before
+		// it, so that they're discarded along with it.
+		tof.snapshots.flush();
+		tof.ring.push_back(make_pair(entry, tof.ring_bytes_written()));
+		tof.trace_bytes_at_last_snapshot = tof.trace_bytes_written();
+		tof.trim_ring();
+	}
+	return tof;
+}
+
+bool
+TraceOfstream::snapshot_due() const
+{
+	if (snapshot_interval
+	    && global_time - last_snapshot_time >= snapshot_interval) {
+		return true;
+	}
+	if (!ring_size) {
+		return false;
+	}
+	// Snapshots themselves don't count, or a snapshot bigger
+	// than |ring_size / 4| would make the next one due at once.
+	return ring.empty()
+		|| (trace_bytes_written() - trace_bytes_at_last_snapshot
+		    >= ring_size / 4);
+}
+
+uint64_t
+TraceOfstream::trace_bytes_written() const
+{
+	return (events.bytes_written() + data.bytes_written()
+		+ data_header.bytes_written() + mmaps.bytes_written());
+}
+
+uint64_t
+TraceOfstream::ring_bytes_written() const
+{
+	return trace_bytes_written() + snapshots.bytes_written();
+}
+
+void
+TraceOfstream::trim_ring()
+{
+	uint64_t written = ring_bytes_written();
+	bool trimmed = false;
+	while (ring.size() > 1 && written - ring[1].second >= ring_size) {
+		ring.pop_front();
+		trimmed = true;
+	}
+	if (!trimmed) {
+		return;
+	}
+	const snapshot_index_entry& oldest = ring.front().first;
+	LOG(debug) <<"Discarding trace data before event "
+		   << oldest.pos.global_time;
+	events.discard_segments_before(oldest.pos.events.segment);
+	data.discard_segments_before(oldest.pos.data.segment);
+	data_header.discard_segments_before(oldest.pos.data_header.segment);
+	mmaps.discard_segments_before(oldest.pos.mmaps.segment);
+	snapshots.discard_segments_before(oldest.snapshot.segment);
+}
+
+bool
+TraceOfstream::good() const
+{
+	return (events.good()
+		&& data.good() && data_header.good()
+		&& mmaps.good() && index.good()
+		&& blobs.good() && blob_index.good()
+		&& snapshots.good() && snapshot_index.good());
+}
+
 void
 TraceOfstream::flush()
 {
@@ -348,6 +871,39 @@ TraceOfstream::flush()
 	data.flush();
 	data_header.flush();
 	mmaps.flush();
+	index.flush();
+	blobs.flush();
+	blob_index.flush();
+	snapshots.flush();
+	snapshot_index.flush();
+	writer.flush();
+}
+
+void
+TraceOfstream::report_dedup_stats() const
+{
+	if (!dedup) {
+		return;
+	}
+	fprintf(stderr,
+		"rr: %llu of %llu bytes of recorded data were duplicates"
+		" (%.1f%%), stored in %zu blobs\n",
+		(unsigned long long)deduped_bytes,
+		(unsigned long long)raw_data_bytes,
+		raw_data_bytes ? 100.0 * deduped_bytes / raw_data_bytes : 0.0,
+		stored_blobs.size());
+}
+
+void
+TraceOfstream::write_index_entry()
+{
+	struct trace_index_entry entry;
+	entry.global_time = global_time;
+	entry.events = events.tell();
+	entry.data = data.tell();
+	entry.data_header = data_header.tell();
+	entry.mmaps = mmaps.tell();
+	index.write(&entry, sizeof(entry));
 }
 
 /*static*/ TraceOfstream::shr_ptr
@@ -371,7 +927,10 @@ TraceOfstream::create(const string& exe_path)
 		FATAL() <<"Unable to create trace directory `"<< dir <<"'";
 	}
 
-	shr_ptr trace(new TraceOfstream(dir));
+	shr_ptr trace(new TraceOfstream(dir, rr_flags()->segment_size));
+	trace->dedup = rr_flags()->dedup_data;
+	trace->ring_size = rr_flags()->ring_size;
+	trace->snapshot_interval = rr_flags()->snapshot_interval;
 
 	string version_path = trace->version_file_path();
 	fstream version(version_path.c_str(), fstream::out);
@@ -380,6 +939,13 @@ TraceOfstream::create(const string& exe_path)
 	}
 	version << TRACE_VERSION << endl;
 
+	if (trace->ring_size) {
+		fstream ring(trace->ring_file_path().c_str(), fstream::out);
+		if (!ring.good()) {
+			FATAL() <<"Unable to create "<< trace->ring_file_path();
+		}
+	}
+
 	string link_name = latest_trace_symlink();
 	// Try to update the symlink to |trace|.  We only try attempt
 	// to set the symlink once.  If the link is re-created after
@@ -401,30 +967,47 @@ TraceOfstream::create(const string& exe_path)
 	return trace;
 }
 
+/**
+ * Restore the event stream position, time and exec info history of
+ * |ifs| when this goes out of scope.  Only the history entries of the
+ * tasks whose frames were read in the meantime are saved, by
+ * |operator>>()|, in |exec_info_undo|.
+ */
 struct AutoRestoreState {
 	AutoRestoreState(TraceIfstream& ifs)
 		: ifs(ifs)
-		, pos(ifs.events.tellg())
+		, pos(ifs.events.tell())
 		, global_time(ifs.global_time)
-	{}
+	{
+		assert(!ifs.exec_info_undo);
+		ifs.exec_info_undo = &exec_info_undo;
+	}
 	~AutoRestoreState() {
-		ifs.events.seekg(pos);
+		ifs.events.seek(pos);
 		ifs.global_time = global_time;
+		for (auto& it : exec_info_undo) {
+			swap(ifs.exec_info_history[it.first], it.second);
+		}
+		ifs.exec_info_undo = nullptr;
 	}
 	TraceIfstream& ifs;
-	fstream::streampos pos;
+	CompressedPosition pos;
 	uint32_t global_time;
+	ExecInfoHistory exec_info_undo;
 };
 
+bool
+TraceIfstream::good()
+{
+	return (events.good() && !events.at_end()
+		&& data.good() && data_header.good()
+		&& mmaps.good() && blobs.good());
+}
+
 TraceIfstream::shr_ptr
 TraceIfstream::clone()
 {
-	shr_ptr stream(new TraceIfstream(dir()));
-	stream->events.seekg(events.tellg());
-	stream->data.seekg(data.tellg());
-	stream->data_header.seekg(data_header.tellg());
-	stream->mmaps.seekg(mmaps.tellg());
-	stream->global_time = global_time;
+	shr_ptr stream(new TraceIfstream(*this));
 	assert(stream->good());
 	return stream;
 }
@@ -456,14 +1039,256 @@ TraceIfstream::peek_to(pid_t pid, EventType type, int state)
 	return frame;
 }
 
+void
+TraceIfstream::load_index()
+{
+	if (index) {
+		return;
+	}
+
+	auto entries = make_shared<vector<trace_index_entry> >();
+	CompressedReader in(index_file_path());
+	struct trace_index_entry entry;
+	while (in.good() && !in.at_end() && in.read(&entry, sizeof(entry))) {
+		entries->push_back(entry);
+	}
+	LOG(debug) <<"Loaded "<< entries->size() <<" trace index entries";
+	index = entries;
+}
+
+void
+TraceIfstream::load_blob_index()
+{
+	if (blob_index) {
+		return;
+	}
+
+	auto entries = make_shared<map<hash128, blob_index_entry> >();
+	CompressedReader in(blob_index_file_path());
+	struct blob_index_entry entry;
+	while (in.good() && !in.at_end() && in.read(&entry, sizeof(entry))) {
+		(*entries)[entry.hash] = entry;
+	}
+	LOG(debug) <<"Loaded "<< entries->size() <<" blob index entries";
+	blob_index = entries;
+}
+
+bool
+TraceIfstream::has_snapshot_data(const snapshot_index_entry& entry) const
+{
+	auto exists = [this](const string& filename,
+			     const CompressedPosition& pos) {
+		string path = segment_file_path(filename, pos.segment);
+		return 0 == access(path.c_str(), F_OK);
+	};
+	return (exists(events_file_path(), entry.pos.events)
+		&& exists(data_file_path(), entry.pos.data)
+		&& exists(data_header_file_path(), entry.pos.data_header)
+		&& exists(mmaps_file_path(), entry.pos.mmaps)
+		&& exists(snapshots_file_path(), entry.snapshot));
+}
+
+bool
+TraceIfstream::start_discarded() const
+{
+	// In any other trace, a missing first segment is an error,
+	// which the stream's reader logs.  The streams fill at
+	// different rates, so any of them may have lost segments
+	// while the others haven't.
+	if (0 != access(ring_file_path().c_str(), F_OK)) {
+		return false;
+	}
+	const string paths[] = { events_file_path(), data_file_path(),
+				 data_header_file_path(), mmaps_file_path() };
+	for (size_t i = 0; i < ALEN(paths); ++i) {
+		if (0 != access(paths[i].c_str(), F_OK)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+TraceIfstream::find_start_snapshot()
+{
+	if (!start_discarded()) {
+		return;
+	}
+	CompressedReader in(snapshot_index_file_path());
+	snapshot_index_entry entry;
+	while (!in.at_end() && in.read(&entry, sizeof(entry))) {
+		if (has_snapshot_data(entry)) {
+			LOG(debug) <<"Trace starts at snapshot before event "
+				   << entry.pos.global_time;
+			has_start_snapshot = true;
+			start_snapshot = entry;
+			return;
+		}
+	}
+	FATAL() <<"The start of trace `"<< trace_dir
+		<<"' is missing, and no snapshot to start from was found";
+}
+
+bool
+TraceIfstream::start_at_snapshot_before(uint32_t time)
+{
+	if (0 != access(snapshot_index_file_path().c_str(), F_OK)) {
+		return false;
+	}
+	CompressedReader in(snapshot_index_file_path());
+	snapshot_index_entry entry;
+	bool found = false;
+	while (!in.at_end() && in.read(&entry, sizeof(entry))
+	       && entry.pos.global_time <= time) {
+		if (entry.pos.global_time > first_time()
+		    && has_snapshot_data(entry)) {
+			start_snapshot = entry;
+			found = true;
+		}
+	}
+	if (!found) {
+		return false;
+	}
+	LOG(debug) <<"Starting replay at snapshot before event "
+		   << start_snapshot.pos.global_time;
+	has_start_snapshot = true;
+	rewind();
+	return true;
+}
+
+void
+TraceIfstream::read_start_snapshot(struct trace_snapshot& s)
+{
+	assert(has_start_snapshot);
+	CompressedReader in(snapshots_file_path());
+	in.seek(start_snapshot.snapshot);
+	s.global_time = start_snapshot.pos.global_time;
+	s.vms.clear();
+	uint32_t num_vms = 0;
+	bool ok = in.read(&num_vms, sizeof(num_vms));
+	for (uint32_t i = 0; ok && i < num_vms; ++i) {
+		s.vms.push_back(vm_snapshot());
+		vm_snapshot& vm = s.vms.back();
+		uint32_t num_mappings = 0, num_tasks = 0;
+		ok = (read_sized(in, vm.exe_image)
+		      && in.read(&vm.heap_start, sizeof(vm.heap_start))
+		      && in.read(&vm.heap_end, sizeof(vm.heap_end))
+		      && in.read(&num_mappings, sizeof(num_mappings)));
+		for (uint32_t j = 0; ok && j < num_mappings; ++j) {
+			vm.mappings.push_back(mapping_snapshot());
+			mapping_snapshot& m = vm.mappings.back();
+			ok = (read_fixed(in, m) && read_sized(in, m.fsname)
+			      && read_sized(in, m.contents));
+		}
+		ok = ok && in.read(&num_tasks, sizeof(num_tasks));
+		for (uint32_t j = 0; ok && j < num_tasks; ++j) {
+			vm.tasks.push_back(task_snapshot());
+			task_snapshot& t = vm.tasks.back();
+			ok = (read_fixed(in, t) && read_sized(in, t.prname)
+			      && read_sized(in, t.syscallbuf_hdr)
+			      && read_sized(in, t.sighandlers));
+		}
+	}
+	if (!ok) {
+		FATAL() <<"Failed to read snapshot for event "<< s.global_time;
+	}
+}
+
+void
+TraceIfstream::seek_to_time(uint32_t time)
+{
+	load_index();
+
+	// The next frame to be read is at |global_time + 1|.  Jump to
+	// the last index entry at or before |time|, if that's not
+	// behind us.  If |time| is behind us, we have to go back to
+	// an index entry or the start of the trace.
+	bool backwards = time <= global_time;
+	auto it = upper_bound(index->begin(), index->end(), time,
+			      [](uint32_t t, const trace_index_entry& e) {
+				      return t < e.global_time;
+			      });
+	if (it != index->begin() && (it - 1)->global_time < first_time()) {
+		// That part of the trace is gone.
+		it = index->begin();
+	}
+	if (it != index->begin()
+	    && (backwards || (it - 1)->global_time > global_time + 1)) {
+		--it;
+		events.seek(it->events);
+		data.seek(it->data);
+		data_header.seek(it->data_header);
+		mmaps.seek(it->mmaps);
+		global_time = it->global_time - 1;
+		exec_info_history.clear();
+	} else if (backwards) {
+		rewind();
+	}
+
+	while (global_time + 1 < time && good()) {
+		struct trace_frame frame;
+		*this >> frame;
+	}
+
+	// Discard the data and mmap records of the frames we skipped.
+	while (!data_header.at_end()) {
+		CompressedPosition pos = data_header.tell();
+		struct raw_data_header h;
+		data_header.read(&h, sizeof(h));
+		if (uint32_t(h.global_time) >= time) {
+			data_header.seek(pos);
+			break;
+		}
+		if (h.flags & RAW_DATA_IN_BLOB) {
+			data_header.skip(sizeof(hash128));
+		} else {
+			data.skip(h.num_bytes);
+		}
+	}
+	while (!mmaps.at_end()) {
+		CompressedPosition pos = mmaps.tell();
+		struct mmapped_file_header h;
+		mmaps.read(&h, sizeof(h));
+		if (h.time >= time) {
+			mmaps.seek(pos);
+			break;
+		}
+		mmaps.skip(h.filename_len);
+	}
+}
+
+void
+TraceIfstream::enable_read_ahead()
+{
+	if (read_ahead) {
+		return;
+	}
+	read_ahead.reset(new ReadAheadThread());
+	events.set_read_ahead(read_ahead.get());
+	data.set_read_ahead(read_ahead.get());
+	data_header.set_read_ahead(read_ahead.get());
+	mmaps.set_read_ahead(read_ahead.get());
+	blobs.set_read_ahead(read_ahead.get());
+}
+
 void
 TraceIfstream::rewind()
 {
-	events.seekg(0);
-	data.seekg(0);
-	data_header.seekg(0);
-	mmaps.seekg(0);
-	global_time = 0;
+	if (has_start_snapshot) {
+		events.seek(start_snapshot.pos.events);
+		data.seek(start_snapshot.pos.data);
+		data_header.seek(start_snapshot.pos.data_header);
+		mmaps.seek(start_snapshot.pos.mmaps);
+		global_time = start_snapshot.pos.global_time - 1;
+	} else {
+		events.rewind();
+		data.rewind();
+		data_header.rewind();
+		mmaps.rewind();
+		global_time = 0;
+	}
+	blobs.rewind();
+	exec_info_history.clear();
 	assert(good());
 }
 
@@ -499,5 +1324,9 @@ TraceIfstream::open(int argc, char** argv)
 			path.c_str(), path.c_str());
 		exit(EX_DATAERR);
 	}
+	trace->find_start_snapshot();
+	if (trace->starts_at_snapshot()) {
+		trace->rewind();
+	}
 	return trace;
 }
@@ -3,17 +3,24 @@
 #ifndef RR_TRACE_H_
 #define RR_TRACE_H_
 
+#include <asm/ldt.h>		// struct user_desc
 #include <linux/limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <deque>
 #include <fstream>
+#include <list>
+#include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "compressed_stream.h"
 #include "event.h"
+#include "hash.h"
 #include "registers.h"
 #include "types.h"
 
@@ -74,7 +81,7 @@ struct mmapped_file {
 	 * data? */
 	int copied;
 
-	char filename[PATH_MAX];
+	std::string filename;
 	struct stat stat;
 
 	/* Bounds of mapped region. */
@@ -119,6 +126,151 @@ struct raw_data {
 	int32_t global_time;
 };
 
+/**
+ * A read-only range of bytes owned by someone else.
+ */
+struct byte_span {
+	byte_span() : ptr(nullptr), len(0) {}
+
+	const byte* data() const { return ptr; }
+	size_t size() const { return len; }
+
+	const byte* ptr;
+	size_t len;
+};
+
+/**
+ * Like |raw_data|, but as read back during replay: |data| points into
+ * the TraceIfstream's buffers (often straight into the mapped trace
+ * file) instead of being copied out.  It's only valid until the next
+ * |raw_data_view| is read from the same stream.
+ */
+struct raw_data_view {
+	byte_span data;
+	void* addr;
+	EncodedEvent ev;
+	int32_t global_time;
+};
+
+/**
+ * The exec info of each task's most recent trace frame, as 32-bit
+ * words.  The next frame's exec info is stored as a delta against
+ * it.  An empty vector means there's nothing to delta against.
+ */
+typedef std::map<pid_t, std::vector<uint32_t> > ExecInfoHistory;
+
+/**
+ * An entry in the trace "blob_index" file, noting where the blob of
+ * raw data with |hash| is stored in the "blobs" file.
+ */
+struct blob_index_entry {
+	hash128 hash;
+	uint32_t num_bytes;
+	CompressedPosition pos;
+};
+
+/**
+ * An entry in the trace "index" file.  Every |TRACE_INDEX_INTERVAL|
+ * events, the recorder notes where the data for event |global_time|
+ * starts in each of the trace files.  Readers can then seek close to
+ * any event without scanning the trace from its beginning.
+ */
+struct trace_index_entry {
+	uint32_t global_time;
+	CompressedPosition events;
+	CompressedPosition data;
+	CompressedPosition data_header;
+	CompressedPosition mmaps;
+};
+
+/**
+ * One mapping of a |vm_snapshot|'s address space, and the resource it
+ * maps (see MappableResource).  |contents| is as much of the
+ * mapping's memory as could be read, or empty if the memory isn't
+ * saved.
+ */
+struct mapping_snapshot {
+	STRUCT_DELIMITER(begin_fixed);
+	void* start;
+	void* end;
+	int prot;
+	int flags;
+	int64_t offset;
+	dev_t device;
+	ino_t inode;
+	int psdev;
+	STRUCT_DELIMITER(end_fixed);
+	std::string fsname;
+	std::vector<byte> contents;
+};
+
+/**
+ * The state of one task needed to recreate it in replay, apart from
+ * its address space.  See Task for what the fields mean.
+ */
+struct task_snapshot {
+	STRUCT_DELIMITER(begin_fixed);
+	pid_t rec_tid;
+	Registers regs;
+	int64_t rbcs;
+	uint32_t thread_time;
+	uint64_t blocked_sigs;
+	void* tid_futex;
+	void* robust_futex_list;
+	uint32_t robust_futex_list_len;
+	bool thread_area_valid;
+	struct user_desc thread_area;
+	void* top_of_stack;
+	void* scratch_ptr;
+	int32_t scratch_size;
+	void* syscallbuf_child;
+	uint32_t num_syscallbuf_bytes;
+	void* traced_syscall_ip;
+	void* untraced_syscall_ip;
+	void* syscallbuf_lib_start;
+	void* syscallbuf_lib_end;
+	uint32_t initial_syscallbuf_size;
+	STRUCT_DELIMITER(end_fixed);
+	std::string prname;
+	// The syscallbuf header, and the task's sighandler table, as
+	// raw bytes.
+	std::vector<byte> syscallbuf_hdr;
+	std::vector<byte> sighandlers;
+};
+
+/**
+ * An address space and the tasks using it.  The first task is the
+ * thread-group leader.
+ */
+struct vm_snapshot {
+	std::string exe_image;
+	void* heap_start;
+	void* heap_end;
+	std::vector<mapping_snapshot> mappings;
+	std::vector<task_snapshot> tasks;
+};
+
+/**
+ * The state of all tracees just before the event at |global_time|.
+ * A trace recorded with a ring buffer starts replay by recreating the
+ * tracees from a snapshot, because the events that created them have
+ * been discarded.
+ */
+struct trace_snapshot {
+	uint32_t global_time;
+	std::vector<vm_snapshot> vms;
+};
+
+/**
+ * An entry in the trace "snapshot_index" file: where the snapshot
+ * taken just before event |pos.global_time| is stored in the
+ * "snapshots" file, and where the trace files continue after it.
+ */
+struct snapshot_index_entry {
+	trace_index_entry pos;
+	CompressedPosition snapshot;
+};
+
 /**
  * TraceFstream stores all the data common to both recording and
  * replay.  TraceOfstream deals with recording-specific logic, and
@@ -132,12 +284,6 @@ public:
 	/** Return the directory storing this trace's files. */
 	const string& dir() const { return trace_dir; }
 
-	/**
-	 * Return true iff all trace files are "good".  See std::ios
-	 * for more details.
-	 */
-	bool good() const;
-
 	/**
 	 * Return the current "global time" (event count) for this
 	 * trace.
@@ -145,13 +291,8 @@ public:
 	uint32_t time() const { return global_time; }
 
 protected:
-	TraceFstream(const string& trace_dir, fstream::openmode mode,
-		     uint32_t initial_time)
+	TraceFstream(const string& trace_dir, uint32_t initial_time)
 		: trace_dir(trace_dir)
-		, events(trace_dir + "/events", mode | fstream::binary)
-		, data(trace_dir + "/data", mode)
-		, data_header(trace_dir + "/data_header", mode)
-		, mmaps(trace_dir + "/mmaps", mode)
 		, global_time(initial_time)
 	{}
 
@@ -161,6 +302,37 @@ protected:
 	 */
 	string args_env_file_path() const;
 
+	/** Return the path of the "events" file. */
+	string events_file_path() const;
+
+	/** Return the path of the "data" file. */
+	string data_file_path() const;
+
+	/** Return the path of the "data_header" file. */
+	string data_header_file_path() const;
+
+	/** Return the path of the "mmaps" file. */
+	string mmaps_file_path() const;
+
+	/** Return the path of the "index" file. */
+	string index_file_path() const;
+
+	/** Return the paths of the "blobs" and "blob_index" files. */
+	string blobs_file_path() const;
+	string blob_index_file_path() const;
+
+	/**
+	 * Return the paths of the "snapshots" and "snapshot_index"
+	 * files.
+	 */
+	string snapshots_file_path() const;
+	string snapshot_index_file_path() const;
+	/**
+	 * Return the path of the "ring" file, whose existence marks a
+	 * trace recorded with --ring.
+	 */
+	string ring_file_path() const;
+
 	/**
 	 * Increment the global time and return the incremented value.
 	 */
@@ -175,15 +347,6 @@ protected:
 
 	// Directory into which we're saving the trace files.
 	string trace_dir;
-	// File that stores events (trace frames).
-	fstream events;
-	// Files that store raw data saved from tracees (|data|), and
-	// metadata about the stored data (|data_header|).
-	fstream data;
-	fstream data_header;
-	// File that stores metadata about files mmap'd during
-	// recording.
-	fstream mmaps;
 	// Arbitrary notion of trace time, ticked on the recording of
 	// each event (trace frame).
 	uint32_t global_time;
@@ -207,10 +370,51 @@ public:
 					 const struct args_env& ae);
 	friend TraceOfstream& operator<<(TraceOfstream& tif,
 					 const struct raw_data& d);
+	/**
+	 * Like writing a |raw_data| with the given fields and
+	 * |num_bytes| bytes of data, but the data is produced by
+	 * |fill| straight into the trace's buffers (see
+	 * |CompressedWriter::write_in_place()|) rather than staged
+	 * in a |raw_data| and copied.
+	 */
+	void write_raw_data(void* addr, size_t num_bytes,
+			    const EncodedEvent& ev, int32_t global_time,
+			    const CompressedWriter::Filler& fill);
+	/**
+	 * Write a snapshot of the tracees, which must be taken just
+	 * before the next event to be recorded.  When recording into
+	 * a ring, this also discards trace data that's no longer
+	 * needed to replay the most recent part of the execution.
+	 */
+	friend TraceOfstream& operator<<(TraceOfstream& tif,
+					 const struct trace_snapshot& s);
+
+	/**
+	 * Return true iff all trace files are "good".  See std::ios
+	 * for more details.
+	 */
+	bool good() const;
 
-	/** Call flush() on all the relevant trace files. */
+	/**
+	 * Call flush() on all the relevant trace files, and wait until
+	 * their data has been written out.
+	 */
 	void flush();
 
+	/**
+	 * If raw data is being deduplicated, tell the user how much
+	 * that saved.
+	 */
+	void report_dedup_stats() const;
+
+	/**
+	 * Return true iff another snapshot should be taken: either
+	 * |snapshot_interval| events have passed since the last one,
+	 * or this is recording into a ring and enough data has been
+	 * written since the last snapshot.
+	 */
+	bool snapshot_due() const;
+
 	/**
 	 * Create and return a trace that will record the initial exe
 	 * image |exe_path|.  The trace name is determined by the
@@ -219,12 +423,139 @@ public:
 	static shr_ptr create(const string& exe_path);
 
 private:
-	TraceOfstream(const string& trace_dir)
-		: TraceFstream(trace_dir, fstream::out | fstream::app,
+	typedef std::list<std::pair<hash128, std::vector<byte> > > BlobCache;
+	/**
+	 * Where a blob was written to the blobs file, and where its
+	 * contents are in |blob_cache|, or |blob_cache.end()|.
+	 */
+	struct stored_blob {
+		CompressedPosition begin;
+		CompressedPosition end;
+		uint32_t num_bytes;
+		BlobCache::iterator cached;
+	};
+
+	TraceOfstream(const string& trace_dir, uint64_t segment_size)
+		: TraceFstream(trace_dir,
 			       // Somewhat arbitrarily start the
 			       // global time from 1.
 			       1)
+		, events(events_file_path(), &writer, segment_size)
+		, data(data_file_path(), &writer, segment_size)
+		, data_header(data_header_file_path(), &writer, segment_size)
+		, mmaps(mmaps_file_path(), &writer, segment_size)
+		, index(index_file_path(), &writer, segment_size)
+		, blobs(blobs_file_path(), &writer, segment_size)
+		, blob_index(blob_index_file_path(), &writer, segment_size)
+		, dedup(false)
+		, blob_cache_bytes(0)
+		, raw_data_bytes(0)
+		, deduped_bytes(0)
+		, snapshots(snapshots_file_path(), &writer, segment_size)
+		// The index files are small, and are needed whole,
+		// so they're never split or discarded.
+		, snapshot_index(snapshot_index_file_path(), &writer)
+		, ring_size(0)
+		, trace_bytes_at_last_snapshot(0)
+		, snapshot_interval(0)
+		, last_snapshot_time(0)
 	{}
+
+	/**
+	 * Note the current positions of all the trace files in the
+	 * index.
+	 */
+	void write_index_entry();
+
+	/**
+	 * Write the header of a raw data record of |num_bytes| bytes,
+	 * with |flags|, and count the bytes.  The caller then writes
+	 * the data, or the hash of the blob holding it.
+	 */
+	void write_raw_data_header(void* addr, size_t num_bytes,
+				   const EncodedEvent& ev,
+				   int32_t global_time, uint32_t flags);
+
+	/**
+	 * Return true iff |b|, whose hash is |hash|, holds |data|.
+	 */
+	bool blob_matches(stored_blob& b, const hash128& hash,
+			  const std::vector<byte>& data);
+	/**
+	 * Make |data| the most recently used entry of |blob_cache|,
+	 * as the contents of |b|, and evict the least recently used
+	 * entries that don't fit.
+	 */
+	void cache_blob(stored_blob& b, const hash128& hash,
+			const std::vector<byte>& data);
+
+	/**
+	 * Return the total number of bytes written to the trace
+	 * files that are discarded when recording into a ring, with
+	 * or without the snapshots.
+	 */
+	uint64_t trace_bytes_written() const;
+	uint64_t ring_bytes_written() const;
+	/**
+	 * Forget the oldest snapshots for as long as the snapshot after
+	 * each still leaves |ring_size| bytes of trace to replay, and
+	 * delete the trace data that only the forgotten ones needed.
+	 */
+	void trim_ring();
+
+	// Writes out the blocks of all the files below, so that the
+	// tracer doesn't wait for disk I/O.  Must outlive them.
+	WriterThread writer;
+	// File that stores events (trace frames).
+	CompressedWriter events;
+	// Files that store raw data saved from tracees (|data|), and
+	// metadata about the stored data (|data_header|).
+	CompressedWriter data;
+	CompressedWriter data_header;
+	// File that stores metadata about files mmap'd during
+	// recording.
+	CompressedWriter mmaps;
+	// File that stores |trace_index_entry|s.
+	CompressedWriter index;
+	// Cleared at each index entry, so that readers can start
+	// decoding there.
+	ExecInfoHistory exec_info_history;
+	// Content-addressed store of raw data payloads, used when
+	// |dedup| is on.  Each distinct large payload is written to
+	// |blobs| once, and |blob_index| notes where.  Records of the
+	// payload in |data_header| refer to it by hash.  A hash
+	// match is only trusted once the stored blob's bytes have
+	// been compared too, against |blob_cache| if the blob is
+	// still there.
+	CompressedWriter blobs;
+	CompressedWriter blob_index;
+	bool dedup;
+	std::map<hash128, stored_blob> stored_blobs;
+	// The contents of the most recently used blobs, most recent
+	// first, and their total size.
+	BlobCache blob_cache;
+	size_t blob_cache_bytes;
+	// Number of raw data bytes recorded, and how many of those
+	// were replaced by references to an existing blob.
+	uint64_t raw_data_bytes;
+	uint64_t deduped_bytes;
+	// Snapshots of the tracees, and the |snapshot_index_entry|s
+	// locating them.
+	CompressedWriter snapshots;
+	CompressedWriter snapshot_index;
+	// When nonzero, old trace data is discarded to keep about
+	// this many bytes.  |ring| holds the snapshots that are still
+	// replayable, oldest first, each with the value of
+	// |ring_bytes_written()| when it was taken.
+	uint64_t ring_size;
+	std::deque<std::pair<snapshot_index_entry, uint64_t> > ring;
+	// The value of |trace_bytes_written()| when the latest
+	// snapshot was taken.
+	uint64_t trace_bytes_at_last_snapshot;
+	// When nonzero, take a snapshot about this often, in events.
+	uint32_t snapshot_interval;
+	// The global time of the latest snapshot, or 0.
+	uint32_t last_snapshot_time;
 };
 
 class TraceIfstream: public TraceFstream {
@@ -246,7 +577,13 @@ public:
 	friend TraceIfstream& operator>>(TraceIfstream& tif,
 					 struct args_env& ae);
 	friend TraceIfstream& operator>>(TraceIfstream& tif,
-					 struct raw_data& d);
+					 struct raw_data_view& d);
+
+	/**
+	 * Return true iff all trace files are "good" and there are
+	 * more trace frames to read.
+	 */
+	bool good();
 
 	/**
 	 * Return a copy of this stream that has exactly the same
@@ -274,6 +611,37 @@ public:
 	 */
 	void rewind();
 
+	/**
+	 * Position this stream so that the next trace frame read is
+	 * the one recorded at |time|, or the end of the trace if
+	 * there's no such frame.  All trace files are positioned
+	 * consistently, as if the preceding frames and their data had
+	 * just been read.  This uses the trace index to skip most of
+	 * the trace, so it's cheap even for distant |time|s.
+	 */
+	void seek_to_time(uint32_t time);
+
+	/**
+	 * Start a thread that reads and decompresses trace data ahead
+	 * of its use.  Clones of this stream don't read ahead.
+	 */
+	void enable_read_ahead();
+
+	/**
+	 * Return true iff the start of this trace was discarded
+	 * during recording, so that replay has to start by restoring
+	 * the snapshot returned by |read_start_snapshot()|.
+	 */
+	bool starts_at_snapshot() const { return has_start_snapshot; }
+	void read_start_snapshot(struct trace_snapshot& s);
+	/**
+	 * If the trace has a snapshot taken at or before |time| and
+	 * after the current start of the trace, make the latest such
+	 * snapshot the start of the trace, rewind to it, and return
+	 * true.  Otherwise return false.
+	 */
+	bool start_at_snapshot_before(uint32_t time);
+
 	/**
 	 * Open and return the trace specified by the command line
 	 * spec |argc| / |argv|.  These are just the portion of the
@@ -283,13 +651,91 @@ public:
 
 private:
 	TraceIfstream(const string& trace_dir)
-		: TraceFstream(trace_dir, fstream::in,
+		: TraceFstream(trace_dir,
 			       // Initialize the global time at 0, so
 			       // that when we tick it when reading
 			       // the first trace, it matches the
 			       // initial global time at recording, 1.
 			       0)
+		, events(events_file_path(), start_discarded())
+		, data(data_file_path(), start_discarded())
+		, data_header(data_header_file_path(), start_discarded())
+		, mmaps(mmaps_file_path(), start_discarded())
+		, blobs(blobs_file_path())
+		, exec_info_undo(nullptr)
+		, has_start_snapshot(false)
 	{}
+	/**
+	 * Open the same trace as |other|, with the compressed streams
+	 * positioned where |other|'s are.  See |clone()|.  The copy
+	 * shares |other|'s open files, loaded blocks and indexes, so
+	 * this is cheap.
+	 */
+	TraceIfstream(const TraceIfstream& other)
+		: TraceFstream(other.trace_dir, other.global_time)
+		, events(other.events)
+		, data(other.data)
+		, data_header(other.data_header)
+		, mmaps(other.mmaps)
+		, blobs(other.blobs)
+		, index(other.index)
+		, exec_info_history(other.exec_info_history)
+		, exec_info_undo(nullptr)
+		, blob_index(other.blob_index)
+		, has_start_snapshot(other.has_start_snapshot)
+		, start_snapshot(other.start_snapshot)
+	{}
+
+	/** Read the whole "index" file into |index|, if necessary. */
+	void load_index();
+	/** Likewise for the "blob_index" file. */
+	void load_blob_index();
+	/**
+	 * Return true iff this is a ring trace some of whose oldest
+	 * segments have been discarded.
+	 */
+	bool start_discarded() const;
+	/**
+	 * If the start of the trace has been discarded, find the
+	 * oldest snapshot whose data is all still there.
+	 */
+	void find_start_snapshot();
+	/**
+	 * Return true iff all of the trace data that's needed to
+	 * start replay at |entry| still exists.
+	 */
+	bool has_snapshot_data(const snapshot_index_entry& entry) const;
+	/**
+	 * Return the time of the first frame that can be read from
+	 * this trace.
+	 */
+	uint32_t first_time() const {
+		return has_start_snapshot ? start_snapshot.pos.global_time : 1;
+	}
+
+	// Must outlive the readers that use it.
+	std::unique_ptr<ReadAheadThread> read_ahead;
+	// See TraceOfstream.
+	CompressedReader events;
+	CompressedReader data;
+	CompressedReader data_header;
+	CompressedReader mmaps;
+	CompressedReader blobs;
+	// Contents of the "index" file, sorted by time, once
+	// |load_index()|d.  Shared with clones.
+	std::shared_ptr<const std::vector<trace_index_entry> > index;
+	// See TraceOfstream.
+	ExecInfoHistory exec_info_history;
+	// While peeking, the |exec_info_history| entry each task had
+	// before the peek first changed it, so that the peek can be
+	// undone without copying the whole history.  Null otherwise.
+	ExecInfoHistory* exec_info_undo;
+	// Contents of the "blob_index" file, once loaded.  Shared
+	// with clones.
+	std::shared_ptr<const std::map<hash128, blob_index_entry> > blob_index;
+	// Where reading starts, if |has_start_snapshot|.
+	bool has_start_snapshot;
+	snapshot_index_entry start_snapshot;
 };
 
 #endif /* RR_TRACE_H_ */
@@ -96,8 +96,33 @@ struct flags {
 	bool raw_dump;
 	// Only open a debug socket, don't launch the debugger too.
 	bool dont_launch_debugger;
+	// Replay without a debugger, start to finish.
+	bool autopilot;
 	// Pass this file name to debugger with -x
 	std::string gdb_command_file_path;
+	// Store each distinct large raw data payload in the trace
+	// only once.
+	bool dedup_data;
+	// Start a new file for each trace stream whenever the current
+	// one reaches this many bytes.  0 means never.
+	uint64_t segment_size;
+	// If nonzero, keep only about this many bytes of the most
+	// recent trace data, starting at a snapshot of all tracees.
+	uint64_t ring_size;
+	// If nonzero, snapshot all tracees about every this many
+	// events, so that replay can start near its target event.
+	uint32_t snapshot_interval;
+	// If nonzero, tracees don't buffer reads of more than this
+	// many bytes.
+	uint32_t max_buffered_read;
+	// Adapt each task's timeslice to its mix of syscalls and
+	// timeslice interrupts, instead of using |max_rbc| and
+	// |max_events| for all tasks.
+	bool adaptive_timeslice;
+	// Patch rdtsc instructions in tracee code to call into the
+	// syscallbuf lib, which records their results without
+	// trapping to rr.
+	bool patch_rdtsc;
 
 	flags()
 	  : max_rbc(0)
@@ -122,7 +147,15 @@ struct flags {
 	  , process_created_how(0)
 	  , raw_dump(false)
 	  , dont_launch_debugger(false)
+	  , autopilot(false)
 	  , gdb_command_file_path("")
+	  , dedup_data(false)
+	  , segment_size(0)
+	  , ring_size(0)
+	  , snapshot_interval(0)
+	  , max_buffered_read(0)
+	  , adaptive_timeslice(false)
+	  , patch_rdtsc(false)
 	{}
 };
 
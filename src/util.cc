@@ -245,6 +245,8 @@ const char* syscallname(int syscall)
 		case static_cast<int>(SyscallsX86::_name): return #_name;
 #define SYSCALL_DEF0(_name, _)				\
 		CASE(_name)
+#define SYSCALL_DEF0_TRIVIAL(_name, _)	\
+		SYSCALL_DEF0(_name, _)
 #define SYSCALL_DEF1(_name, _, _1, _2)			\
 		CASE(_name)
 #define SYSCALL_DEF1_DYNSIZE(_name, _, _1, _2)		\
@@ -267,6 +269,7 @@ const char* syscallname(int syscall)
 #undef SYSCALLNO_X86
 #undef CASE
 #undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
 #undef SYSCALL_DEF1
 #undef SYSCALL_DEF1_DYNSIZE
 #undef SYSCALL_DEF1_STR
@@ -296,6 +299,8 @@ bool is_always_emulated_syscall(int syscallno)
 		case static_cast<int>(SyscallsX86::_name): return _type();
 #define SYSCALL_DEF0(_name, _type)			\
 		CASE(_name, _type)
+#define SYSCALL_DEF0_TRIVIAL(_name, _type)	\
+		SYSCALL_DEF0(_name, _type)
 #define SYSCALL_DEF1(_name, _type, _1, _2)		\
 		CASE(_name, _type)
 #define SYSCALL_DEF1_DYNSIZE(_name, _type, _1, _2)	\
@@ -322,6 +327,7 @@ bool is_always_emulated_syscall(int syscallno)
 #undef CASE
 #undef SYSCALLNO_X86
 #undef SYSCALL_DEF0
+#undef SYSCALL_DEF0_TRIVIAL
 #undef SYSCALL_DEF1
 #undef SYSCALL_DEF1_DYNSIZE
 #undef SYSCALL_DEF1_STR
@@ -1008,18 +1014,17 @@ void record_struct_msghdr(Task* t, struct msghdr* child_msghdr)
 	// Record the entire struct, because some of the direct fields
 	// are written as inoutparams.
 	t->record_local(child_msghdr, sizeof(msg), &msg);
-	t->record_remote(msg.msg_name, msg.msg_namelen);
-
-	// Read all the inout iovecs in one shot.
-	struct iovec iovs[msg.msg_iovlen];
-	t->read_bytes_helper(msg.msg_iov,
-			     msg.msg_iovlen * sizeof(iovs[0]), (byte*)iovs);
-	for (size_t i = 0; i < msg.msg_iovlen; ++i) {
-		const struct iovec* iov = &iovs[i];
-		t->record_remote(iov->iov_base, iov->iov_len);
-	}
 
-	t->record_remote(msg.msg_control, msg.msg_controllen);
+	// Read all the inout iovecs in one shot, and then record the
+	// name, the iovecs' buffers and the control data in another.
+	struct iovec ranges[msg.msg_iovlen + 2];
+	ranges[0].iov_base = msg.msg_name;
+	ranges[0].iov_len = msg.msg_namelen;
+	t->read_bytes_helper(msg.msg_iov, msg.msg_iovlen * sizeof(ranges[0]),
+			     (byte*)&ranges[1]);
+	ranges[msg.msg_iovlen + 1].iov_base = msg.msg_control;
+	ranges[msg.msg_iovlen + 1].iov_len = msg.msg_controllen;
+	t->record_remote_ranges(ranges, msg.msg_iovlen + 2);
 }
 
 void record_struct_mmsghdr(Task* t, struct mmsghdr* child_mmsghdr)
@@ -1038,23 +1043,24 @@ void restore_struct_msghdr(Task* t, struct msghdr* child_msghdr)
 	struct msghdr msg;
 	t->read_mem(child_msghdr, &msg);
 
-	// Restore msg itself.
-	t->set_data_from_trace();
-	// Restore msg.msg_name.
-	t->set_data_from_trace();
-	// For each iovec arg, restore its recorded data.
-	for (size_t i = 0; i < msg.msg_iovlen; ++i) {
-		// Restore iov_base buffer.
-		t->set_data_from_trace();
-	}
-	// Restore msg_control buffer.
-	t->set_data_from_trace();
+	// Restore msg itself, msg.msg_name, the buffer of each iovec
+	// and the msg_control buffer.
+	t->set_data_from_trace_records(msg.msg_iovlen + 3);
 }
 
-void restore_struct_mmsghdr(Task* t, struct mmsghdr* child_mmsghdr)
+void restore_struct_mmsghdrs(Task* t, struct mmsghdr* child_mmsghdrs,
+			     size_t num_mmsghdrs)
 {
-	restore_struct_msghdr(t, (struct msghdr*)child_mmsghdr);
-	t->set_data_from_trace();
+	struct mmsghdr msgs[num_mmsghdrs];
+	t->read_bytes_helper(child_mmsghdrs, sizeof(msgs), (byte*)msgs);
+
+	// Each message has the records of its msghdr, and then its
+	// msg_len.
+	size_t num_records = 0;
+	for (size_t i = 0; i < num_mmsghdrs; ++i) {
+		num_records += msgs[i].msg_hdr.msg_iovlen + 3 + 1;
+	}
+	t->set_data_from_trace_records(num_records);
 }
 
 bool is_now_contended_pi_futex(Task* t, void* futex, uint32_t* next_val)
@@ -1390,6 +1396,205 @@ void finish_remote_syscalls(Task* t, struct current_state_buffer* state)
 	t->set_regs(state->regs);
 }
 
+RemoteSyscallBatch::Arg
+RemoteSyscallBatch::push_data(const void* p, size_t num_bytes)
+{
+	size_t offset = data.size();
+	const byte* bytes = static_cast<const byte*>(p);
+	data.insert(data.end(), bytes, bytes + num_bytes);
+	// Keep later data and the results aligned.
+	data.resize((data.size() + sizeof(int32_t) - 1)
+		    & ~(sizeof(int32_t) - 1));
+	return Arg(Arg::DATA, offset);
+}
+
+RemoteSyscallBatch::Arg
+RemoteSyscallBatch::push_str(const char* str)
+{
+	return push_data(str, strlen(str) + 1/*null byte*/);
+}
+
+RemoteSyscallBatch::Arg
+RemoteSyscallBatch::add(int syscallno, Arg a1, Arg a2, Arg a3,
+			Arg a4, Arg a5, Arg a6)
+{
+	Call call = { syscallno, { a1, a2, a3, a4, a5, a6 } };
+	calls.push_back(call);
+	return Arg(Arg::RESULT, calls.size() - 1);
+}
+
+long
+RemoteSyscallBatch::result(const Arg& call) const
+{
+	assert(Arg::RESULT == call.kind && call.value < results.size());
+	return results[call.value];
+}
+
+/**
+ * Return the value of |arg| when the batch's data is at |scratch| in
+ * the tracee.  Results must already be known.
+ */
+uintptr_t
+RemoteSyscallBatch::arg_value(const Arg& arg, byte* scratch) const
+{
+	switch (arg.kind) {
+	case Arg::IMM:
+		return arg.value;
+	case Arg::DATA:
+		return uintptr_t(scratch + arg.value);
+	case Arg::RESULT:
+		return results[arg.value];
+	}
+	FATAL() <<"Unknown batch arg kind "<< arg.kind;
+	return 0;	// not reached
+}
+
+static void append_u32(vector<byte>& code, uint32_t value)
+{
+	const byte* p = reinterpret_cast<const byte*>(&value);
+	code.insert(code.end(), p, p + sizeof(value));
+}
+
+/**
+ * Append to |code| the instructions that make syscall |i| and store
+ * its result.  Results of syscalls before |first| are known, and are
+ * passed as constants; later ones are loaded from where the stub
+ * stored them.
+ */
+void
+RemoteSyscallBatch::append_stub_call(vector<byte>& code, size_t i,
+				     size_t first, byte* scratch) const
+{
+	// Encodings of $ebx, $ecx, $edx, $esi, $edi and $ebp, which
+	// pass the syscall args, in that order.
+	static const byte arg_regs[] = { 3, 1, 2, 6, 7, 5 };
+	byte* stored_results = scratch + data.size();
+	const Call& call = calls[i];
+
+	code.push_back(0xb8);	// mov $syscallno, %eax
+	append_u32(code, call.syscallno);
+	for (size_t j = 0; j < ALEN(arg_regs); ++j) {
+		const Arg& arg = call.args[j];
+		if (Arg::RESULT == arg.kind && arg.value >= first) {
+			assert(arg.value < i);
+			// mov result, %reg
+			code.push_back(0x8b);
+			code.push_back((arg_regs[j] << 3) | 5);
+			append_u32(code, uintptr_t(stored_results
+						   + arg.value * sizeof(int32_t)));
+		} else {
+			// mov $value, %reg
+			code.push_back(0xb8 + arg_regs[j]);
+			append_u32(code, arg_value(arg, scratch));
+		}
+	}
+	code.insert(code.end(), syscall_insn,
+		    syscall_insn + sizeof(syscall_insn));
+	code.push_back(0xa3);	// mov %eax, result
+	append_u32(code, uintptr_t(stored_results + i * sizeof(int32_t)));
+}
+
+/**
+ * Run as many syscalls starting at |first| as fit in a stub at the
+ * remote-syscall site, and return the index of the next syscall to
+ * run.
+ */
+size_t
+RemoteSyscallBatch::run_stub(Task* t, struct current_state_buffer* state,
+			     size_t first, byte* scratch)
+{
+	byte* code_addr = (byte*)state->start_addr;
+	const AddressSpace::MemoryMap& mem = t->vm()->memmap();
+	auto it = mem.find(Mapping(code_addr, 1));
+	size_t avail = 0;
+	if (it != mem.end() && (PROT_EXEC & it->first.prot)) {
+		avail = MIN(size_t((byte*)it->first.end - code_addr),
+			    page_size());
+	}
+
+	vector<byte> code;
+	size_t end = first;
+	for (; end < calls.size(); ++end) {
+		size_t size = code.size();
+		append_stub_call(code, end, first, scratch);
+		// Leave room for the final trap.
+		if (code.size() + 1 > avail) {
+			code.resize(size);
+			break;
+		}
+	}
+	if (end == first) {
+		// Not even one syscall fits, so make it the usual
+		// way.
+		const Call& call = calls[first];
+		long args[ALEN(call.args)];
+		for (size_t j = 0; j < ALEN(args); ++j) {
+			args[j] = arg_value(call.args[j], scratch);
+		}
+		results[first] = remote_syscall(t, state, WAIT,
+						call.syscallno,
+						args[0], args[1], args[2],
+						args[3], args[4], args[5]);
+		return first + 1;
+	}
+	code.push_back(AddressSpace::breakpoint_insn);
+
+	vector<byte> saved_code(code.size());
+	t->read_bytes_helper(code_addr, saved_code.size(), saved_code.data());
+	t->write_bytes_helper(code_addr, code.size(), code.data());
+
+	Registers r = state->regs;
+	r.set_ip(uintptr_t(code_addr));
+	r.set_sp(uintptr_t(scratch));
+	t->set_regs(r);
+	do {
+		t->cont();
+	} while (t->is_ptrace_seccomp_event() || SIGCHLD == t->pending_sig());
+	ASSERT(t, (SIGTRAP == t->pending_sig()
+		   && t->ip() == code_addr + code.size()))
+		<<"Batched syscalls stopped at "<< t->ip() <<" with "
+		<< signalname(t->pending_sig()) <<", expected trap at "
+		<< (void*)(code_addr + code.size());
+
+	t->write_bytes_helper(code_addr, saved_code.size(), saved_code.data());
+
+	vector<int32_t> stored(end - first);
+	t->read_bytes_helper(scratch + data.size() + first * sizeof(int32_t),
+			     stored.size() * sizeof(int32_t),
+			     (byte*)stored.data());
+	copy(stored.begin(), stored.end(), results.begin() + first);
+	return end;
+}
+
+void
+RemoteSyscallBatch::run(Task* t, struct current_state_buffer* state)
+{
+	assert(t->tid == state->pid);
+
+	results.assign(calls.size(), 0);
+	if (calls.empty()) {
+		return;
+	}
+
+	// The data and the results go just below the stack pointer,
+	// like tmp mem.
+	size_t scratch_size = data.size() + calls.size() * sizeof(int32_t);
+	byte* scratch = (byte*)((state->regs.sp() - scratch_size)
+				& ~uintptr_t(sizeof(int32_t) - 1));
+	vector<byte> saved(scratch_size);
+	t->read_bytes_helper(scratch, saved.size(), saved.data());
+	if (!data.empty()) {
+		t->write_bytes_helper(scratch, data.size(), data.data());
+	}
+
+	for (size_t i = 0; i < calls.size(); ) {
+		i = run_stub(t, state, i, scratch);
+	}
+
+	t->write_bytes_helper(scratch, saved.size(), saved.data());
+	t->set_regs(state->regs);
+}
+
 void destroy_buffers(Task* t)
 {
 	// NB: we have to pay all this complexity here because glibc
@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include <ostream>
+#include <vector>
 
 #include "registers.h"
 #include "types.h"
@@ -373,8 +374,12 @@ void record_struct_mmsghdr(Task* t, struct mmsghdr* child_mmsghdr);
  * |child_msghdr_ptr|.
  */
 void restore_struct_msghdr(Task* t, struct msghdr* child_msghdr);
-/** Like restore_struct_msghdr(), but for mmsghdr. */
-void restore_struct_mmsghdr(Task* t, struct mmsghdr* child_mmsghdr);
+/**
+ * Like restore_struct_msghdr(), but for the array of |num_mmsghdrs|
+ * mmsghdrs at |child_mmsghdrs|.
+ */
+void restore_struct_mmsghdrs(Task* t, struct mmsghdr* child_mmsghdrs,
+			     size_t num_mmsghdrs);
 
 /**
  * Return true if a FUTEX_LOCK_PI operation on |futex| done by |t|
@@ -520,6 +525,84 @@ void finish_remote_syscalls(Task* t, struct current_state_buffer* state);
 #define remote_syscall0(_c, _s, _no)		\
 	remote_syscall1(_c, _s, _no, 0)
 
+/**
+ * A sequence of syscalls to make in a tracee prepared for remote
+ * syscalls, without stopping between them.  Making syscalls one at a
+ * time with |remote_syscall()| costs a register update and two ptrace
+ * stops per syscall.  A batch instead writes a stub into the tracee
+ * at the remote-syscall site that makes all its syscalls and then
+ * traps, so that the whole batch costs one resume.  Data the
+ * syscalls need is copied into the tracee in one write, rather than
+ * pushed with |push_tmp_mem()| piece by piece.
+ *
+ * Syscall arguments can be constants, addresses of data pushed with
+ * |push_data()|, or results of earlier syscalls in the batch.  The
+ * results are available with |result()| after |run()|.  A failing
+ * syscall doesn't stop the batch, so callers must check results in
+ * order and treat the results of syscalls after a failure that they
+ * depend on as meaningless.
+ *
+ * If the code at the remote-syscall site isn't followed by enough
+ * executable memory for a stub, the batch is run in pieces, and
+ * syscalls that don't fit at all are made by |remote_syscall()|.
+ */
+class RemoteSyscallBatch {
+public:
+	struct Arg {
+		enum Kind { IMM, DATA, RESULT };
+
+		template<typename T>
+		Arg(T value) : kind(IMM), value(uintptr_t(value)) {}
+		Arg(Kind kind, uintptr_t value) : kind(kind), value(value) {}
+
+		Kind kind;
+		// The constant, the offset of the pushed data, or the
+		// index of the syscall.
+		uintptr_t value;
+	};
+
+	/**
+	 * Copy |num_bytes| of |data| into the tracee when the batch
+	 * runs, and return an argument that passes its address.
+	 */
+	Arg push_data(const void* data, size_t num_bytes);
+	/** Like |push_data()|, for |str| including its '\0' byte. */
+	Arg push_str(const char* str);
+
+	/**
+	 * Append the syscall |syscallno| to the batch.  Return an
+	 * argument that passes its result to later syscalls, which
+	 * can also be passed to |result()|.
+	 */
+	Arg add(int syscallno, Arg a1 = 0, Arg a2 = 0, Arg a3 = 0,
+		Arg a4 = 0, Arg a5 = 0, Arg a6 = 0);
+
+	/**
+	 * Make the syscalls of this batch in |t|, which must have
+	 * been prepared for remote syscalls in |state|.
+	 */
+	void run(Task* t, struct current_state_buffer* state);
+
+	/** Return the result of |call|, which |add()| returned. */
+	long result(const Arg& call) const;
+
+private:
+	struct Call {
+		int syscallno;
+		Arg args[6];
+	};
+
+	uintptr_t arg_value(const Arg& arg, byte* scratch) const;
+	void append_stub_call(std::vector<byte>& code, size_t i,
+			      size_t first, byte* scratch) const;
+	size_t run_stub(Task* t, struct current_state_buffer* state,
+			size_t first, byte* scratch);
+
+	std::vector<Call> calls;
+	std::vector<byte> data;
+	std::vector<long> results;
+};
+
 /**
  * At thread exit time, undo the work that init_buffers() did.
  *